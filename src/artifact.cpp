@@ -3,50 +3,476 @@
 #include "artifact.h"
 
 #include "conf.h"
+#include "log.h"
+#include "store.h"
 
+#include <dirent.h>
+#include <fcntl.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
-#include <algorithm>
-
-#include <list>
+#include <map>
+#include <set>
+#include <vector>
 
 #include <boost/property_tree/ptree.hpp>
 #include <boost/property_tree/json_parser.hpp>
 #include <boost/lexical_cast.hpp>
-#include <boost/filesystem.hpp>
+#include <boost/thread.hpp>
 
-using namespace boost::filesystem;
 using boost::property_tree::ptree;
 
-/* ubuntu 10.04 includes boost 1.40, which has boost::filesystem API
-   2. 11.10 includes API 3. rather than demand and upgraded or
-   downgraded boost, I tried to write code that works with both. this
-   wrapper is needed to get a filename from an iterator.
-*/
 
-static string filename( const vector<path>::const_iterator & i )
+// what the cache knows about one artifact file
+struct CachedArtifact
 {
-#if defined(BOOST_FILESYSTEM_VERSION) && BOOST_FILESYSTEM_VERSION == 3
-    return i->filename().native();
-#else
-    return i->filename();
-#endif
-}
+    // Expected means that a service wants it, but it's not here yet
+    enum State { Expected, Downloaded, Installed };
+
+    CachedArtifact(): bytes( 0 ), used( 0 ), refs( 0 ), state( Expected ) {}
+
+    unsigned long long bytes;
+    time_t used;
+    int refs;
+    State state;
+    string sha256;
+};
+
+
+static boost::mutex mutex;
+static std::map<string, CachedArtifact> cache;
+static std::map<string, unsigned long long> trees;
+static unsigned long long total = 0;
+static string loaded;
+static int logFd = -1;
+static unsigned int logged = 0;
 
 
 /*! \class Artifact artifact.h
 
     The Artifact class is a namespace class to gather various
     artifact-related functions and keep them from being globals.
-    
-    At the moment list() is the only function.
+
+    Apart from list(), it manages the artifact cache: The downloaded
+    files in the artefact directory and the trees the Store unpacks
+    them into. Without management, those would grow forever.
+
+    The cache knows the size of each artifact (file and tree
+    together), when it was last used, and how many Process objects use
+    it. Launcher calls acquire() when it launches a service and Init
+    calls release() soon after it forgets the Process, and an artifact with
+    references is never removed. Launcher calls record() once an
+    artifact is installed, and then trim(), which removes the least
+    recently used unreferenced artifacts until the cache fits within
+    quota(). uninstall() removes one artifact, if it's not in use.
+
+    The cache is kept in the artefact directory, as a snapshot
+    (.index) and a log of changes since (.index.log). Each line is a
+    record: "A name\tbytes\tsha256\tstate\tused" describes an
+    artifact, "R name" says it's gone, "T sha256\tbytes" describes a
+    tree in the Store and "X sha256" says that's gone. Records are
+    appended to the log as things change, and when the log grows much
+    longer than the index, the whole index is written as a new
+    snapshot and the log is emptied. Replaying a record twice does no
+    harm, so a crash between those two steps is harmless.
+
+    Both files are read once, the first time the cache is needed, and
+    after that list() and the rest look only at memory. If neither
+    exists, the cache scans the artefact directory once and writes a
+    snapshot. Files that appear later without nodee's help aren't
+    noticed. The scan doesn't know which tree belongs to which file,
+    and finds out by computing the file's SHA-256 sum if it wants to
+    remove the file.
 */
 
 
+static string cacheDirectory()
+{
+    return Conf::artefactDirectory();
+}
+
+
+static string indexName()
+{
+    return cacheDirectory() + "/.index";
+}
+
+
+// returns the size of the files in d and its subdirectories
+static unsigned long long treeSize( const string & d )
+{
+    unsigned long long n = 0;
+    DIR * dir = ::opendir( d.c_str() );
+    if ( !dir )
+	return 0;
+    struct dirent * e;
+    while ( ( e = ::readdir( dir ) ) != 0 ) {
+	string name = e->d_name;
+	if ( name == "." || name == ".." )
+	    continue;
+	string p = d + "/" + name;
+	struct stat st;
+	if ( ::lstat( p.c_str(), &st ) < 0 )
+	    continue;
+	if ( S_ISDIR( st.st_mode ) )
+	    n += treeSize( p );
+	else
+	    n += st.st_size;
+    }
+    ::closedir( dir );
+    return n;
+}
+
+
+static bool temporary( const string & name )
+{
+    return name.size() > 4 && name.substr( name.size() - 4 ) == ".tmp";
+}
+
+
+// returns true if name can be an artifact file: a plain file name
+// that's not one of ours, and that can go in an index record as is
+static bool plain( const string & name )
+{
+    if ( name.empty() || name[0] == '.' || name.find( '/' ) != string::npos )
+	return false;
+    string::const_iterator c = name.begin();
+    while ( c != name.end() ) {
+	if ( (unsigned char)*c < 32 || *c == 127 )
+	    return false;
+	++c;
+    }
+    return true;
+}
+
+
+// returns the index record describing name
+static string describe( const string & name, const CachedArtifact & a )
+{
+    return "A " + name +
+	"\t" + boost::lexical_cast<string>( a.bytes ) +
+	"\t" + ( a.sha256.empty() ? string( "-" ) : a.sha256 ) +
+	"\t" + ( a.state == CachedArtifact::Installed
+		 ? "installed" : "downloaded" ) +
+	"\t" + boost::lexical_cast<string>( a.used ) + "\n";
+}
+
+
+static string describe( const string & sha256, unsigned long long bytes )
+{
+    return "T " + sha256 + "\t" + boost::lexical_cast<string>( bytes ) +
+	"\n";
+}
+
+
+// reads all of the file name into contents, in one read if possible
+static bool slurp( const string & name, string & contents )
+{
+    int fd = ::open( name.c_str(), O_RDONLY | O_CLOEXEC );
+    if ( fd < 0 )
+	return false;
+    struct stat st;
+    if ( ::fstat( fd, &st ) == 0 && st.st_size > 0 ) {
+	contents.resize( st.st_size );
+	off_t n = 0;
+	int r = 1;
+	while ( n < st.st_size && r > 0 ) {
+	    r = ::read( fd, &contents[n], st.st_size - n );
+	    if ( r > 0 )
+		n += r;
+	}
+	contents.resize( n );
+    }
+    ::close( fd );
+    return true;
+}
+
+
+// splits s at each tab
+static std::vector<string> fields( const string & s )
+{
+    std::vector<string> r;
+    string::size_type b = 0;
+    while ( true ) {
+	string::size_type e = s.find( '\t', b );
+	if ( e == string::npos ) {
+	    r.push_back( s.substr( b ) );
+	    return r;
+	}
+	r.push_back( s.substr( b, e - b ) );
+	b = e + 1;
+    }
+}
+
+
+// the next seven functions expect the caller to hold the mutex.
+// replay() applies index records and returns how many there were,
+// compact() writes a snapshot, note() appends a record to the log,
+// scan() looks at the artefact directory and load() reads the index
+// if it hasn't already. evictTree() and evict() forget a tree or an
+// artifact, and add what needs to be deleted to doomed.
+
+static unsigned int replay( const string & s )
+{
+    unsigned int n = 0;
+    string::size_type b = 0;
+    string::size_type e;
+    // a line without a newline was cut short by a crash
+    while ( ( e = s.find( '\n', b ) ) != string::npos ) {
+	string line = s.substr( b, e - b );
+	b = e + 1;
+	n++;
+	if ( line.size() < 3 || line[1] != ' ' )
+	    continue;
+	std::vector<string> f = fields( line.substr( 2 ) );
+	if ( line[0] == 'A' && f.size() == 5 ) {
+	    CachedArtifact & a = cache[f[0]];
+	    a.bytes = ::strtoull( f[1].c_str(), 0, 10 );
+	    a.sha256 = f[2] == "-" ? string() : f[2];
+	    a.state = f[3] == "installed" ? CachedArtifact::Installed
+					  : CachedArtifact::Downloaded;
+	    a.used = ::strtol( f[4].c_str(), 0, 10 );
+	} else if ( line[0] == 'R' ) {
+	    cache.erase( f[0] );
+	} else if ( line[0] == 'T' && f.size() == 2 ) {
+	    trees[f[0]] = ::strtoull( f[1].c_str(), 0, 10 );
+	} else if ( line[0] == 'X' ) {
+	    trees.erase( f[0] );
+	}
+    }
+    return n;
+}
+
+
+static void compact()
+{
+    string s;
+    std::map<string, CachedArtifact>::iterator i = cache.begin();
+    while ( i != cache.end() ) {
+	if ( i->second.state != CachedArtifact::Expected )
+	    s += describe( i->first, i->second );
+	++i;
+    }
+    std::map<string, unsigned long long>::iterator t = trees.begin();
+    while ( t != trees.end() ) {
+	s += describe( t->first, t->second );
+	++t;
+    }
+
+    string tmp = indexName() + ".tmp";
+    int fd = ::open( tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+		     0644 );
+    bool ok = fd >= 0;
+    unsigned int n = 0;
+    while ( ok && n < s.size() ) {
+	int w = ::write( fd, s.data() + n, s.size() - n );
+	ok = w > 0;
+	n += w;
+    }
+    ok = ok && ::fsync( fd ) == 0;
+    if ( fd >= 0 )
+	::close( fd );
+    if ( !ok || ::rename( tmp.c_str(), indexName().c_str() ) < 0 ) {
+	debug << "nodee: Could not write " << indexName() << endl;
+	::unlink( tmp.c_str() );
+	return;
+    }
+    if ( logFd >= 0 )
+	(void)::ftruncate( logFd, 0 );
+    else
+	(void)::truncate( ( indexName() + ".log" ).c_str(), 0 );
+    logged = 0;
+}
+
+
+static void note( const string & record )
+{
+    if ( logFd < 0 )
+	logFd = ::open( ( indexName() + ".log" ).c_str(),
+			O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644 );
+    if ( logFd < 0 ||
+	 ::write( logFd, record.data(), record.size() ) !=
+	 (int)record.size() )
+	debug << "nodee: Could not write " << indexName() << ".log" << endl;
+    if ( ++logged > 1000 && logged > 2 * ( cache.size() + trees.size() ) )
+	compact();
+}
+
+
+static void scan()
+{
+    DIR * dir = ::opendir( cacheDirectory().c_str() );
+    struct dirent * e;
+    while ( dir && ( e = ::readdir( dir ) ) != 0 ) {
+	string name = e->d_name;
+	struct stat st;
+	if ( !plain( name ) || temporary( name ) ||
+	     ::stat( ( cacheDirectory() + "/" + name ).c_str(), &st ) < 0 ||
+	     !S_ISREG( st.st_mode ) )
+	    continue;
+	CachedArtifact & a = cache[name];
+	a.bytes = st.st_size;
+	a.used = st.st_mtime;
+	a.state = CachedArtifact::Downloaded;
+    }
+    if ( dir )
+	::closedir( dir );
+
+    dir = ::opendir( Store::directory().c_str() );
+    while ( dir && ( e = ::readdir( dir ) ) != 0 ) {
+	string name = e->d_name;
+	if ( name[0] != '.' && !temporary( name ) )
+	    trees[name] = treeSize( Store::tree( name ) );
+    }
+    if ( dir )
+	::closedir( dir );
+}
+
+
+static void load()
+{
+    if ( loaded == cacheDirectory() )
+	return;
+    loaded = cacheDirectory();
+    cache.clear();
+    trees.clear();
+    total = 0;
+    if ( logFd >= 0 )
+	::close( logFd );
+    logFd = -1;
+    logged = 0;
+
+    string snapshot;
+    string log;
+    bool s = slurp( indexName(), snapshot );
+    bool l = slurp( indexName() + ".log", log );
+    if ( s || l ) {
+	replay( snapshot );
+	logged = replay( log );
+    } else {
+	scan();
+	compact();
+    }
+
+    std::map<string, CachedArtifact>::iterator i = cache.begin();
+    while ( i != cache.end() ) {
+	total += i->second.bytes;
+	++i;
+    }
+    std::map<string, unsigned long long>::iterator t = trees.begin();
+    while ( t != trees.end() ) {
+	total += t->second;
+	++t;
+    }
+
+    // extractions that didn't finish leave staging directories behind
+    DIR * dir = ::opendir( Store::directory().c_str() );
+    struct dirent * e;
+    while ( dir && ( e = ::readdir( dir ) ) != 0 ) {
+	string name = e->d_name;
+	if ( temporary( name ) )
+	    Store::remove( Store::directory() + "/" + name );
+    }
+    if ( dir )
+	::closedir( dir );
+}
+
+
+static void evictTree( const string & sha256, std::vector<string> & doomed )
+{
+    std::map<string, unsigned long long>::iterator t = trees.find( sha256 );
+    if ( t == trees.end() )
+	return;
+    total -= t->second;
+    trees.erase( t );
+    note( "X " + sha256 + "\n" );
+    // renaming is quick, so the tree is gone before anyone else can
+    // look for it. deleting it may take a while.
+    string s = Store::staging( sha256 );
+    if ( s.empty() )
+	doomed.push_back( Store::tree( sha256 ) );
+    else if ( ::rename( Store::tree( sha256 ).c_str(), s.c_str() ) == 0 )
+	doomed.push_back( s );
+    else {
+	doomed.push_back( s );
+	doomed.push_back( Store::tree( sha256 ) );
+    }
+}
+
+
+static void evict( const string & name, std::vector<string> & doomed )
+{
+    std::map<string, CachedArtifact>::iterator i = cache.find( name );
+    if ( i == cache.end() )
+	return;
+    string sha256 = i->second.sha256;
+    total -= i->second.bytes;
+    cache.erase( i );
+    note( "R " + name + "\n" );
+    ::unlink( ( cacheDirectory() + "/" + name ).c_str() );
+    if ( sha256.empty() )
+	return;
+    // another file may have the same contents, and use the same tree
+    i = cache.begin();
+    while ( i != cache.end() ) {
+	if ( i->second.sha256 == sha256 )
+	    return;
+	++i;
+    }
+    evictTree( sha256, doomed );
+}
+
+
+// removes name from the cache, unless it's in use
+static Artifact::Result discard( const string & name )
+{
+    string sha256;
+    {
+	boost::lock_guard<boost::mutex> lock( mutex );
+	load();
+	std::map<string, CachedArtifact>::iterator i = cache.find( name );
+	if ( i == cache.end() || i->second.state == CachedArtifact::Expected )
+	    return Artifact::NoSuchArtifact;
+	if ( i->second.refs )
+	    return Artifact::InUse;
+	sha256 = i->second.sha256;
+    }
+
+    // we need the digest to find the tree, and it may take a while
+    string md5;
+    if ( sha256.empty() )
+	(void)Store::digests( cacheDirectory() + "/" + name, md5, sha256 );
+
+    std::vector<string> doomed;
+    {
+	boost::lock_guard<boost::mutex> lock( mutex );
+	std::map<string, CachedArtifact>::iterator i = cache.find( name );
+	if ( i == cache.end() )
+	    return Artifact::NoSuchArtifact;
+	if ( i->second.refs )
+	    return Artifact::InUse;
+	if ( i->second.sha256.empty() )
+	    i->second.sha256 = sha256;
+	evict( name, doomed );
+    }
+    std::vector<string>::iterator d = doomed.begin();
+    while ( d != doomed.end() ) {
+	Store::remove( *d );
+	++d;
+    }
+    return Artifact::Uninstalled;
+}
+
+
 /*! Returns a json object containing a list of installed artifacts.
     Format to be decided later; I don't think this is useful, so I'll
     just do something and if we turn out to need it, but different,
     we'll know how by then.
+
+    The list comes from the cache's index, so the artefact directory
+    isn't read.
 */
 
 string Artifact::list()
@@ -54,18 +480,13 @@ string Artifact::list()
     ostringstream os;
     ptree pt;
 
-    vector<path> sorted;
-
-    copy( directory_iterator( Conf::artefactdir ),
-	  directory_iterator(),
-	  back_inserter( sorted ) );
-    sort( sorted.begin(), sorted.end() );
-
-    vector<path>::const_iterator i = sorted.begin();
+    boost::lock_guard<boost::mutex> lock( mutex );
+    load();
+    std::map<string, CachedArtifact>::const_iterator i = cache.begin();
     int n = 1;
-    while ( i != sorted.end() ) {
-	if ( is_regular_file( *i ) ) {
-	    pt.put( boost::lexical_cast<string>( n ), filename( i ) );
+    while ( i != cache.end() ) {
+	if ( i->second.state != CachedArtifact::Expected ) {
+	    pt.put( boost::lexical_cast<string>( n ), i->first );
 	    n++;
 	}
 	++i;
@@ -74,3 +495,224 @@ string Artifact::list()
     write_json( os, pt );
     return os.str();
 }
+
+
+/*! Records that a Process uses the artifact file \a name, so that
+    it's not removed from the cache until release() is called. The
+    file need not exist yet. Names that can't be artifact files, such
+    as ones with a slash or a control character, are ignored.
+*/
+
+void Artifact::acquire( const string & name )
+{
+    if ( !plain( name ) )
+	return;
+    boost::lock_guard<boost::mutex> lock( mutex );
+    load();
+    CachedArtifact & a = cache[name];
+    a.refs++;
+    a.used = ::time( 0 );
+}
+
+
+/*! Records that a Process no longer uses the artifact file \a
+    name. If nothing else does, it may now be removed.
+*/
+
+void Artifact::release( const string & name )
+{
+    boost::lock_guard<boost::mutex> lock( mutex );
+    std::map<string, CachedArtifact>::iterator i = cache.find( name );
+    if ( i == cache.end() )
+	return;
+    if ( i->second.refs > 0 )
+	i->second.refs--;
+    i->second.used = ::time( 0 );
+    if ( i->second.state != CachedArtifact::Expected )
+	note( describe( name, i->second ) );
+    else if ( !i->second.refs )
+	cache.erase( i ); // it never arrived
+}
+
+
+/*! Records that the artifact file \a name has been downloaded and
+    installed in the Store, and that its SHA-256 sum is \a sha256.
+    The cache looks at the sizes of both the file and the Store's
+    tree. Like acquire(), this ignores names that can't be artifact
+    files.
+*/
+
+void Artifact::record( const string & name, const string & sha256 )
+{
+    if ( !plain( name ) )
+	return;
+    unsigned long long size = 0;
+    struct stat st;
+    if ( ::stat( ( cacheDirectory() + "/" + name ).c_str(), &st ) == 0 )
+	size = st.st_size;
+
+    bool known;
+    {
+	boost::lock_guard<boost::mutex> lock( mutex );
+	load();
+	known = sha256.empty() || trees.find( sha256 ) != trees.end();
+    }
+    unsigned long long tree = known ? 0 : treeSize( Store::tree( sha256 ) );
+
+    boost::lock_guard<boost::mutex> lock( mutex );
+    CachedArtifact & a = cache[name];
+    total = total - a.bytes + size;
+    a.bytes = size;
+    a.used = ::time( 0 );
+    a.state = CachedArtifact::Installed;
+    if ( !sha256.empty() )
+	a.sha256 = sha256;
+    note( describe( name, a ) );
+    if ( !known && trees.find( sha256 ) == trees.end() ) {
+	trees[sha256] = tree;
+	total += tree;
+	note( describe( sha256, tree ) );
+    }
+}
+
+
+/*! Removes the least recently used artifacts until the cache fits
+    within quota(). Artifacts that are in use are not removed, even
+    if that means going over quota.
+
+    If all the remaining artifacts are in use, trees that no artifact
+    file refers to are removed as well.
+*/
+
+void Artifact::trim()
+{
+    unsigned long long limit = quota();
+    if ( !limit )
+	return;
+
+    while ( true ) {
+	string victim;
+	std::vector<string> doomed;
+	{
+	    boost::lock_guard<boost::mutex> lock( mutex );
+	    load();
+	    if ( total <= limit )
+		return;
+	    time_t oldest = 0;
+	    bool certain = true;
+	    std::set<string> needed;
+	    std::map<string, CachedArtifact>::iterator i = cache.begin();
+	    while ( i != cache.end() ) {
+		if ( !i->second.refs &&
+		     ( victim.empty() || i->second.used < oldest ) ) {
+		    victim = i->first;
+		    oldest = i->second.used;
+		}
+		if ( i->second.sha256.empty() )
+		    certain = false;
+		needed.insert( i->second.sha256 );
+		++i;
+	    }
+	    if ( victim.empty() && certain ) {
+		std::vector<string> orphans;
+		std::map<string, unsigned long long>::iterator t
+		    = trees.begin();
+		while ( t != trees.end() ) {
+		    if ( !needed.count( t->first ) )
+			orphans.push_back( t->first );
+		    ++t;
+		}
+		std::vector<string>::iterator o = orphans.begin();
+		while ( o != orphans.end() ) {
+		    evictTree( *o, doomed );
+		    ++o;
+		}
+	    }
+	    if ( victim.empty() && doomed.empty() ) {
+		debug << "nodee: Artifacts use " << total
+		      << " bytes, more than the quota, but all are in use"
+		      << endl;
+		return;
+	    }
+	}
+
+	if ( !victim.empty() ) {
+	    debug << "nodee: Removing artifact " << victim
+		  << " to stay within quota" << endl;
+	    (void)discard( victim );
+	}
+	std::vector<string>::iterator d = doomed.begin();
+	while ( d != doomed.end() ) {
+	    Store::remove( *d );
+	    ++d;
+	}
+    }
+}
+
+
+/*! Removes the artifact file \a name and (unless another file has
+    the same contents) its tree from the cache, and returns
+    Uninstalled. If \a name is in use, nothing is removed and InUse is
+    returned, and if there's no such artifact, NoSuchArtifact.
+*/
+
+Artifact::Result Artifact::uninstall( const string & name )
+{
+    if ( !plain( name ) )
+	return NoSuchArtifact;
+    return discard( name );
+}
+
+
+/*! Returns true if the artifact file \a name has been downloaded,
+    checked and installed, so it can be given to others, and false if
+    not, or if \a name isn't a plain file name.
+*/
+
+bool Artifact::available( const string & name )
+{
+    if ( !plain( name ) )
+	return false;
+    boost::lock_guard<boost::mutex> lock( mutex );
+    load();
+    std::map<string, CachedArtifact>::iterator i = cache.find( name );
+    return i != cache.end() && i->second.state != CachedArtifact::Expected;
+}
+
+
+/*! Returns the number of Process objects using the artifact file \a
+    name.
+*/
+
+int Artifact::references( const string & name )
+{
+    boost::lock_guard<boost::mutex> lock( mutex );
+    std::map<string, CachedArtifact>::iterator i = cache.find( name );
+    if ( i == cache.end() )
+	return 0;
+    return i->second.refs;
+}
+
+
+/*! Returns the number of bytes used by the artifact cache, both
+    files and unpacked trees.
+*/
+
+unsigned long long Artifact::bytes()
+{
+    boost::lock_guard<boost::mutex> lock( mutex );
+    load();
+    return total;
+}
+
+
+/*! Returns the number of bytes the artifact cache may use, or 0 if
+    there is no limit. Conf::artefactquota is in megabytes.
+*/
+
+unsigned long long Artifact::quota()
+{
+    if ( Conf::artefactquota <= 0 )
+	return 0;
+    return Conf::artefactquota * 1024ULL * 1024;
+}
@@ -9,6 +9,19 @@ class Artifact
 {
 public:
     static string list();
+
+    static void acquire( const string & );
+    static void release( const string & );
+    static void record( const string &, const string & );
+    static void trim();
+
+    enum Result { Uninstalled, InUse, NoSuchArtifact };
+    static Result uninstall( const string & );
+
+    static bool available( const string & );
+    static int references( const string & );
+    static unsigned long long bytes();
+    static unsigned long long quota();
 };
 
 
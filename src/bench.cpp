@@ -0,0 +1,303 @@
+// Copyright Arnt Gulbrandsen <arnt@gulbrandsen.priv.no>; BSD-licensed.
+
+// nodeebench measures how long it takes to start a child process, as
+// nodee grows. It starts /bin/true many times using Spawn and using
+// plain fork()+exec, with varying numbers of idle threads and varying
+// amounts of touched memory, and prints the average latency of each.
+//
+// Given "proc" as first argument, it instead measures how long
+// ChoreKeeper takes to scan a synthetic /proc with many processes,
+// and how long the same scan took with ifstream and boost::tokenizer.
+//
+// Usage: nodeebench [megabytes [iterations]]
+//        nodeebench proc [processes [iterations]]
+
+#include "spawn.h"
+#include "chorekeeper.h"
+
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <map>
+#include <vector>
+
+#include <dirent.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#include <boost/thread.hpp>
+#include <boost/bind.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/tokenizer.hpp>
+
+
+static boost::mutex mutex;
+static boost::condition_variable done;
+static bool finished = false;
+
+
+static void idle()
+{
+    boost::unique_lock<boost::mutex> lock( mutex );
+    while ( !finished )
+	done.wait( lock );
+}
+
+
+static double now()
+{
+    struct timeval tv;
+    ::gettimeofday( &tv, 0 );
+    return tv.tv_sec * 1000000.0 + tv.tv_usec;
+}
+
+
+static void reap( int pid )
+{
+    int status;
+    while ( ::waitpid( pid, &status, 0 ) < 0 && errno == EINTR )
+	;
+}
+
+
+// returns the average number of microseconds until the parent can go
+// on with its work, which is what matters to nodee.
+
+static double viaSpawn( int iterations )
+{
+    double total = 0;
+    int i = 0;
+    while ( i < iterations ) {
+	Spawn s;
+	s.setProgram( "/bin/true" );
+	double before = now();
+	int pid = s.run();
+	total += now() - before;
+	if ( s.pidfd() >= 0 )
+	    ::close( s.pidfd() );
+	reap( pid );
+	i++;
+    }
+    return total / iterations;
+}
+
+
+static double viaFork( int iterations )
+{
+    double total = 0;
+    int i = 0;
+    while ( i < iterations ) {
+	char * args[2];
+	args[0] = const_cast<char*>( "/bin/true" );
+	args[1] = 0;
+	double before = now();
+	int pid = ::fork();
+	if ( pid == 0 ) {
+	    ::execv( args[0], args );
+	    ::_exit( 127 );
+	}
+	total += now() - before;
+	reap( pid );
+	i++;
+    }
+    return total / iterations;
+}
+
+
+// writes a /proc-like tree with the given number of processes to
+// dir. each process' parent is one of the processes before it, so
+// there's a tree several levels deep.
+
+static void makeProc( const std::string & dir, int processes )
+{
+    boost::filesystem::remove_all( dir );
+    boost::filesystem::create_directories( dir );
+    int i = 0;
+    while ( i < processes ) {
+	int pid = 1000 + i;
+	int ppid = i ? 1000 + ( i - 1 ) / 4 : 1;
+	std::string d = dir + "/" + boost::lexical_cast<std::string>( pid );
+	boost::filesystem::create_directory( d );
+	std::ofstream f( ( d + "/stat" ).c_str() );
+	f << pid << " (worker " << i << ") S " << ppid
+	  << " 1 1 0 -1 4202752 15766 23427027 " << i % 50 << " " << i % 7
+	  << " 129 133 929507 187524 20 0 1 0 3 24895488 " << 100 + i
+	  << " 18446744073709551615 1 1 0 0 0 0 0 4096 671180323"
+	  << " 18446744073709551615 0 0 0 1 0 0 4 0 0" << std::endl;
+	i++;
+    }
+    std::ofstream v( ( dir + "/vmstat" ).c_str() );
+    v << "nr_free_pages 741357\nnr_inactive_anon 8197\n"
+	"nr_active_anon 199740\npgpgin 1180454\npgpgout 4243148\n"
+	"pgmajfault 8364\npgrefill_dma 0\npgsteal_dma 0\n";
+}
+
+
+// the way ChoreKeeper used to read /proc, for comparison: an
+// ifstream and a tokenizer per process, and a lexical_cast per field.
+
+static RunningProcess tokenized( std::string line )
+{
+    std::string::size_type l = line.rfind( ')' );
+    if ( l == std::string::npos )
+	return RunningProcess();
+    line = line.substr( 0, line.find( ' ' ) ) + line.substr( l + 1 );
+    boost::tokenizer<> tokens( line );
+    std::vector<std::string> f( tokens.begin(), tokens.end() );
+    RunningProcess r;
+    if ( f.size() < 23 )
+	return r;
+    r.pid = boost::lexical_cast<int>( f[0] );
+    r.ppid = boost::lexical_cast<int>( f[2] );
+    r.majflt = boost::lexical_cast<int>( f[10] ) +
+	       boost::lexical_cast<int>( f[11] );
+    r.rss = boost::lexical_cast<int>( f[22] );
+    return r;
+}
+
+
+static void scanTokenized( const std::string & dir )
+{
+    std::map<int,RunningProcess> observed;
+    boost::filesystem::directory_iterator i( dir );
+    while ( i != boost::filesystem::directory_iterator() ) {
+	std::string n = i->path().string();
+	if ( *n.rbegin() <= '9' ) {
+	    std::ifstream stat( ( n + "/stat" ).c_str() );
+	    std::string line;
+	    getline( stat, line );
+	    RunningProcess r( tokenized( line ) );
+	    observed[r.pid] = r;
+	}
+	++i;
+    }
+}
+
+
+static int benchProc( int processes, int iterations )
+{
+    std::string dir = "/tmp/nodeebench-proc." +
+		      boost::lexical_cast<std::string>( ::getpid() );
+    makeProc( dir, processes );
+
+    Init init;
+    ChoreKeeper c( init );
+
+    double before = now();
+    int i = 0;
+    while ( i < iterations ) {
+	c.scanProcesses( dir.c_str(), ::getpid() );
+	i++;
+    }
+    double scan = ( now() - before ) / iterations;
+
+    before = now();
+    i = 0;
+    while ( i < iterations ) {
+	scanTokenized( dir );
+	i++;
+    }
+    double old = ( now() - before ) / iterations;
+
+    std::string vmstat = dir + "/vmstat";
+    before = now();
+    i = 0;
+    while ( i < iterations * 100 ) {
+	(void)c.readProcVmstat( vmstat.c_str() );
+	i++;
+    }
+    double vm = ( now() - before ) / ( iterations * 100 );
+
+    boost::filesystem::remove_all( dir );
+
+    std::cout << std::setw( 10 ) << "processes"
+	      << std::setw( 12 ) << "scan us"
+	      << std::setw( 14 ) << "tokenizer us"
+	      << std::setw( 12 ) << "vmstat us"
+	      << std::endl
+	      << std::setw( 10 ) << processes
+	      << std::fixed << std::setprecision( 1 )
+	      << std::setw( 12 ) << scan
+	      << std::setw( 14 ) << old
+	      << std::setw( 12 ) << vm
+	      << std::endl;
+    return 0;
+}
+
+
+int main( int argc, char ** argv )
+{
+    if ( argc > 1 && !::strcmp( argv[1], "proc" ) ) {
+	int processes = 5000;
+	int iterations = 20;
+	if ( argc > 2 )
+	    processes = boost::lexical_cast<int>( argv[2] );
+	if ( argc > 3 )
+	    iterations = boost::lexical_cast<int>( argv[3] );
+	return benchProc( processes, iterations );
+    }
+
+    int megabytes = 512;
+    int iterations = 200;
+    if ( argc > 1 )
+	megabytes = boost::lexical_cast<int>( argv[1] );
+    if ( argc > 2 )
+	iterations = boost::lexical_cast<int>( argv[2] );
+
+    int threadCounts[] = { 1, 16, 64 };
+    int sizes[] = { 0, megabytes / 4, megabytes };
+
+    std::cout << std::setw( 8 ) << "threads"
+	      << std::setw( 8 ) << "MB"
+	      << std::setw( 12 ) << "spawn us"
+	      << std::setw( 12 ) << "fork us"
+	      << std::endl;
+
+    boost::thread_group threads;
+    int running = 1;
+    int t = 0;
+    while ( t < 3 ) {
+	while ( running < threadCounts[t] ) {
+	    threads.create_thread( idle );
+	    running++;
+	}
+	std::vector<char *> memory;
+	int allocated = 0;
+	int s = 0;
+	while ( s < 3 ) {
+	    // touch every page, so that fork() has to copy the page tables
+	    while ( allocated < sizes[s] ) {
+		char * m = (char *)::malloc( 1024 * 1024 );
+		::memset( m, 1, 1024 * 1024 );
+		memory.push_back( m );
+		allocated++;
+	    }
+	    std::cout << std::setw( 8 ) << running
+		      << std::setw( 8 ) << allocated
+		      << std::setw( 12 ) << std::fixed << std::setprecision( 1 )
+		      << viaSpawn( iterations )
+		      << std::setw( 12 ) << viaFork( iterations )
+		      << std::endl;
+	    s++;
+	}
+	std::vector<char *>::iterator i = memory.begin();
+	while ( i != memory.end() ) {
+	    ::free( *i );
+	    ++i;
+	}
+	t++;
+    }
+
+    {
+	boost::lock_guard<boost::mutex> lock( mutex );
+	finished = true;
+	done.notify_all();
+    }
+    threads.join_all();
+    return 0;
+}
@@ -2,21 +2,30 @@
 
 #include "chorekeeper.h"
 #include "log.h"
+#include "service.h"
+#include "journal.h"
+#include "events.h"
 
 #include <sys/types.h>
+#include <sys/time.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <sysexits.h>
 
-#include <iostream>
-#include <fstream>
-
 #include <map>
-#include <list>
+#include <vector>
 
-#include <boost/tokenizer.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/lexical_cast.hpp>
+#include <boost/property_tree/ptree.hpp>
+#include <boost/property_tree/json_parser.hpp>
 
 
 using namespace std;
@@ -68,7 +77,7 @@ using namespace std;
 */
 
 ChoreKeeper::ChoreKeeper( Init & i )
-    : init( i )
+    : sampled( 0 ), init( i ), ticks( 0 ), vmstat( -1 )
 {
     int n = 7;
     while ( n > 0 ) {
@@ -99,8 +108,10 @@ void ChoreKeeper::start()
 	    ::sleep( 1 );
 	    scanProcesses( "/proc", getpid() );
 	    detectThrashing();
+	    if ( Events::subscribers() )
+		Events::publish( "sample", sample(), true );
 	    if ( isThrashing() ) {
-		Process * jesus = 0;
+		boost::shared_ptr<Process> jesus;
 		jesus = furthestOverPeak();
 		if ( !jesus )
 		    jesus = furthestOverExpected();
@@ -113,7 +124,9 @@ void ChoreKeeper::start()
 		if ( jesus ) {
 		    // we kill with signal 9, since we're already in a
 		    // bad state.
-		    ::kill( jesus->pid(), 9 );
+		    jesus->signal( 9 );
+		    Journal::record( Journal::Killed, jesus->pid(),
+				     jesus->coordinate() );
 		    // come to think of it, should we use
 		    // Process::stop()?
 
@@ -138,10 +151,50 @@ void ChoreKeeper::start()
 }
 
 
-/*! Just a dummy to please the linker. Yes, really. */
+/*! Closes the /proc files the ChoreKeeper keeps open. */
 
 ChoreKeeper::~ChoreKeeper()
 {
+    map<int,int>::iterator i = statFiles.begin();
+    while ( i != statFiles.end() ) {
+	if ( i->second >= 0 )
+	    ::close( i->second );
+	++i;
+    }
+    if ( vmstat >= 0 )
+	::close( vmstat );
+}
+
+
+// reads all of fd (or as much as fits) into b, using pread() so
+// that a file that's read again and again needn't be reopened, and
+// returns the number of bytes read. one pread() is almost always
+// enough for a /proc file. the kernel regenerates a /proc file when
+// it's read at offset 0.
+static int readFd( int fd, char * b, int size )
+{
+    int n = 0;
+    while ( n < size ) {
+	int r = ::pread( fd, b + n, size - n, n );
+	if ( r < 0 && errno == EINTR )
+	    continue;
+	if ( r <= 0 )
+	    break;
+	n += r;
+    }
+    return n;
+}
+
+
+// opens fileName and reads it using readFd()
+static int readFile( const char * fileName, char * b, int size )
+{
+    int fd = ::open( fileName, O_RDONLY );
+    if ( fd < 0 )
+	return 0;
+    int n = readFd( fd, b, size );
+    ::close( fd );
+    return n;
 }
 
 
@@ -163,24 +216,52 @@ ChoreKeeper::~ChoreKeeper()
 
 void ChoreKeeper::detectThrashing()
 {
-    int nr_free_pages = 0; // pages currently unused
-    int pgmajfault = 0; // times a process has had to wait for a page from disk
-    int pgpgout = 0; // times something has been written to disk
+    // /proc/vmstat is kept open, and reread from the start each time
+    if ( vmstat < 0 )
+	vmstat = ::open( "/proc/vmstat", O_RDONLY );
+    char b[16384];
+    int l = vmstat >= 0 ? readFd( vmstat, b, sizeof( b ) ) : 0;
+    VmstatSample s;
+    parseProcVmstat( b, l, s );
+    struct timeval tv;
+    ::gettimeofday( &tv, 0 );
+    s.when = tv.tv_sec + tv.tv_usec / 1000000.0;
+    detectThrashing( s );
+}
+
 
-    readProcVmstat( "/proc/vmstat", nr_free_pages, pgmajfault, pgpgout );
+/*! Records \a s as the latest /proc/vmstat sample, and does the
+    momentary test using the difference between it and the sample
+    before. The last eight samples are kept.
+*/
 
+void ChoreKeeper::detectThrashing( const VmstatSample & s )
+{
     int n = 7;
     while ( n > 0 ) {
 	thrashing[n] = thrashing[n-1];
 	n--;
     }
 
-    thrashing[0] = oneBitOfThrashing( nr_free_pages, pgmajfault, pgpgout );
+    // the counters are cumulative since boot, so the first sample
+    // says nothing about what's happening now
+    thrashing[0] = false;
+    if ( sampled > 0 ) {
+	const VmstatSample & p = samples[( sampled - 1 ) % 8];
+	thrashing[0] = oneBitOfThrashing( s.nr_free_pages,
+					  s.pgmajfault - p.pgmajfault,
+					  s.pgpgout - p.pgpgout,
+					  s.when - p.when );
+    }
+    samples[sampled % 8] = s;
+    sampled++;
 }
 
 
-/*! Returns true or false depending on whether \a nr_free_pages, \a
-    pgmajfault and \a pgpgout indicate that there may be thrashing.
+/*! Returns true or false depending on whether \a nr_free_pages and
+    the changes in pgmajfault and pgpgout indicate that there may be
+    thrashing. \a pgmajfault and \a pgpgout are the increases in those
+    counters during the last \a seconds.
 
     The algorithm used is highly heuristic. It's intended to return
     true a little too often, so ChoreKeeper only takes action if
@@ -190,26 +271,37 @@ void ChoreKeeper::detectThrashing()
     unit testing.
 */
 
-bool ChoreKeeper::oneBitOfThrashing( int nr_free_pages, int pgmajfault, int pgpgout )
+bool ChoreKeeper::oneBitOfThrashing( long long nr_free_pages,
+				     long long pgmajfault,
+				     long long pgpgout,
+				     double seconds )
 {
     // heuristic hell here
 
+    // rule 0. if the counters went backwards or no time has passed,
+    // we know nothing.
+    if ( seconds <= 0 || pgmajfault < 0 || pgpgout < 0 )
+	return false;
+
     // rule 1. if we have megabytes of unused RAM, we can't be
     // thrashing.
     if ( nr_free_pages > 5000 )
 	return false;
 
-    // rule 2. if we're paging in anything, we are thrashing.
-    if ( pgmajfault > 3 ) {
-	// 3 is very low, but it only applies when we're out of RAM,
-	// and isThrashing() will ensure that we have to be paging in
-	// in eight consecutive seconds, so I think a low threshold is
-	// good.
+    // rule 2. if we're paging in more than a little, we are
+    // thrashing.
+    if ( pgmajfault / seconds > 20 ) {
+	// 20 per second is low, but it only applies when we're out of
+	// RAM, and isThrashing() will ensure that we have to be
+	// paging in in eight consecutive seconds, so I think a low
+	// threshold is good. a host with a small page cache rereads a
+	// few pages now and then, which is fine.
 	return true;
     }
 
-    // rule 3. if we aren't writing, we aren't thrashing.
-    if ( pgpgout < 3 ) {
+    // rule 3. if we aren't writing, we aren't thrashing. pgpgout
+    // counts kilobytes.
+    if ( pgpgout / seconds < 256 ) {
 	// this is tricky, and perhaps not good. if we're out of RAM
 	// (see rule 2) but aren't paging in anything (see rule 3)
 	// then being out of RAM can't be a real problem. right?
@@ -235,137 +327,440 @@ bool ChoreKeeper::isThrashing() const
 }
 
 
-/*! Opens and reads \a fileName, storing the eponymous variables in \a
-    nr_free_pages, \a pgmajfault and \a pgpgout.
+/*! Returns a one-line JSON object describing what the last scan
+    found: Whether each of the last eight thrashing checks was
+    positive (most recent first), the host's major page faults and
+    kilobytes written per second during those checks, and the rss and
+    recent page faults of each service.
 */
 
-void ChoreKeeper::readProcVmstat( const char * fileName,
-				  int & nr_free_pages,
-				  int & pgmajfault,
-				  int & pgpgout )
+string ChoreKeeper::sample() const
 {
-    ifstream vmstat( fileName );
-    nr_free_pages = 0; // pages currently unused
-    pgmajfault = 0; // times a process has had to wait for a page from disk
-    pgpgout = 0; // times something has been written to disk
-    boost::char_separator<char> space( " " );
-    while ( vmstat ) {
-	string line;
-	getline( vmstat, line );
-	if ( !line.empty() ) {
-	    boost::tokenizer<boost::char_separator<char> > t( line, space );
-	    boost::tokenizer<boost::char_separator<char> >::iterator i
-		= t.begin();
-	    string n = *i;
-	    ++i;
-	    int v = boost::lexical_cast<int>( *i );
-
-	    // nr_free_pages is the number of RAM pages that are
-	    // completely unused.
-	    if ( n == "nr_free_pages" )
-		nr_free_pages = v;
-	    // pgmajfault is the number of times a process has had to wait
-	    // for a page to be read from either swap or the executable
-	    if ( n == "pgmajfault" )
-		pgmajfault = v;
-	    // pgpgout is the number of things that have been written to
-	    // disk, including swap but also including everything else
-	    if ( n == "pgpgout" )
-		pgpgout = v;
-
-	    // I use pgmajfault for input since that's about waiting, and
-	    // waiting is the most important effect of thrashing
-        }
+    using boost::property_tree::ptree;
+
+    string bits;
+    int n = 0;
+    while ( n < 8 )
+	bits += thrashing[n++] ? '1' : '0';
+
+    ptree pt;
+    pt.put( "thrashing", bits );
+    if ( sampled > 1 ) {
+	const VmstatSample & last = samples[( sampled - 1 ) % 8];
+	const VmstatSample & first = samples[sampled > 8 ? sampled % 8 : 0];
+	double seconds = last.when - first.when;
+	if ( seconds > 0 ) {
+	    pt.put( "majfaults",
+		    (long long)( ( last.pgmajfault - first.pgmajfault ) /
+				 seconds ) );
+	    pt.put( "kbwritten",
+		    (long long)( ( last.pgpgout - first.pgpgout ) /
+				 seconds ) );
+	}
+    }
+    boost::shared_ptr<const Init::Processes> pl = init.processes();
+    Init::Processes::const_iterator m( pl->begin() );
+    while ( m != pl->end() ) {
+	string prefix = "services." +
+			boost::lexical_cast<string>( (*m)->pid() );
+	pt.put( prefix + ".rss", (*m)->currentRss() );
+	pt.put( prefix + ".recentfaults", (*m)->recentPageFaults() );
+	++m;
     }
+
+    ostringstream os;
+    write_json( os, pt, false );
+    return os.str();
 }
 
 
-/*! Parses \a line as though it were a /proc/<pid>/stat line, and returns
-    a RunningProcess with all the right fields filled in.
+/*! Opens and reads \a fileName, and returns a VmstatSample with the
+    eponymous variables filled in. The sample's time is left at 0.
 */
 
-RunningProcess ChoreKeeper::parseProcStat( string line )
-    throw ( boost::bad_lexical_cast )
+VmstatSample ChoreKeeper::readProcVmstat( const char * fileName )
+{
+    // /proc/vmstat is about 5k on 2020s kernels
+    char b[16384];
+    int n = readFile( fileName, b, sizeof( b ) );
+    VmstatSample s;
+    parseProcVmstat( b, n, s );
+    return s;
+}
+
+
+// reads a decimal number starting at b[i], and moves i past it. stops
+// at anything other than a digit, and returns -1 if there are no
+// digits at all.
+static long long number( const char * b, int n, int & i )
 {
-    // the first four fields are pid, filename in parens,
-    // state and ppid. we have to get rid of the filename
-    // so it won't confuse the tokenizer (which wants
-    // space-separated thingies).
+    int start = i;
+    long long v = 0;
+    while ( i < n && b[i] >= '0' && b[i] <= '9' )
+	v = v * 10 + b[i++] - '0';
+    if ( i == start )
+	return -1;
+    return v;
+}
+
+
+/*! Parses the \a n bytes at \a b as a /proc/vmstat file, storing the
+    eponymous variables in \a s. Allocates no memory. The counters
+    can exceed 2^31 on a host that's been up a while, so \a s uses
+    long long.
+*/
+
+void ChoreKeeper::parseProcVmstat( const char * b, int n, VmstatSample & s )
+{
+    s.nr_free_pages = 0; // pages currently unused
+    s.pgmajfault = 0; // times a process has had to wait for a page from disk
+    s.pgpgout = 0; // times something has been written to disk
 
     int i = 0;
-    while ( i < line.length() && line[i] != '(' )
-        i++;
-    while ( i < line.length() && line[i] != ')' ) {
-        if ( line[i] == '\\' ) // the kernel escapes rightparens
-	    line[i++] = '0';
-        line[i++] = '0';
+    while ( i < n ) {
+	int name = i;
+	while ( i < n && b[i] != ' ' && b[i] != '\n' )
+	    i++;
+	int l = i - name;
+	while ( i < n && b[i] == ' ' )
+	    i++;
+	long long v = number( b, n, i );
+	while ( i < n && b[i] != '\n' )
+	    i++;
+	i++;
+	if ( v < 0 )
+	    continue;
+
+	// nr_free_pages is the number of RAM pages that are
+	// completely unused.
+	if ( l == 13 && !::memcmp( b + name, "nr_free_pages", 13 ) )
+	    s.nr_free_pages = v;
+	// pgmajfault is the number of times a process has had to wait
+	// for a page to be read from either swap or the executable
+	else if ( l == 10 && !::memcmp( b + name, "pgmajfault", 10 ) )
+	    s.pgmajfault = v;
+	// pgpgout is the number of things that have been written to
+	// disk, including swap but also including everything else
+	else if ( l == 7 && !::memcmp( b + name, "pgpgout", 7 ) )
+	    s.pgpgout = v;
+
+	// I use pgmajfault for input since that's about waiting, and
+	// waiting is the most important effect of thrashing
     }
-    if ( line[i] == ')' )
-        line[i] = '0';
+}
+
 
-    boost::tokenizer<> tokens( line );
-    boost::tokenizer<>::iterator t = tokens.begin();
-    boost::tokenizer<>::iterator end = tokens.end();
+/*! Parses \a line as though it were a /proc/<pid>/stat line, and returns
+    a RunningProcess with all the right fields filled in, or an empty
+    RunningProcess if \a line doesn't parse.
 
+    This is a wrapper around the other parseProcStat(), which doesn't
+    need a string. It no longer throws anything.
+*/
 
+RunningProcess ChoreKeeper::parseProcStat( string line )
+{
     RunningProcess r;
-    if ( t == end )
-	return RunningProcess();
-    r.pid = boost::lexical_cast<int>( *t );
-    ++t; // points to the nulls from above
-    ++t; // points to the state ('D', 'R' or whatever)
-    ++t; // points to the ppid
-    if ( t == end )
-	return RunningProcess();
-    r.ppid = boost::lexical_cast<int>( *t );
-    ++t; // points to the process group
-    ++t; // points to the session id
-    ++t; // points to the tty number
-    ++t; // points to the process group controller
-    ++t; // points to the kernel flags
-    ++t; // points to minflt
-    ++t; // points to cminflt
-    ++t; // points to majflt
-    if ( t == end )
+    if ( !parseProcStat( line.data(), line.size(), r ) )
 	return RunningProcess();
-    r.majflt = boost::lexical_cast<int>( *t );
-    ++t; // points to cmajflt
-    if ( t == end )
-	return RunningProcess();
-    r.majflt += boost::lexical_cast<int>( *t );
-    ++t; // points to user time ticks
-    ++t; // points to kernel time ticks
-    ++t; // points to waited-for child user time
-    ++t; // points to waited-for child kernel time ticks
-    ++t; // points to kernel real-time priority
-    ++t; // points to niceness
-    ++t; // points to numthreads
-    ++t; // points to null
-    ++t; // points to the process' start time
-    ++t; // points to vsize
-    ++t; // points to rss in pages
-    if ( t == end )
-	return RunningProcess();
-    r.rss = boost::lexical_cast<int>( *t );
     return r;
 }
 
 
-/* ubuntu 10.04 includes boost 1.40, which has boost::filesystem API
-   2. 11.10 includes API 3. rather than demand and upgraded or
-   downgraded boost, I tried to write code that works with both. this
-   wrapper is needed to get a filename from an iterator.
+/*! Parses the \a n bytes at \a b as a /proc/<pid>/stat line, and fills
+    in \a r. Returns true if all went well, and false if not, in
+    which case \a r may be partly filled in. Allocates no memory.
+
+    The second field is the file name in parens, which may contain
+    anything, including spaces and parens, so the fields after it are
+    counted from the last right paren.
+*/
+
+bool ChoreKeeper::parseProcStat( const char * b, int n, RunningProcess & r )
+{
+    int i = 0;
+    long long pid = number( b, n, i );
+    if ( pid < 0 )
+	return false;
+    r.pid = (int)pid;
+
+    i = n;
+    while ( i > 0 && b[i-1] != ')' )
+	i--;
+    if ( !i )
+	return false;
+
+    // fields 3 onwards. we want 4 (ppid), 12 and 13 (majflt and
+    // cmajflt) and 24 (rss in pages).
+    long long cmajflt = 0;
+    int field = 3;
+    while ( field <= 24 ) {
+	while ( i < n && b[i] == ' ' )
+	    i++;
+	if ( i >= n )
+	    return false;
+	if ( field == 4 || field == 12 || field == 13 || field == 24 ) {
+	    long long v = number( b, n, i );
+	    if ( v < 0 )
+		return false;
+	    if ( field == 4 )
+		r.ppid = (int)v;
+	    else if ( field == 12 )
+		r.majflt = (int)v;
+	    else if ( field == 13 )
+		cmajflt = v;
+	    else
+		r.rss = (int)v;
+	}
+	while ( i < n && b[i] != ' ' )
+	    i++;
+	field++;
+    }
+    r.majflt += (int)cmajflt;
+    return true;
+}
+
+
+// reads proc/pid/stat into r, returns false if that's not possible
+static bool readStatFile( const char * proc, int pid, RunningProcess & r )
+{
+    char name[PATH_MAX];
+    char b[4096];
+    int l = ::snprintf( name, sizeof( name ), "%s/%d/stat", proc, pid );
+    if ( l <= 0 || l >= (int)sizeof( name ) )
+	return false;
+    int n = readFile( name, b, sizeof( b ) );
+    return n > 0 && ChoreKeeper::parseProcStat( b, n, r );
+}
+
+
+// appends the children of pid to the work list, as told by
+// proc/pid/task/*/children. each thread has its own list of the
+// children it forked.
+static void findChildren( const char * proc, int pid, vector<int> & work )
+{
+    char name[PATH_MAX];
+    int l = ::snprintf( name, sizeof( name ), "%s/%d/task", proc, pid );
+    if ( l <= 0 || l >= (int)sizeof( name ) )
+	return;
+    DIR * dir = ::opendir( name );
+    if ( !dir )
+	return;
+    char b[16384];
+    struct dirent * e;
+    while ( ( e = ::readdir( dir ) ) != 0 ) {
+	if ( e->d_name[0] < '1' || e->d_name[0] > '9' )
+	    continue;
+	l = ::snprintf( name, sizeof( name ), "%s/%d/task/%s/children",
+			proc, pid, e->d_name );
+	if ( l <= 0 || l >= (int)sizeof( name ) )
+	    continue;
+	int n = readFile( name, b, sizeof( b ) );
+	int i = 0;
+	while ( i < n ) {
+	    long long child = number( b, n, i );
+	    if ( child > 0 )
+		work.push_back( (int)child );
+	    else
+		i++;
+	}
+    }
+    ::closedir( dir );
+}
+
+
+// returns the index in procs of the process whose pid is pid, or -1.
+// slots is an open-addressing hash table of indexes plus one, so 0
+// means an empty slot.
+static int indexOf( const vector<int> & slots,
+		    const vector<RunningProcess> & procs, int pid )
+{
+    unsigned int mask = slots.size() - 1;
+    unsigned int h = ( (unsigned int)pid * 2654435761u ) & mask;
+    while ( slots[h] ) {
+	if ( procs[slots[h] - 1].pid == pid )
+	    return slots[h] - 1;
+	h = ( h + 1 ) & mask;
+    }
+    return -1;
+}
+
+
+// reads the stat file of every process in proc and adds each
+// process' rss and page faults to that of its parent, and so on up
+// to the child of me (or of no one), storing the totals of the
+// managed processes in observed. this is for kernels that don't tell
+// scanProcesses() about children directly.
+//
+// the processes are kept in a flat vector, indexed by a hash of the
+// pid, and the tree is folded bottom-up: a process is added to its
+// parent once all of its own children have been added to it. that
+// makes each process cost O(1), however deep the tree is.
+static void scanAll( const char * proc, int me,
+		     const Init::Processes & managed,
+		     map<int,RunningProcess> & observed )
+{
+    vector<RunningProcess> procs;
+    procs.reserve( 1024 );
+
+    DIR * dir = ::opendir( proc );
+    if ( !dir ) {
+	// kill all processes or just fail?
+	::exit( EX_SOFTWARE );
+    }
+    // the file names and contents are put on the stack, so reading a
+    // stat file costs three syscalls and no allocations.
+    struct dirent * e;
+    while ( ( e = ::readdir( dir ) ) != 0 ) {
+	if ( e->d_name[0] < '1' || e->d_name[0] > '9' )
+	    continue;
+	RunningProcess r;
+	// if parseProcStat fails, then we just don't manage that
+	// process. it probably exited just now.
+	if ( readStatFile( proc, ::atoi( e->d_name ), r ) )
+	    procs.push_back( r );
+    }
+    ::closedir( dir );
+
+    int n = procs.size();
+    unsigned int size = 2;
+    while ( size < 2 * procs.size() )
+	size *= 2;
+    vector<int> slots( size, 0 );
+    int i = 0;
+    while ( i < n ) {
+	unsigned int h = ( (unsigned int)procs[i].pid * 2654435761u )
+			 & ( size - 1 );
+	while ( slots[h] )
+	    h = ( h + 1 ) & ( size - 1 );
+	slots[h] = i + 1;
+	i++;
+    }
+
+    // parent[i] is the index of i's parent, or -1 if i is the top of
+    // its tree. pending[i] is the number of children not yet added.
+    vector<int> parent( n, -1 );
+    vector<int> pending( n, 0 );
+    i = 0;
+    while ( i < n ) {
+	if ( procs[i].ppid && procs[i].ppid != me ) {
+	    int p = indexOf( slots, procs, procs[i].ppid );
+	    if ( p >= 0 && p != i ) {
+		parent[i] = p;
+		pending[p]++;
+	    }
+	}
+	i++;
+    }
+
+    vector<int> ready;
+    ready.reserve( n );
+    i = 0;
+    while ( i < n ) {
+	if ( !pending[i] )
+	    ready.push_back( i );
+	i++;
+    }
+    while ( !ready.empty() ) {
+	int c = ready.back();
+	ready.pop_back();
+	int p = parent[c];
+	if ( p >= 0 ) {
+	    procs[p].rss += procs[c].rss;
+	    procs[p].majflt += procs[c].majflt;
+	    if ( !--pending[p] )
+		ready.push_back( p );
+	}
+    }
+
+    Init::Processes::const_iterator m( managed.begin() );
+    while ( m != managed.end() ) {
+	int p = indexOf( slots, procs, (*m)->pid() );
+	if ( p >= 0 )
+	    observed[(*m)->pid()] = procs[p];
+	++m;
+    }
+}
+
+
+/*! Finds the processes in each of the trees rooted at \a managed,
+    using the children files in \a proc, and records them so
+    scanProcesses() can sum their stat files. Opens the stat files of
+    new processes and closes those of processes that are no longer in
+    any tree.
 */
 
-static string filename( const boost::filesystem::directory_iterator & i )
+void ChoreKeeper::enumerate( const char * proc,
+			     const Init::Processes & managed )
 {
-#if defined(BOOST_FILESYSTEM_VERSION) && BOOST_FILESYSTEM_VERSION == 3
-    return i->path().native();
-#else
-    return i->string();
-#endif
+    ticks = 0;
+    trees.clear();
+
+    map<int,int> open;
+    vector<int> work;
+    Init::Processes::const_iterator m( managed.begin() );
+    while ( m != managed.end() ) {
+	vector<int> & members = trees[(*m)->pid()];
+	work.clear();
+	work.push_back( (*m)->pid() );
+	while ( !work.empty() ) {
+	    int pid = work.back();
+	    work.pop_back();
+	    if ( pid <= 0 || open.find( pid ) != open.end() )
+		continue;
+	    int fd = -1;
+	    map<int,int>::iterator f = statFiles.find( pid );
+	    if ( f != statFiles.end() ) {
+		fd = f->second;
+		statFiles.erase( f );
+	    } else {
+		char name[PATH_MAX];
+		int l = ::snprintf( name, sizeof( name ), "%s/%d/stat",
+				    proc, pid );
+		if ( l > 0 && l < (int)sizeof( name ) )
+		    fd = ::open( name, O_RDONLY );
+		// a process that has exited just now has no stat, and
+		// we don't care about its children either. if we're
+		// out of fds, readStat() opens the file each time.
+		if ( fd < 0 && errno != EMFILE && errno != ENFILE )
+		    continue;
+	    }
+	    open[pid] = fd;
+	    members.push_back( pid );
+	    findChildren( proc, pid, work );
+	}
+	++m;
+    }
+
+    // whatever's left belongs to processes that are gone
+    map<int,int>::iterator i = statFiles.begin();
+    while ( i != statFiles.end() ) {
+	if ( i->second >= 0 )
+	    ::close( i->second );
+	++i;
+    }
+    statFiles.swap( open );
 }
 
+
+/*! Reads the stat file for \a pid into \a r, using the file
+    enumerate() opened if there is one. Returns false if the process
+    has exited, or the file can't be parsed.
+*/
+
+bool ChoreKeeper::readStat( const char * proc, int pid, RunningProcess & r )
+{
+    map<int,int>::iterator f = statFiles.find( pid );
+    if ( f == statFiles.end() || f->second < 0 )
+	return readStatFile( proc, pid, r );
+    // once a process has been reaped, reading its stat file fails
+    // with ESRCH, even if the pid has been reused.
+    char b[4096];
+    int n = readFd( f->second, b, sizeof( b ) );
+    return n > 0 && parseProcStat( b, n, r );
+}
+
+
 /*! Scans the Process table and the /proc/<pid>/stat files and finds out
     how much memory each of our processes is using (including all children)
     and how badly it is suffering from thrashing.
@@ -373,60 +768,76 @@ static string filename( const boost::filesystem::directory_iterator & i )
     \a proc is /proc (or another value for testing) and \a me is
     nodee's pid (or another value for testing). I dislike this,
     can't tell why.
+
+    If the kernel provides /proc/<pid>/task/<tid>/children (linux
+    3.5 and later usually do), this looks only at each managed process
+    and its descendants, so the work done depends on how many
+    processes nodee manages, not on how many run on the host. If not,
+    it reads the stat file of every process on the host and walks up
+    from each.
+
+    In the former case, the stat files are kept open and reread with
+    pread(), so a tick costs one syscall per process. The trees are
+    enumerated afresh when the Init's process table changes, when a
+    process in a tree exits, and every 16th tick in order to notice
+    children forked meanwhile.
 */
 
 void ChoreKeeper::scanProcesses( const char * proc, int me )
 {
-    using namespace boost::filesystem;
-
-    path p ( proc );
     map<int,RunningProcess> observed;
-    try {
-
-	directory_iterator i = directory_iterator( p );
-	while ( i != directory_iterator() ) {
-	    if ( *filename( i ).rbegin() <= '9' ) {
-		string x = filename( i );
-		x.append( "/stat" );
-		ifstream stat( x.data() );
-		string line;
-		getline( stat, line );
-		try {
-		    RunningProcess r( parseProcStat( line ) );
-		    observed[r.pid] = r;
-		} catch (  boost::bad_lexical_cast ) {
-		    // if parseProcStat throws, then we just don't
-		    // manage that process
+    boost::shared_ptr<const Init::Processes> pl = init.processes();
+
+    char name[PATH_MAX];
+    int l = ::snprintf( name, sizeof( name ), "%s/%d/task/%d/children",
+			proc, me, me );
+    if ( l > 0 && l < (int)sizeof( name ) && ::access( name, R_OK ) == 0 ) {
+	if ( pl != enumerated || ++ticks >= 16 ) {
+	    enumerate( proc, *pl );
+	    enumerated = pl;
+	}
+	bool exited = false;
+	Init::Processes::const_iterator m( pl->begin() );
+	while ( m != pl->end() ) {
+	    RunningProcess & total = observed[(*m)->pid()];
+	    const vector<int> & members = trees[(*m)->pid()];
+	    vector<int>::const_iterator i = members.begin();
+	    while ( i != members.end() ) {
+		RunningProcess r;
+		if ( readStat( proc, *i, r ) ) {
+		    total.rss += r.rss;
+		    total.majflt += r.majflt;
+		} else {
+		    exited = true;
 		}
+		++i;
 	    }
-	    ++i;
+	    ++m;
 	}
-    } catch (const filesystem_error& ex) {
-	// kill all processes or just fail?
-	::exit( EX_SOFTWARE );
-    }
-
-    map<int,RunningProcess>::iterator i = observed.begin();
-    while ( i != observed.end() ) {
-	pid_t mother = i->second.pid;
-	while ( mother &&
-	        observed[mother].ppid &&
-	        observed[mother].ppid != me )
-	    mother = observed[mother].ppid;
-	if ( observed[mother].pid != i->second.pid ) {
-	    observed[mother].rss += i->second.rss;
-	    observed[mother].majflt += i->second.majflt;
-	}
-	++i;
+	// a process exited, so its children have a new parent and
+	// its pid may be reused. better look again next time.
+	if ( exited )
+	    enumerated.reset();
+    } else {
+	scanAll( proc, me, *pl, observed );
     }
 
-    list<Process *> & pl = init.processes();
-    list<Process *>::iterator m( pl.begin() );
-    while ( m != pl.end() ) {
+    // the service list shows rss and recent faults, so if either
+    // changes, the list has to be rebuilt.
+    bool changed = false;
+    Init::Processes::const_iterator m( pl->begin() );
+    while ( m != pl->end() ) {
+	int rss = (*m)->currentRss();
+	int faults = (*m)->recentPageFaults();
 	(*m)->setCurrentRss( observed[(*m)->pid()].rss );
 	(*m)->setPageFaults( observed[(*m)->pid()].majflt );
+	if ( rss != (*m)->currentRss() ||
+	     faults != (*m)->recentPageFaults() )
+	    changed = true;
 	++m;
     }
+    if ( changed )
+	Service::changed();
 }
 
 
@@ -435,12 +846,12 @@ void ChoreKeeper::scanProcesses( const char * proc, int me )
     none are above their peak.
 */
 
-Process * ChoreKeeper::furthestOverPeak() const
+boost::shared_ptr<Process> ChoreKeeper::furthestOverPeak() const
 {
-    Process * p = 0;
-    list<Process *> & pl = init.processes();
-    list<Process *>::iterator m( pl.begin() );
-    while ( m != pl.end() ) {
+    boost::shared_ptr<Process> p;
+    boost::shared_ptr<const Init::Processes> pl = init.processes();
+    Init::Processes::const_iterator m( pl->begin() );
+    while ( m != pl->end() ) {
 	int over = (*m)->currentRss() - (*m)->spec().expectedPeakMemory();
 	if ( over > 0 &&
 	     ( !p ||
@@ -457,12 +868,12 @@ Process * ChoreKeeper::furthestOverPeak() const
     pointer Process if none are above their expected typical size.
 */
 
-Process * ChoreKeeper::furthestOverExpected() const
+boost::shared_ptr<Process> ChoreKeeper::furthestOverExpected() const
 {
-    Process * p = 0;
-    list<Process *> & pl = init.processes();
-    list<Process *>::iterator m( pl.begin() );
-    while ( m != pl.end() ) {
+    boost::shared_ptr<Process> p;
+    boost::shared_ptr<const Init::Processes> pl = init.processes();
+    Init::Processes::const_iterator m( pl->begin() );
+    while ( m != pl->end() ) {
 	int over = (*m)->currentRss() - (*m)->spec().expectedTypicalMemory();
 	if ( over > 0 &&
 	     ( !p ||
@@ -480,13 +891,13 @@ Process * ChoreKeeper::furthestOverExpected() const
     most important Process.
 */
 
-Process * ChoreKeeper::leastValuable() const
+boost::shared_ptr<Process> ChoreKeeper::leastValuable() const
 {
-    Process * max = 0;
-    Process * min = 0;
-    list<Process *> & pl = init.processes();
-    list<Process *>::iterator m( pl.begin() );
-    while ( m != pl.end() ) {
+    boost::shared_ptr<Process> max;
+    boost::shared_ptr<Process> min;
+    boost::shared_ptr<const Init::Processes> pl = init.processes();
+    Init::Processes::const_iterator m( pl->begin() );
+    while ( m != pl->end() ) {
 	if ( !max || max->spec().value() < (*m)->spec().value() )
 	    max = *m;
 	if ( !min || min->spec().value() > (*m)->spec().value() )
@@ -494,7 +905,7 @@ Process * ChoreKeeper::leastValuable() const
 	++m;
     }
     if ( min && max && min->spec().value() >= max->spec().value() )
-	min = 0;
+	min.reset();
     return min;
 }
 
@@ -504,14 +915,14 @@ Process * ChoreKeeper::leastValuable() const
     worse affected than the others.
 */
 
-Process * ChoreKeeper::thrashingMost() const
+boost::shared_ptr<Process> ChoreKeeper::thrashingMost() const
 {
-    Process * worst = 0;
-    Process * least = 0;
+    boost::shared_ptr<Process> worst;
+    boost::shared_ptr<Process> least;
 
-    list<Process *> & pl = init.processes();
-    list<Process *>::iterator m( pl.begin() );
-    while ( m != pl.end() ) {
+    boost::shared_ptr<const Init::Processes> pl = init.processes();
+    Init::Processes::const_iterator m( pl->begin() );
+    while ( m != pl->end() ) {
 	if ( !worst || (*m)->recentPageFaults() > least->recentPageFaults() )
 	    worst = *m;
 	if ( !least || (*m)->recentPageFaults() < least->recentPageFaults() )
@@ -521,7 +932,7 @@ Process * ChoreKeeper::thrashingMost() const
 
     if ( worst && least &&
 	 least->recentPageFaults() >= worst->recentPageFaults() )
-	worst = 0;
+	worst.reset();
 
     return worst;
 }
@@ -532,12 +943,12 @@ Process * ChoreKeeper::thrashingMost() const
     being managed by Nodee.
 */
 
-Process * ChoreKeeper::biggest() const
+boost::shared_ptr<Process> ChoreKeeper::biggest() const
 {
-    Process * p = 0;
-    list<Process *> & pl = init.processes();
-    list<Process *>::iterator m( pl.begin() );
-    while ( m != pl.end() ) {
+    boost::shared_ptr<Process> p;
+    boost::shared_ptr<const Init::Processes> pl = init.processes();
+    Init::Processes::const_iterator m( pl->begin() );
+    while ( m != pl->end() ) {
 	if ( !p || (*m)->currentRss() > p->currentRss() )
 	    p = *m;
 	++m;
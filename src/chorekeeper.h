@@ -6,7 +6,21 @@
 #include "process.h"
 #include "init.h"
 
+#include <map>
+#include <vector>
+
 #include <boost/lexical_cast.hpp>
+#include <boost/shared_ptr.hpp>
+
+
+struct VmstatSample {
+    VmstatSample()
+	: when( 0 ), nr_free_pages( 0 ), pgmajfault( 0 ), pgpgout( 0 ) {}
+    double when;
+    long long nr_free_pages;
+    long long pgmajfault;
+    long long pgpgout;
+};
 
 
 struct RunningProcess {
@@ -29,25 +43,39 @@ public:
     void start();
 
     void detectThrashing();
+    void detectThrashing( const VmstatSample & );
     bool isThrashing() const;
-    static bool oneBitOfThrashing( int, int, int );
+    string sample() const;
+    static bool oneBitOfThrashing( long long, long long, long long, double );
 
     void scanProcesses( const char *, int );
 
-    Process * furthestOverPeak() const;
-    Process * furthestOverExpected() const;
-    Process * leastValuable() const;
-    Process * thrashingMost() const;
-    Process * biggest() const;
+    boost::shared_ptr<Process> furthestOverPeak() const;
+    boost::shared_ptr<Process> furthestOverExpected() const;
+    boost::shared_ptr<Process> leastValuable() const;
+    boost::shared_ptr<Process> thrashingMost() const;
+    boost::shared_ptr<Process> biggest() const;
 
-    void readProcVmstat( const char *, int &, int &, int & );
+    VmstatSample readProcVmstat( const char * );
+    static void parseProcVmstat( const char *, int, VmstatSample & );
 
-    RunningProcess parseProcStat( string line )
-	throw ( boost::bad_lexical_cast );
+    RunningProcess parseProcStat( string line );
+    static bool parseProcStat( const char *, int, RunningProcess & );
 
 private:
+    void enumerate( const char *, const Init::Processes & );
+    bool readStat( const char *, int, RunningProcess & );
+
     bool thrashing[8];
+    VmstatSample samples[8];
+    int sampled;
     Init & init;
+
+    boost::shared_ptr<const Init::Processes> enumerated;
+    int ticks;
+    std::map< int, std::vector<int> > trees;
+    std::map<int, int> statFiles;
+    int vmstat;
 };
 
 
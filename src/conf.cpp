@@ -15,11 +15,19 @@
 
 
 map<string,string> Conf::depots;
+vector<string> Conf::peers;
 string Conf::scriptdir;
 string Conf::basedir;
 string Conf::workdir;
 string Conf::artefactdir;
 string Conf::zk;
+int Conf::httpworkers;
+int Conf::downloadlimit;
+int Conf::verifylimit;
+int Conf::installlimit;
+int Conf::startlimit;
+int Conf::artefactquota;
+int Conf::prefetchrate;
 
 
 /*! Writes default values into the configuration values. The default
@@ -30,3 +38,15 @@ string Conf::zk;
 void Conf::setDefaults()
 {
 }
+
+
+/*! Returns the name of the artefact directory: artefactdir if that's
+    an absolute path, or else artefactdir within basedir.
+*/
+
+string Conf::artefactDirectory()
+{
+    if ( !artefactdir.empty() && artefactdir[0] == '/' )
+	return artefactdir;
+    return basedir + "/" + artefactdir;
+}
@@ -5,6 +5,7 @@
 
 #include <map>
 #include <string>
+#include <vector>
 
 using namespace std;
 
@@ -13,15 +14,24 @@ class Conf
 {
 public:
     static void setDefaults();
+    static string artefactDirectory();
 
     // boost::po wants to write to variables and I didn't feel like
     // writing setters just for blah, so I made these public.
     static map<string,string> depots;
+    static vector<string> peers;
     static string scriptdir;
     static string basedir;
     static string workdir;
     static string artefactdir;
     static string zk;
+    static int httpworkers;
+    static int downloadlimit;
+    static int verifylimit;
+    static int installlimit;
+    static int startlimit;
+    static int artefactquota;
+    static int prefetchrate;
 };
 
 
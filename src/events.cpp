@@ -0,0 +1,274 @@
+// Copyright Arnt Gulbrandsen <arnt@gulbrandsen.priv.no>; BSD-licensed.
+
+#include "events.h"
+
+#include "log.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <list>
+#include <vector>
+
+#include <boost/thread.hpp>
+
+
+struct EventSubscriber
+{
+    int fd;
+    EventQueue queue;
+};
+
+
+static boost::mutex mutex;
+static std::list<EventSubscriber> streams;
+static int wakeup[2] = { -1, -1 };
+
+
+/*! \class Events events.h
+
+    The Events class streams what happens to anyone who wants to know,
+    using the text/event-stream format (also known as Server-Sent
+    Events).
+
+    A client that GETs /service/events gets a response that never
+    ends. The HttpServer hands its socket over to subscribe() and
+    forgets about it, and from then on, each event that's publish()ed
+    is written to the socket.
+
+    A single thread writes to all the subscribers, using nonblocking
+    writes. Each subscriber has an EventQueue, so if a client reads
+    slowly, the events wait there. If it reads very slowly, the queue
+    drops old samples to make room for new ones. The thread is started
+    when the first client subscribes, and runs forever.
+
+    ChoreKeeper publishes a sample every time it looks at /proc, and
+    Journal publishes each change it records.
+*/
+
+
+/*! Starts writing events to \a fd, beginning with \a header (which
+    should be the HTTP response header). Events owns \a fd from now
+    on, and closes it when the client goes away.
+*/
+
+void Events::subscribe( int fd, const string & header )
+{
+    boost::lock_guard<boost::mutex> lock( mutex );
+    if ( wakeup[0] < 0 ) {
+	if ( ::pipe( wakeup ) < 0 ) {
+	    ::close( fd );
+	    return;
+	}
+	(void)::fcntl( wakeup[0], F_SETFL, O_NONBLOCK );
+	(void)::fcntl( wakeup[1], F_SETFL, O_NONBLOCK );
+	boost::thread t( &Events::start );
+    }
+    (void)::fcntl( fd, F_SETFL, ::fcntl( fd, F_GETFL ) | O_NONBLOCK );
+    streams.push_back( EventSubscriber() );
+    streams.back().fd = fd;
+    streams.back().queue.push( header, false );
+    (void)::write( wakeup[1], "", 1 );
+}
+
+
+/*! Returns the number of subscribers. Publishers can use this to
+    avoid preparing events that nobody will see.
+*/
+
+int Events::subscribers()
+{
+    boost::lock_guard<boost::mutex> lock( mutex );
+    return streams.size();
+}
+
+
+/*! Sends an event called \a event with JSON \a data to all
+    subscribers. If \a sample is true, the event may be dropped in
+    favour of later samples if a subscriber is slow.
+
+    Returns at once; the writing happens in another thread.
+*/
+
+void Events::publish( const string & event, const string & data,
+		      bool sample )
+{
+    boost::lock_guard<boost::mutex> lock( mutex );
+    if ( streams.empty() )
+	return;
+    string e = format( event, data );
+    std::list<EventSubscriber>::iterator i = streams.begin();
+    while ( i != streams.end() ) {
+	i->queue.push( e, sample );
+	++i;
+    }
+    (void)::write( wakeup[1], "", 1 );
+}
+
+
+/*! Returns \a event with \a data formatted as text/event-stream
+    wants it. \a data may end with a line feed (as compact write_json
+    output does), but may not contain any others.
+*/
+
+string Events::format( const string & event, const string & data )
+{
+    string r = "event: ";
+    r += event;
+    r += "\ndata: ";
+    r += data;
+    if ( data.empty() || data[data.size() - 1] != '\n' )
+	r += "\n";
+    r += "\n";
+    return r;
+}
+
+
+/*! Writes events to subscribers until the end of time. Subscribers
+    that close their connection, or whose connections break, are
+    forgotten.
+
+    If nothing happens for 15 seconds, a comment is sent to everyone,
+    so that dead connections are noticed and proxies don't time out.
+*/
+
+void Events::start()
+{
+    std::vector<struct pollfd> fds;
+    while ( true ) {
+	fds.clear();
+	struct pollfd w;
+	w.fd = wakeup[0];
+	w.events = POLLIN;
+	w.revents = 0;
+	fds.push_back( w );
+	{
+	    boost::lock_guard<boost::mutex> lock( mutex );
+	    std::list<EventSubscriber>::iterator i = streams.begin();
+	    while ( i != streams.end() ) {
+		struct pollfd p;
+		p.fd = i->fd;
+		p.events = POLLRDHUP;
+		if ( !i->queue.empty() )
+		    p.events |= POLLOUT;
+		p.revents = 0;
+		fds.push_back( p );
+		++i;
+	    }
+	}
+
+	int r = ::poll( &fds[0], fds.size(), 15000 );
+	if ( r < 0 && errno != EINTR ) {
+	    debug << "nodee: poll() failed for events, errno " << errno
+		  << endl;
+	    ::sleep( 1 );
+	    continue;
+	}
+
+	char buffer[256];
+	while ( ::read( wakeup[0], buffer, sizeof( buffer ) ) > 0 )
+	    ;
+
+	// subscribers may have been added while we polled, but they're
+	// always added at the end and only this thread removes any, so
+	// the first ones match fds.
+	boost::lock_guard<boost::mutex> lock( mutex );
+	unsigned int n = 1;
+	std::list<EventSubscriber>::iterator i = streams.begin();
+	while ( i != streams.end() ) {
+	    short events = n < fds.size() ? fds[n].revents : 0;
+	    n++;
+
+	    if ( !r )
+		i->queue.push( ":\n\n", false );
+	    if ( ( events & ( POLLERR | POLLHUP | POLLRDHUP | POLLNVAL ) ) ||
+		 !i->queue.write( i->fd ) ) {
+		::close( i->fd );
+		i = streams.erase( i );
+	    } else {
+		++i;
+	    }
+	}
+    }
+}
+
+
+/*! \class EventQueue events.h
+
+    The EventQueue class holds the events that are waiting to be
+    written to one subscriber, and knows how much of the first has
+    been written already.
+
+    The queue holds at most Max events. When a new event would exceed
+    that, the queue drops the oldest sample, or if there are no
+    samples, the oldest event. An event that has been partly written
+    is never dropped, since that would garble the stream.
+*/
+
+
+/*! Constructs an empty EventQueue. */
+
+EventQueue::EventQueue()
+    : o( 0 ), d( 0 )
+{
+}
+
+
+/*! Appends \a text to the queue. \a sample is true if \a text may be
+    dropped in favour of newer events.
+*/
+
+void EventQueue::push( const string & text, bool sample )
+{
+    q.push_back( std::make_pair( sample, text ) );
+    if ( (int)q.size() <= Max )
+	return;
+
+    // we look for the oldest sample, but not at the one being written
+    std::deque< std::pair<bool, string> >::iterator i = q.begin();
+    if ( o )
+	++i;
+    std::deque< std::pair<bool, string> >::iterator victim = i;
+    while ( i != q.end() && !i->first )
+	++i;
+    if ( i != q.end() )
+	victim = i;
+    q.erase( victim );
+    d++;
+}
+
+
+/*! Writes as much as possible to the socket \a fd without blocking.
+    Returns true if all is well, and false if the connection is
+    broken.
+
+    A client that goes away must not cost us a SIGPIPE, so this uses
+    send() rather than write().
+*/
+
+bool EventQueue::write( int fd )
+{
+    while ( !q.empty() ) {
+	const string & s = q.front().second;
+	int r = ::send( fd, s.data() + o, s.size() - o, MSG_NOSIGNAL );
+	if ( r < 0 )
+	    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+	o += r;
+	if ( o < (int)s.size() )
+	    return true;
+	q.pop_front();
+	o = 0;
+    }
+    return true;
+}
+
+
+/*! \fn int EventQueue::dropped() const
+
+    Returns the number of events that have been dropped because the
+    queue was full.
+*/
@@ -0,0 +1,48 @@
+// Copyright Arnt Gulbrandsen <arnt@gulbrandsen.priv.no>; BSD-licensed.
+
+#ifndef EVENTS_H
+#define EVENTS_H
+
+#include <deque>
+#include <string>
+#include <utility>
+
+using namespace std;
+
+
+class EventQueue
+{
+public:
+    EventQueue();
+
+    enum { Max = 64 };
+
+    void push( const string &, bool );
+    bool empty() const { return q.empty(); }
+    int size() const { return q.size(); }
+    int dropped() const { return d; }
+
+    bool write( int );
+
+private:
+    std::deque< std::pair<bool, string> > q;
+    int o;
+    int d;
+};
+
+
+class Events
+{
+public:
+    static void subscribe( int, const string & );
+    static int subscribers();
+
+    static void publish( const string &, const string &, bool = false );
+
+    static string format( const string &, const string & );
+
+private:
+    static void start();
+};
+
+#endif
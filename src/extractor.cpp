@@ -0,0 +1,917 @@
+// Copyright Arnt Gulbrandsen <arnt@gulbrandsen.priv.no>; BSD-licensed.
+
+#include "extractor.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <zlib.h>
+
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <set>
+#include <vector>
+
+#include <boost/bind.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/thread.hpp>
+
+
+// a zip entry, as described by the central directory
+struct ZipEntry
+{
+    string name;
+    int method;
+    unsigned int crc;
+    unsigned int csize;
+    unsigned int usize;
+    unsigned int offset;
+    int mode;
+};
+
+
+// a small file from a tar archive, read and waiting to be written
+struct TarFile
+{
+    string name;
+    int mode;
+    string data;
+};
+
+
+// a link from a tar archive, made once all the files exist
+struct TarLink
+{
+    string name;
+    string target;
+    bool symbolic;
+};
+
+
+// what the threads working on one archive share
+class ExtractState
+{
+public:
+    ExtractState()
+	: fd( -1 ), uid( 0 ), gid( 0 ), next( 0 ),
+	  buffered( 0 ), finished( false ) {}
+
+    void fail( const string & why ) {
+	boost::lock_guard<boost::mutex> lock( mutex );
+	if ( error.empty() )
+	    error = why;
+	changed.notify_all();
+    }
+
+    bool failed() {
+	boost::lock_guard<boost::mutex> lock( mutex );
+	return !error.empty();
+    }
+
+    string directory;
+    int fd;
+    int uid;
+    int gid;
+
+    // zip: the entries, and the next one to extract
+    std::vector<ZipEntry> entries;
+    unsigned int next;
+
+    // tar: the files waiting for a writer, and their total size
+    std::deque<TarFile *> files;
+    unsigned int buffered;
+    bool finished;
+
+    string error;
+    boost::mutex mutex;
+    boost::condition_variable changed;
+};
+
+
+// tar members up to this size are handed to the writer threads, and
+// the reader stops when this many bytes are waiting to be written.
+enum { SmallFile = 1024 * 1024, Backlog = 16 * 1024 * 1024 };
+
+
+/*! \class Extractor extractor.h
+
+    The Extractor class unpacks an artifact file into a directory,
+    like the install script used to do, but without starting unzip,
+    tar and chown.
+
+    extract() supports .zip and .tar.gz files, and copies .jar files
+    as they are, as the script does. Each file is created with its
+    final mode and owner (see setOwner()), so there's no need for a
+    separate chown pass afterwards. Entries whose names are absolute
+    or contain .. are refused, and so are entries that would be
+    written through a symbolic link made by an earlier entry.
+
+    The archive is read once. A zip file's entries can be read in any
+    order, so a few threads (see setWorkers()) each take the next
+    entry until there are none left. A .tar.gz has to be decompressed
+    in order, so one thread does that, and the small files it finds
+    are written by the others while it goes on. Links are made last,
+    when all the files exist.
+
+    ZIP64 and encrypted zip files are not supported. Neither are
+    devices and fifos in tar files, which are skipped.
+*/
+
+
+/*! Constructs an Extractor that unpacks \a filename into \a
+    directory. extract() does the work.
+*/
+
+Extractor::Extractor( const string & f, const string & d )
+    : filename( f ), directory( d ),
+      uid( 0 ), gid( 0 ), workers( 4 )
+{
+}
+
+
+/*! Records that the unpacked files should be owned by \a uid and \a
+    gid. If \a uid is 0 (the default), they're owned by nodee.
+*/
+
+void Extractor::setOwner( int u, int g )
+{
+    uid = u;
+    gid = g;
+}
+
+
+/*! Records that extract() may use as many as \a n threads. The
+    default is 4. 1 means that extract() uses only its caller's
+    thread.
+*/
+
+void Extractor::setWorkers( int n )
+{
+    workers = n > 0 ? n : 1;
+}
+
+
+static bool endsWith( const string & s, const string & suffix )
+{
+    return s.size() >= suffix.size() &&
+	s.compare( s.size() - suffix.size(), suffix.size(), suffix ) == 0;
+}
+
+
+/*! Returns true if extract() knows what to do with \a filename, which
+    it does if the name ends in .zip, .tar.gz or .jar.
+*/
+
+bool Extractor::extractable( const string & filename )
+{
+    return endsWith( filename, ".zip" ) || endsWith( filename, ".tar.gz" ) ||
+	endsWith( filename, ".jar" );
+}
+
+
+// returns name without leading ./ and trailing /
+static string relative( const string & name )
+{
+    unsigned int b = 0;
+    while ( name.compare( b, 2, "./" ) == 0 ) {
+	b += 2;
+	while ( b < name.size() && name[b] == '/' )
+	    b++;
+    }
+    unsigned int e = name.size();
+    while ( e > b && name[e-1] == '/' )
+	e--;
+    if ( e - b == 1 && name[b] == '.' )
+	return string();
+    return name.substr( b, e - b );
+}
+
+
+// returns true if name stays inside the target directory
+static bool safe( const string & name )
+{
+    if ( name.empty() || name[0] == '/' )
+	return false;
+    unsigned int b = 0;
+    while ( b <= name.size() ) {
+	string::size_type e = name.find( '/', b );
+	if ( e == string::npos )
+	    e = name.size();
+	if ( name.compare( b, e - b, ".." ) == 0 )
+	    return false;
+	b = e + 1;
+    }
+    return true;
+}
+
+
+// creates the directories leading up to name, and checks that they
+// are directories, not symlinks to somewhere else.
+static bool parents( ExtractState * s, const string & name )
+{
+    string::size_type i = name.find( '/' );
+    while ( i != string::npos ) {
+	string p = s->directory + "/" + name.substr( 0, i );
+	if ( ::mkdir( p.c_str(), 0755 ) == 0 ) {
+	    if ( s->uid )
+		(void)::lchown( p.c_str(), s->uid, s->gid );
+	} else {
+	    struct stat st;
+	    if ( errno != EEXIST || ::lstat( p.c_str(), &st ) < 0 ||
+		 !S_ISDIR( st.st_mode ) )
+		return false;
+	}
+	i = name.find( '/', i + 1 );
+    }
+    return true;
+}
+
+
+// creates the directory name, with mode if that's nonzero. setuid
+// and setgid are dropped; the sticky bit may stay.
+static bool makeDirectory( ExtractState * s, const string & name, int mode )
+{
+    if ( !parents( s, name + "/" ) )
+	return false;
+    if ( mode )
+	(void)::chmod( ( s->directory + "/" + name ).c_str(),
+		       ( mode & 01777 ) | 0700 );
+    return true;
+}
+
+
+// creates the file name, with the right owner and mode, and returns
+// a file descriptor open for writing, or -1. setuid, setgid and
+// sticky bits are dropped: the file may belong to root, and it'll be
+// linked into the roots of services that run as other users.
+static int create( ExtractState * s, const string & name, int mode )
+{
+    if ( !parents( s, name ) )
+	return -1;
+    string p = s->directory + "/" + name;
+    ::unlink( p.c_str() );
+    int fd = ::open( p.c_str(),
+		     O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC,
+		     0600 );
+    if ( fd < 0 )
+	return -1;
+    if ( s->uid )
+	(void)::fchown( fd, s->uid, s->gid );
+    (void)::fchmod( fd, mode & 0777 ? mode & 0777 : 0644 );
+    return fd;
+}
+
+
+static bool writeAll( int fd, const char * b, unsigned int n )
+{
+    while ( n > 0 ) {
+	int w = ::write( fd, b, n );
+	if ( w < 0 && errno == EINTR )
+	    continue;
+	if ( w <= 0 )
+	    return false;
+	b += w;
+	n -= w;
+    }
+    return true;
+}
+
+
+static bool readAt( int fd, char * b, unsigned int n, off_t o )
+{
+    while ( n > 0 ) {
+	int r = ::pread( fd, b, n, o );
+	if ( r < 0 && errno == EINTR )
+	    continue;
+	if ( r <= 0 )
+	    return false;
+	b += r;
+	n -= r;
+	o += r;
+    }
+    return true;
+}
+
+
+// returns true if name is a regular file in the target directory,
+// and none of the directories leading to it is a symlink. link()
+// follows symlinks in the middle of a name, so a hard link to
+// "x/shadow" could otherwise pull in a file from the host.
+static bool plainFile( ExtractState * s, const string & name )
+{
+    struct stat st;
+    string::size_type i = name.find( '/' );
+    while ( i != string::npos ) {
+	string p = s->directory + "/" + name.substr( 0, i );
+	if ( ::lstat( p.c_str(), &st ) < 0 || !S_ISDIR( st.st_mode ) )
+	    return false;
+	i = name.find( '/', i + 1 );
+    }
+    string p = s->directory + "/" + name;
+    return ::lstat( p.c_str(), &st ) == 0 && S_ISREG( st.st_mode );
+}
+
+
+static bool isHardLink( const TarLink & l )
+{
+    return !l.symbolic;
+}
+
+
+// makes the link name, pointing to target
+static bool makeLink( ExtractState * s, const TarLink & l )
+{
+    if ( !parents( s, l.name ) )
+	return false;
+    if ( !l.symbolic && !plainFile( s, l.target ) )
+	return false;
+    string p = s->directory + "/" + l.name;
+    ::unlink( p.c_str() );
+    if ( !l.symbolic )
+	return ::link( ( s->directory + "/" + l.target ).c_str(),
+		       p.c_str() ) == 0;
+    if ( ::symlink( l.target.c_str(), p.c_str() ) < 0 )
+	return false;
+    if ( s->uid )
+	(void)::lchown( p.c_str(), s->uid, s->gid );
+    return true;
+}
+
+
+static unsigned int le16( const char * p )
+{
+    const unsigned char * u = (const unsigned char *)p;
+    return u[0] | ( u[1] << 8 );
+}
+
+
+static unsigned int le32( const char * p )
+{
+    const unsigned char * u = (const unsigned char *)p;
+    return u[0] | ( u[1] << 8 ) | ( u[2] << 16 ) | ( (unsigned int)u[3] << 24 );
+}
+
+
+// writes the decompressed contents of e to out, or appends them to
+// into if out is -1. checks the size and CRC.
+static bool unzip( ExtractState * s, const ZipEntry & e,
+		   int out, string * into )
+{
+    char h[30];
+    if ( !readAt( s->fd, h, 30, e.offset ) || le32( h ) != 0x04034b50 )
+	return false;
+    if ( e.method != 0 && e.method != Z_DEFLATED )
+	return false;
+
+    off_t o = (off_t)e.offset + 30 + le16( h + 26 ) + le16( h + 28 );
+    unsigned int left = e.csize;
+    uLong crc = crc32( 0, 0, 0 );
+    unsigned int total = 0;
+    std::vector<char> in( 65536 );
+    std::vector<char> buffer( 65536 );
+
+    bool inflating = e.method == Z_DEFLATED;
+    z_stream z;
+    ::memset( &z, 0, sizeof( z ) );
+    if ( inflating && inflateInit2( &z, -MAX_WBITS ) != Z_OK )
+	return false;
+
+    bool ok = true;
+    int r = Z_OK;
+    while ( ok && left > 0 && r != Z_STREAM_END ) {
+	unsigned int n = left < in.size() ? left : in.size();
+	ok = readAt( s->fd, &in[0], n, o );
+	o += n;
+	left -= n;
+	const char * b = &in[0];
+	if ( inflating ) {
+	    z.next_in = (Bytef *)&in[0];
+	    z.avail_in = n;
+	}
+	do {
+	    if ( inflating && ok ) {
+		z.next_out = (Bytef *)&buffer[0];
+		z.avail_out = buffer.size();
+		r = inflate( &z, Z_NO_FLUSH );
+		if ( r != Z_OK && r != Z_STREAM_END && r != Z_BUF_ERROR )
+		    ok = false;
+		b = &buffer[0];
+		n = buffer.size() - z.avail_out;
+	    }
+	    if ( ok && n ) {
+		crc = crc32( crc, (const Bytef *)b, n );
+		total += n;
+		if ( into )
+		    into->append( b, n );
+		else
+		    ok = writeAll( out, b, n );
+	    }
+	} while ( ok && inflating && z.avail_out == 0 && r != Z_STREAM_END );
+    }
+    if ( inflating ) {
+	inflateEnd( &z );
+	ok = ok && r == Z_STREAM_END;
+    }
+    return ok && total == e.usize && crc == e.crc;
+}
+
+
+// extracts zip entries until there are none left
+static void unzipFiles( ExtractState * s )
+{
+    while ( true ) {
+	unsigned int i;
+	{
+	    boost::lock_guard<boost::mutex> lock( s->mutex );
+	    if ( !s->error.empty() || s->next >= s->entries.size() )
+		return;
+	    i = s->next++;
+	}
+	const ZipEntry & e = s->entries[i];
+	int out = create( s, e.name, e.mode );
+	bool ok = out >= 0 && unzip( s, e, out, 0 );
+	if ( out >= 0 )
+	    ::close( out );
+	if ( !ok )
+	    s->fail( "Cannot extract " + e.name );
+    }
+}
+
+
+static bool extractZip( ExtractState * s, int workers )
+{
+    struct stat st;
+    if ( ::fstat( s->fd, &st ) < 0 )
+	return false;
+
+    // the end of central directory record is in the last 64k or so
+    unsigned int tail = st.st_size < 65557 ? st.st_size : 65557;
+    if ( tail < 22 ) {
+	s->fail( "Not a zip file" );
+	return false;
+    }
+    std::vector<char> t( tail );
+    if ( !readAt( s->fd, &t[0], tail, st.st_size - tail ) )
+	return false;
+    int i = tail - 22;
+    while ( i >= 0 && le32( &t[i] ) != 0x06054b50 )
+	i--;
+    if ( i < 0 ) {
+	s->fail( "Not a zip file" );
+	return false;
+    }
+    unsigned int count = le16( &t[i + 10] );
+    unsigned int size = le32( &t[i + 12] );
+    unsigned int offset = le32( &t[i + 16] );
+    if ( count == 0xffff || size == 0xffffffff || offset == 0xffffffff ) {
+	s->fail( "ZIP64 is not supported" );
+	return false;
+    }
+    if ( (off_t)offset + size > st.st_size ) {
+	s->fail( "Truncated zip file" );
+	return false;
+    }
+
+    std::vector<char> cd( size + 1 );
+    if ( !readAt( s->fd, &cd[0], size, offset ) )
+	return false;
+
+    // directories are made at once, the rest later. if a name occurs
+    // twice, the last one wins.
+    std::map<string, unsigned int> names;
+    std::vector<ZipEntry> links;
+    unsigned int p = 0;
+    unsigned int n = 0;
+    while ( n < count ) {
+	if ( p + 46 > size || le32( &cd[p] ) != 0x02014b50 ||
+	     p + 46 + le16( &cd[p + 28] ) > size ) {
+	    s->fail( "Bad zip central directory" );
+	    return false;
+	}
+	ZipEntry e;
+	unsigned int host = (unsigned char)cd[p + 5];
+	unsigned int flags = le16( &cd[p + 8] );
+	e.method = le16( &cd[p + 10] );
+	e.crc = le32( &cd[p + 16] );
+	e.csize = le32( &cd[p + 20] );
+	e.usize = le32( &cd[p + 24] );
+	e.mode = host == 3 ? le32( &cd[p + 38] ) >> 16 : 0;
+	e.offset = le32( &cd[p + 42] );
+	string raw( &cd[p + 46], le16( &cd[p + 28] ) );
+	p += 46 + le16( &cd[p + 28] ) + le16( &cd[p + 30] ) +
+	     le16( &cd[p + 32] );
+	n++;
+
+	e.name = relative( raw );
+	if ( e.name.empty() )
+	    continue;
+	if ( !safe( e.name ) ) {
+	    s->fail( "Unsafe name in zip file: " + raw );
+	    return false;
+	}
+	if ( flags & 1 ) {
+	    s->fail( "Encrypted zip files are not supported" );
+	    return false;
+	}
+	if ( raw[raw.size() - 1] == '/' || S_ISDIR( e.mode ) ) {
+	    if ( !makeDirectory( s, e.name, e.mode & 07777 ) ) {
+		s->fail( "Cannot create directory " + e.name );
+		return false;
+	    }
+	} else if ( S_ISLNK( e.mode ) ) {
+	    links.push_back( e );
+	} else {
+	    std::map<string, unsigned int>::iterator d = names.find( e.name );
+	    if ( d == names.end() ) {
+		names[e.name] = s->entries.size();
+		s->entries.push_back( e );
+	    } else {
+		s->entries[d->second] = e;
+	    }
+	}
+    }
+
+    // a thread per 16 files, but no more than we may
+    unsigned int threads = s->entries.size() / 16 + 1;
+    if ( threads > (unsigned int)workers )
+	threads = workers;
+    boost::thread_group pool;
+    while ( threads > 1 ) {
+	pool.create_thread( boost::bind( &unzipFiles, s ) );
+	threads--;
+    }
+    try {
+	unzipFiles( s );
+    } catch ( ... ) {
+	s->fail( "Cannot extract zip file" );
+    }
+    pool.join_all();
+
+    std::vector<ZipEntry>::iterator l = links.begin();
+    while ( l != links.end() && !s->failed() ) {
+	TarLink link;
+	link.name = l->name;
+	link.symbolic = true;
+	if ( !unzip( s, *l, -1, &link.target ) || !makeLink( s, link ) )
+	    s->fail( "Cannot create symbolic link " + l->name );
+	++l;
+    }
+    return !s->failed();
+}
+
+
+// writes the TarFiles queued by extractTar() until there are no more
+static void writeTarFiles( ExtractState * s )
+{
+    while ( true ) {
+	TarFile * f = 0;
+	{
+	    boost::unique_lock<boost::mutex> lock( s->mutex );
+	    while ( s->files.empty() && !s->finished && s->error.empty() )
+		s->changed.wait( lock );
+	    if ( s->files.empty() || !s->error.empty() )
+		return;
+	    f = s->files.front();
+	    s->files.pop_front();
+	}
+	int out = create( s, f->name, f->mode );
+	bool ok = out >= 0 && writeAll( out, f->data.data(), f->data.size() );
+	if ( out >= 0 )
+	    ::close( out );
+	{
+	    boost::lock_guard<boost::mutex> lock( s->mutex );
+	    s->buffered -= f->data.size();
+	    s->changed.notify_all();
+	}
+	if ( !ok )
+	    s->fail( "Cannot write " + f->name );
+	delete f;
+    }
+}
+
+
+static bool readFully( gzFile g, char * b, unsigned int n )
+{
+    while ( n > 0 ) {
+	int r = gzread( g, b, n );
+	if ( r <= 0 )
+	    return false;
+	b += r;
+	n -= r;
+    }
+    return true;
+}
+
+
+static bool skip( gzFile g, unsigned long long n )
+{
+    char b[65536];
+    while ( n > 0 ) {
+	unsigned int l = n < sizeof( b ) ? n : sizeof( b );
+	if ( !readFully( g, b, l ) )
+	    return false;
+	n -= l;
+    }
+    return true;
+}
+
+
+// returns the NUL-terminated string at p, which is at most n bytes
+static string field( const char * p, unsigned int n )
+{
+    unsigned int l = 0;
+    while ( l < n && p[l] )
+	l++;
+    return string( p, l );
+}
+
+
+// parses a tar number, which is octal or (GNU) base-256
+static unsigned long long number( const char * p, unsigned int n )
+{
+    unsigned long long r = 0;
+    unsigned int i = 0;
+    if ( p[0] & 0x80 ) {
+	r = p[0] & 0x7f;
+	while ( ++i < n )
+	    r = ( r << 8 ) | (unsigned char)p[i];
+	return r;
+    }
+    while ( i < n && p[i] == ' ' )
+	i++;
+    while ( i < n && p[i] >= '0' && p[i] <= '7' )
+	r = r * 8 + p[i++] - '0';
+    return r;
+}
+
+
+// looks for key in a pax extended header, and stores its value
+static void pax( const string & h, const string & key, string & value )
+{
+    unsigned int p = 0;
+    while ( p < h.size() ) {
+	unsigned int l = 0;
+	unsigned int i = p;
+	while ( i < h.size() && h[i] >= '0' && h[i] <= '9' )
+	    l = l * 10 + h[i++] - '0';
+	if ( l == 0 || p + l > h.size() || i >= h.size() || h[i] != ' ' )
+	    return;
+	unsigned int k = i + 1;
+	string::size_type eq = h.find( '=', k );
+	if ( eq < p + l && h.compare( k, eq - k, key ) == 0 )
+	    value = h.substr( eq + 1, p + l - eq - 2 );
+	p += l;
+    }
+}
+
+
+static bool extractTar( ExtractState * s, int workers )
+{
+    int fd = ::dup( s->fd );
+    gzFile g = fd >= 0 ? gzdopen( fd, "rb" ) : 0;
+    if ( !g ) {
+	if ( fd >= 0 )
+	    ::close( fd );
+	return false;
+    }
+    gzbuffer( g, 131072 );
+
+    boost::thread_group pool;
+    int writers = 0;
+    std::set<string> queued;
+    std::vector<TarLink> links;
+    string longName;
+    string longLink;
+    char h[512];
+    std::vector<char> b( 65536 );
+    bool ok = true;
+    // the writers use s, so nothing may leave this function before
+    // they've been joined.
+    try {
+	while ( ok ) {
+	    if ( !readFully( g, h, 512 ) ) {
+		s->fail( "Truncated tar file" );
+		break;
+	    }
+	    unsigned int sum = 0;
+	    int i = 0;
+	    while ( i < 512 ) {
+		sum += ( i >= 148 && i < 156 ) ? ' ' : (unsigned char)h[i];
+		i++;
+	    }
+	    if ( sum == 256 )
+		break; // an all-zero block ends the archive
+	    if ( sum != number( h + 148, 8 ) ) {
+		s->fail( "Bad tar header checksum" );
+		break;
+	    }
+
+	    string raw = longName.empty() ? field( h, 100 ) : longName;
+	    if ( longName.empty() && !::memcmp( h + 257, "ustar", 5 ) && h[345] )
+		raw = field( h + 345, 155 ) + "/" + raw;
+	    string target = longLink.empty() ? field( h + 157, 100 ) : longLink;
+	    unsigned long long size = number( h + 124, 12 );
+	    unsigned long long padding = ( 512 - size % 512 ) % 512;
+	    int mode = number( h + 100, 8 ) & 07777;
+	    char type = h[156];
+
+	    if ( type == 'L' || type == 'K' || type == 'x' ) {
+		// GNU long names and pax headers apply to the next member.
+		// the size may be anything, so check it before allocating.
+		if ( size > 65536 ) {
+		    s->fail( "Bad tar extension header" );
+		    break;
+		}
+		string d( size, '\0' );
+		if ( ( size && !readFully( g, &d[0], size ) ) ||
+		     !skip( g, padding ) ) {
+		    s->fail( "Bad tar extension header" );
+		    break;
+		}
+		if ( type == 'L' )
+		    longName = field( d.data(), d.size() );
+		else if ( type == 'K' )
+		    longLink = field( d.data(), d.size() );
+		else {
+		    pax( d, "path", longName );
+		    pax( d, "linkpath", longLink );
+		}
+		continue;
+	    }
+	    longName.clear();
+	    longLink.clear();
+
+	    string name = relative( raw );
+	    if ( name.empty() || type == 'g' ) {
+		ok = skip( g, size + padding );
+		continue;
+	    }
+	    if ( !safe( name ) ) {
+		s->fail( "Unsafe name in tar file: " + raw );
+		break;
+	    }
+
+	    if ( type == '5' ) {
+		if ( !makeDirectory( s, name, mode ) )
+		    s->fail( "Cannot create directory " + name );
+		ok = skip( g, size + padding );
+	    } else if ( type == '1' || type == '2' ) {
+		TarLink l;
+		l.name = name;
+		l.target = type == '1' ? relative( target ) : target;
+		l.symbolic = type == '2';
+		if ( !l.symbolic && !safe( l.target ) ) {
+		    s->fail( "Unsafe link in tar file: " + raw );
+		    break;
+		}
+		links.push_back( l );
+		ok = skip( g, size + padding );
+	    } else if ( type != '0' && type != '\0' && type != '7' ) {
+		ok = skip( g, size + padding );
+	    } else if ( workers > 1 && size <= SmallFile &&
+			queued.insert( name ).second ) {
+		// a small file: read it and let a writer write it
+		TarFile * f = new TarFile;
+		f->name = name;
+		f->mode = mode;
+		f->data.resize( size );
+		if ( ( size && !readFully( g, &f->data[0], size ) ) ||
+		     !skip( g, padding ) ) {
+		    delete f;
+		    s->fail( "Truncated tar file" );
+		    break;
+		}
+		boost::unique_lock<boost::mutex> lock( s->mutex );
+		while ( s->buffered > Backlog && s->error.empty() )
+		    s->changed.wait( lock );
+		s->files.push_back( f );
+		s->buffered += size;
+		s->changed.notify_all();
+		if ( writers < workers ) {
+		    pool.create_thread( boost::bind( &writeTarFiles, s ) );
+		    writers++;
+		}
+	    } else {
+		// a large file, or one that's queued already, which might
+		// still be waiting for a writer. write it ourselves.
+		if ( queued.count( name ) ) {
+		    boost::unique_lock<boost::mutex> lock( s->mutex );
+		    while ( s->buffered > 0 && s->error.empty() )
+			s->changed.wait( lock );
+		}
+		int out = create( s, name, mode );
+		unsigned long long left = size;
+		while ( out >= 0 && left > 0 && ok ) {
+		    unsigned int n = left < b.size() ? left : b.size();
+		    ok = readFully( g, &b[0], n ) && writeAll( out, &b[0], n );
+		    left -= n;
+		}
+		if ( out >= 0 )
+		    ::close( out );
+		if ( out < 0 || !ok )
+		    s->fail( "Cannot extract " + name );
+		ok = ok && skip( g, padding );
+	    }
+	    ok = ok && !s->failed();
+	}
+    } catch ( ... ) {
+	s->fail( "Cannot extract tar file" );
+	ok = false;
+    }
+    if ( !ok )
+	s->fail( "Truncated tar file" );
+
+    {
+	boost::lock_guard<boost::mutex> lock( s->mutex );
+	s->finished = true;
+	s->changed.notify_all();
+    }
+    pool.join_all();
+    while ( !s->files.empty() ) {
+	delete s->files.front();
+	s->files.pop_front();
+    }
+    gzclose( g );
+
+    // hard links first, so that they can't pass through any of the
+    // archive's symlinks
+    std::stable_partition( links.begin(), links.end(), isHardLink );
+    std::vector<TarLink>::iterator l = links.begin();
+    while ( l != links.end() && !s->failed() ) {
+	if ( !makeLink( s, *l ) )
+	    s->fail( "Cannot create link " + l->name );
+	++l;
+    }
+    return !s->failed();
+}
+
+
+// copies the jar, as it is, into the directory
+static bool copyJar( ExtractState * s, const string & filename )
+{
+    string name = filename.substr( filename.rfind( '/' ) + 1 );
+    int out = create( s, name, 0644 );
+    if ( out < 0 )
+	return false;
+    char b[65536];
+    int n;
+    bool ok = true;
+    while ( ok && ( n = ::read( s->fd, b, sizeof( b ) ) ) > 0 )
+	ok = writeAll( out, b, n );
+    ::close( out );
+    return ok && n == 0;
+}
+
+
+/*! Unpacks the file into the directory, creating the directory if
+    necessary. Returns true if all went well, and false (and sets
+    error()) if not. Files that were unpacked before the error are
+    left in place; the caller should remove the directory.
+
+    A subdirectory called tmp is created, as the install script did.
+*/
+
+bool Extractor::extract()
+{
+    ExtractState s;
+    s.directory = directory;
+    s.uid = uid;
+    s.gid = gid;
+
+    try {
+	boost::filesystem::create_directories( directory );
+    } catch ( ... ) {
+	e = "Cannot create " + directory;
+	return false;
+    }
+    if ( !makeDirectory( &s, "tmp", 0 ) ) {
+	e = "Cannot create " + directory + "/tmp";
+	return false;
+    }
+
+    s.fd = ::open( filename.c_str(), O_RDONLY | O_CLOEXEC );
+    if ( s.fd < 0 ) {
+	e = "Cannot open " + filename + ": " + ::strerror( errno );
+	return false;
+    }
+
+    bool ok = false;
+    if ( endsWith( filename, ".zip" ) )
+	ok = extractZip( &s, workers );
+    else if ( endsWith( filename, ".tar.gz" ) )
+	ok = extractTar( &s, workers );
+    else if ( endsWith( filename, ".jar" ) )
+	ok = copyJar( &s, filename );
+    else
+	s.fail( "Unknown file type" );
+    ::close( s.fd );
+
+    if ( !ok )
+	e = filename + ": " + ( s.error.empty() ? "Read error" : s.error );
+    return ok;
+}
@@ -0,0 +1,34 @@
+// Copyright Arnt Gulbrandsen <arnt@gulbrandsen.priv.no>; BSD-licensed.
+
+#ifndef EXTRACTOR_H
+#define EXTRACTOR_H
+
+#include <string>
+
+using namespace std;
+
+
+class Extractor
+{
+public:
+    Extractor( const string &, const string & );
+
+    void setOwner( int, int );
+    void setWorkers( int );
+
+    bool extract();
+
+    string error() const { return e; }
+
+    static bool extractable( const string & );
+
+private:
+    string filename;
+    string directory;
+    int uid;
+    int gid;
+    int workers;
+    string e;
+};
+
+#endif
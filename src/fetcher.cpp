@@ -0,0 +1,705 @@
+// Copyright Arnt Gulbrandsen <arnt@gulbrandsen.priv.no>; BSD-licensed.
+
+#include "fetcher.h"
+
+#include "init.h"
+#include "log.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+
+#include <openssl/evp.h>
+
+#include <algorithm>
+
+#include <boost/lexical_cast.hpp>
+#include <boost/thread.hpp>
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+#define EVP_MD_CTX_new EVP_MD_CTX_create
+#define EVP_MD_CTX_free EVP_MD_CTX_destroy
+#endif
+
+
+// an MD5 and a SHA-256 digest, computed together as the bytes arrive
+class FetchDigests
+{
+public:
+    FetchDigests()
+	: md5( EVP_MD_CTX_new() ), sha256( EVP_MD_CTX_new() ) {
+	reset();
+    }
+    ~FetchDigests() {
+	EVP_MD_CTX_free( md5 );
+	EVP_MD_CTX_free( sha256 );
+    }
+
+    void reset() {
+	EVP_DigestInit_ex( md5, EVP_md5(), 0 );
+	EVP_DigestInit_ex( sha256, EVP_sha256(), 0 );
+    }
+
+    void update( const char * b, int n ) {
+	EVP_DigestUpdate( md5, b, n );
+	EVP_DigestUpdate( sha256, b, n );
+    }
+
+    void finish( string & m, string & s ) {
+	m = hex( md5 );
+	s = hex( sha256 );
+    }
+
+private:
+    static string hex( EVP_MD_CTX * c ) {
+	unsigned char d[EVP_MAX_MD_SIZE];
+	unsigned int l = 0;
+	EVP_DigestFinal_ex( c, d, &l );
+	string r;
+	unsigned int i = 0;
+	while ( i < l ) {
+	    r.push_back( "0123456789abcdef"[d[i] >> 4] );
+	    r.push_back( "0123456789abcdef"[d[i] & 15] );
+	    i++;
+	}
+	return r;
+    }
+
+    EVP_MD_CTX * md5;
+    EVP_MD_CTX * sha256;
+};
+
+
+static boost::mutex peerMutex;
+static vector<string> knownPeers;
+
+
+// the parts of an http URL we care about
+struct FetchUrl
+{
+    bool valid;
+    string host;
+    string port;
+    string path;
+    string auth;
+};
+
+
+static string base64( const string & in )
+{
+    static const char * a =
+	"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    string r;
+    unsigned int i = 0;
+    while ( i < in.size() ) {
+	unsigned int n = (unsigned char)in[i] << 16;
+	if ( i + 1 < in.size() )
+	    n |= (unsigned char)in[i+1] << 8;
+	if ( i + 2 < in.size() )
+	    n |= (unsigned char)in[i+2];
+	r.push_back( a[( n >> 18 ) & 63] );
+	r.push_back( a[( n >> 12 ) & 63] );
+	r.push_back( i + 1 < in.size() ? a[( n >> 6 ) & 63] : '=' );
+	r.push_back( i + 2 < in.size() ? a[n & 63] : '=' );
+	i += 3;
+    }
+    return r;
+}
+
+
+static FetchUrl parse( const string & url )
+{
+    FetchUrl u;
+    u.valid = false;
+    if ( url.substr( 0, 7 ) != "http://" )
+	return u;
+    string::size_type slash = url.find( '/', 7 );
+    string authority = url.substr( 7, slash == string::npos
+					  ? string::npos : slash - 7 );
+    u.path = slash == string::npos ? string( "/" ) : url.substr( slash );
+    string::size_type at = authority.rfind( '@' );
+    if ( at != string::npos ) {
+	u.auth = base64( authority.substr( 0, at ) );
+	authority = authority.substr( at + 1 );
+    }
+    u.port = "80";
+    string::size_type colon = authority.rfind( ':' );
+    if ( colon != string::npos && authority.find( ']', colon ) == string::npos ) {
+	u.port = authority.substr( colon + 1 );
+	authority = authority.substr( 0, colon );
+    }
+    if ( authority.size() > 2 && authority[0] == '[' )
+	authority = authority.substr( 1, authority.size() - 2 );
+    u.host = authority;
+    u.valid = !u.host.empty() && !u.port.empty();
+    return u;
+}
+
+
+static int connectTo( const FetchUrl & u, int patience )
+{
+    struct addrinfo hints;
+    ::memset( &hints, 0, sizeof( hints ) );
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo * result = 0;
+    if ( ::getaddrinfo( u.host.c_str(), u.port.c_str(), &hints, &result ) )
+	return -1;
+
+    int fd = -1;
+    struct addrinfo * a = result;
+    while ( a && fd < 0 ) {
+	fd = ::socket( a->ai_family, a->ai_socktype, a->ai_protocol );
+	if ( fd >= 0 ) {
+	    // a server that stops sending is as bad as one that's gone
+	    struct timeval tv;
+	    tv.tv_sec = patience;
+	    tv.tv_usec = 0;
+	    ::setsockopt( fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof( tv ) );
+	    ::setsockopt( fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof( tv ) );
+	    if ( ::connect( fd, a->ai_addr, a->ai_addrlen ) < 0 ) {
+		::close( fd );
+		fd = -1;
+	    }
+	}
+	a = a->ai_next;
+    }
+    ::freeaddrinfo( result );
+    return fd;
+}
+
+
+static bool writeAll( int fd, const char * b, int n )
+{
+    while ( n > 0 ) {
+	int w = ::write( fd, b, n );
+	if ( w < 0 && errno == EINTR )
+	    continue;
+	if ( w <= 0 )
+	    return false;
+	b += w;
+	n -= w;
+    }
+    return true;
+}
+
+
+// returns the value of header \a name in \a headers, or an empty
+// string.
+static string header( const string & headers, const char * name )
+{
+    string::size_type l = ::strlen( name );
+    string::size_type i = headers.find( "\r\n" );
+    while ( i != string::npos ) {
+	i += 2;
+	if ( !::strncasecmp( headers.c_str() + i, name, l ) &&
+	     headers[i+l] == ':' ) {
+	    string::size_type s = i + l + 1;
+	    while ( s < headers.size() && headers[s] == ' ' )
+		s++;
+	    string::size_type e = headers.find( "\r\n", s );
+	    return headers.substr( s, e == string::npos ? e : e - s );
+	}
+	i = headers.find( "\r\n", i );
+    }
+    return string();
+}
+
+
+enum FetchResult { Done, Retry, Redirect, Fail };
+
+
+// makes one request for \a url, and appends what it gets to \a fd,
+// which already contains \a have bytes. may update all its arguments.
+// calls progress, if set, as data arrives. gives up on a server that
+// says nothing for patience seconds.
+static FetchResult request( string & url, int fd, long long & have,
+			    FetchDigests & digests, string & error,
+			    const boost::function<void (long long, long long)> &
+			    progress, int patience )
+{
+    FetchUrl u = parse( url );
+    if ( !u.valid ) {
+	error = "Cannot parse URL " + url;
+	return Fail;
+    }
+
+    int s = connectTo( u, patience );
+    if ( s < 0 ) {
+	error = "Cannot connect to " + u.host;
+	return Retry;
+    }
+
+    string r = "GET " + u.path + " HTTP/1.0\r\n"
+	       "Host: " + u.host + ( u.port == "80" ? "" : ":" + u.port ) +
+	       "\r\n"
+	       "User-Agent: nodee\r\n"
+	       "Connection: close\r\n";
+    if ( !u.auth.empty() )
+	r += "Authorization: Basic " + u.auth + "\r\n";
+    if ( have > 0 )
+	r += "Range: bytes=" + boost::lexical_cast<string>( have ) + "-\r\n";
+    r += "\r\n";
+    if ( ::send( s, r.data(), r.size(), MSG_NOSIGNAL ) != (int)r.size() ) {
+	::close( s );
+	error = "Cannot send request to " + u.host;
+	return Retry;
+    }
+
+    // read the response header, and perhaps the start of the body
+    char b[65536];
+    string headers;
+    string::size_type end = string::npos;
+    while ( end == string::npos && headers.size() < 65536 ) {
+	int n = ::recv( s, b, sizeof( b ), 0 );
+	if ( n < 0 && errno == EINTR )
+	    continue;
+	if ( n <= 0 )
+	    break;
+	headers.append( b, n );
+	end = headers.find( "\r\n\r\n" );
+    }
+    if ( end == string::npos ) {
+	::close( s );
+	error = "No response header from " + u.host;
+	return Retry;
+    }
+    string body = headers.substr( end + 4 );
+    headers.resize( end + 2 );
+
+    int status = 0;
+    string::size_type sp = headers.find( ' ' );
+    if ( sp != string::npos )
+	status = ::atoi( headers.c_str() + sp + 1 );
+
+    long long length = -1;
+    string cl = header( headers, "Content-Length" );
+    if ( !cl.empty() )
+	length = ::atoll( cl.c_str() );
+
+    if ( status == 301 || status == 302 || status == 303 ||
+	 status == 307 || status == 308 ) {
+	::close( s );
+	string l = header( headers, "Location" );
+	if ( l.empty() ) {
+	    error = "Redirect without Location";
+	    return Fail;
+	}
+	if ( l[0] == '/' )
+	    l = "http://" + u.host + ":" + u.port + l;
+	url = l;
+	return Redirect;
+    }
+
+    bool restart = false;
+    if ( status == 200 ) {
+	restart = have > 0;
+    } else if ( status == 206 ) {
+	// Content-Range: bytes 1000-1999/2000
+	string cr = header( headers, "Content-Range" );
+	string::size_type d = cr.find_first_of( "0123456789" );
+	if ( d == string::npos || ::atoll( cr.c_str() + d ) != have ) {
+	    ::close( s );
+	    error = "Bad Content-Range from " + u.host;
+	    have = 0;
+	    digests.reset();
+	    if ( ::ftruncate( fd, 0 ) < 0 || ::lseek( fd, 0, SEEK_SET ) < 0 )
+		return Fail;
+	    return Retry;
+	}
+    } else if ( status == 416 ) {
+	// the server doesn't like our range. start over.
+	restart = true;
+    } else {
+	::close( s );
+	error = "HTTP status " + boost::lexical_cast<string>( status ) +
+		" from " + u.host;
+	if ( status == 408 || status == 429 || status >= 500 )
+	    return Retry;
+	return Fail;
+    }
+
+    if ( restart ) {
+	have = 0;
+	digests.reset();
+	if ( ::ftruncate( fd, 0 ) < 0 || ::lseek( fd, 0, SEEK_SET ) < 0 ) {
+	    ::close( s );
+	    error = "Cannot truncate temporary file";
+	    return Fail;
+	}
+	if ( status == 416 ) {
+	    ::close( s );
+	    return Retry;
+	}
+    }
+
+    long long expected = length >= 0 ? have + length : -1;
+
+    // now the body. it's written to disk and digested in the same
+    // pass, so nothing ever reads the file again.
+    const char * p = body.data();
+    int n = body.size();
+    bool broken = false;
+    while ( true ) {
+	if ( expected >= 0 && have + n > expected )
+	    n = expected - have;
+	if ( n > 0 ) {
+	    if ( !writeAll( fd, p, n ) ) {
+		::close( s );
+		error = "Cannot write: " + string( ::strerror( errno ) );
+		return Fail;
+	    }
+	    digests.update( p, n );
+	    have += n;
+	    if ( progress )
+		progress( have, expected );
+	}
+	if ( expected >= 0 && have >= expected )
+	    break;
+	n = ::recv( s, b, sizeof( b ), 0 );
+	if ( n < 0 && errno == EINTR ) {
+	    n = 0;
+	    continue;
+	}
+	if ( n <= 0 ) {
+	    broken = n < 0;
+	    break;
+	}
+	p = b;
+    }
+    ::close( s );
+
+    if ( broken || ( expected >= 0 && have < expected ) ) {
+	error = "Connection to " + u.host + " broke";
+	return Retry;
+    }
+    return Done;
+}
+
+
+/*! \class Fetcher fetcher.h
+
+    The Fetcher class downloads an artifact over HTTP, within nodee.
+
+    It replaces the download script (which is still used for URLs
+    other than http://), and does the same job with less I/O: The
+    file is written and digested in one pass, so there's no need to
+    read it again to check its MD5 sum.
+
+    The data is written to an anonymous file (O_TMPFILE) in the
+    destination directory, which is linked in under its real name
+    only when it's complete and has the expected digests. Until then
+    nobody can see the partial file, and if nodee dies, the kernel
+    removes it. On filesystems without O_TMPFILE, a file called
+    filename.part is used instead, and renamed at the end.
+
+    If a connection breaks, the next attempt asks for the rest of the
+    file using a Range request, unless the server ignores that, in
+    which case it starts over. Failed attempts are retried after an
+    increasing delay, as computed by Init::backoff().
+
+    If the file's digest is known, fetch() first asks a few of the
+    peers() for it, since other nodees are usually closer than the
+    depot and much less busy when many hosts start the same new
+    version at once. The digest tells whether a peer's copy is right.
+    A peer that doesn't have the file, is busy or sends the wrong
+    thing gets one try, then the next is asked, and finally the
+    depot.
+
+    fetch() blocks, so it should run in a thread of its own. Launcher
+    does that.
+*/
+
+
+/*! Constructs a Fetcher to fetch \a url to \a filename. Nothing
+    happens until fetch() is called.
+*/
+
+Fetcher::Fetcher( const string & u, const string & f )
+    : url( u ), filename( f ), attempts( 4 ), r( 0 )
+{
+}
+
+
+/*! Records that the file's MD5 sum must be \a md5, in hex. */
+
+void Fetcher::setMd5( const string & md5 )
+{
+    expectedMd5 = md5;
+}
+
+
+/*! Records that the file's SHA-256 sum must be \a sha256, in hex. */
+
+void Fetcher::setSha256( const string & sha256 )
+{
+    expectedSha256 = sha256;
+}
+
+
+/*! Records that fetch() should give up after \a n failed attempts. The
+    default is 4.
+*/
+
+void Fetcher::setAttempts( int n )
+{
+    attempts = n;
+}
+
+
+/*! Records that fetch() should call \a callback as data arrives,
+    with the number of bytes received so far and the expected size
+    of the file, or -1 if the server didn't say. The callback runs in
+    fetch()'s thread, and fetch() waits for it to return, which
+    Launcher uses to limit the bandwidth.
+*/
+
+void Fetcher::setProgress( boost::function<void (long long, long long)>
+			   callback )
+{
+    progress = callback;
+}
+
+
+/*! Fetches the file, unless it's already there and has the right
+    digests, and returns true if the file is there when this returns.
+
+    If the file is there and no digest was specified, it's assumed to
+    be right, as the download script always did. md5() and sha256()
+    return empty strings in that case.
+*/
+
+bool Fetcher::fetch()
+{
+    if ( ::access( filename.c_str(), R_OK ) == 0 ) {
+	if ( expectedMd5.empty() && expectedSha256.empty() )
+	    return true;
+	if ( digest( filename, m, s ) &&
+	     matches( expectedMd5, m ) && matches( expectedSha256, s ) )
+	    return true;
+	debug << "nodee: Cached " << filename << " is stale" << endl;
+	::unlink( filename.c_str() );
+    }
+
+    string dir = ".";
+    string::size_type slash = filename.rfind( '/' );
+    if ( slash != string::npos )
+	dir = filename.substr( 0, slash ? slash : 1 );
+    string part;
+    int fd = -1;
+#if defined(O_TMPFILE)
+    fd = ::open( dir.c_str(), O_TMPFILE | O_RDWR, 0644 );
+#endif
+    if ( fd < 0 ) {
+	part = filename + ".part";
+	fd = ::open( part.c_str(), O_CREAT | O_TRUNC | O_RDWR, 0644 );
+    }
+    if ( fd < 0 ) {
+	e = "Cannot create a file in " + dir + ": " + ::strerror( errno );
+	return false;
+    }
+
+    FetchDigests digests;
+    long long have = 0;
+    FetchResult result = Retry;
+
+    vector<string> p;
+    if ( !expectedMd5.empty() || !expectedSha256.empty() )
+	p = peers();
+    std::random_shuffle( p.begin(), p.end() );
+    if ( p.size() > 3 )
+	p.resize( 3 );
+    string name = filename.substr( slash == string::npos ? 0 : slash + 1 );
+    vector<string>::iterator peer = p.begin();
+    while ( result != Done && peer != p.end() ) {
+	string u = "http://" + *peer + "/artifact/file/" + name;
+	r++;
+	result = request( u, fd, have, digests, e, progress, 5 );
+	if ( result == Done ) {
+	    digests.finish( m, s );
+	    if ( !matches( expectedMd5, m ) || !matches( expectedSha256, s ) ) {
+		e = "Digest mismatch";
+		result = Retry;
+	    }
+	}
+	if ( result != Done ) {
+	    debug << "nodee: Fetching " << u << ": " << e << endl;
+	    // whatever it sent is worthless now
+	    have = 0;
+	    digests.reset();
+	    if ( ::ftruncate( fd, 0 ) < 0 || ::lseek( fd, 0, SEEK_SET ) < 0 )
+		peer = p.end();
+	    else
+		++peer;
+	}
+    }
+    bool peered = result == Done;
+    if ( peered )
+	debug << "nodee: Fetched " << name << " from " << *peer << endl;
+    else
+	result = Retry;
+
+    string u = url;
+    int failures = 0;
+    int redirects = 0;
+    while ( result != Done && result != Fail ) {
+	r++;
+	result = request( u, fd, have, digests, e, progress, 60 );
+	if ( result == Redirect && ++redirects > 5 ) {
+	    e = "Too many redirects";
+	    result = Fail;
+	} else if ( result == Retry ) {
+	    failures++;
+	    debug << "nodee: Fetching " << url << ": " << e << endl;
+	    if ( failures >= attempts )
+		result = Fail;
+	    else
+		::sleep( Init::backoff( 1, failures ) );
+	}
+    }
+
+    bool ok = result == Done;
+    if ( ok && !peered ) {
+	digests.finish( m, s );
+	if ( !matches( expectedMd5, m ) || !matches( expectedSha256, s ) ) {
+	    e = "Digest mismatch for " + url;
+	    ok = false;
+	}
+    }
+
+    if ( ok && ( ::fchmod( fd, 0644 ) < 0 || ::fsync( fd ) < 0 ) ) {
+	e = "Cannot write " + filename + ": " + ::strerror( errno );
+	ok = false;
+    }
+
+    if ( ok && part.empty() ) {
+	// link the anonymous file in under a temporary name, then
+	// rename that over the real name, which is atomic.
+	part = filename + "." + boost::lexical_cast<string>( ::getpid() ) +
+	       ".tmp";
+	::unlink( part.c_str() );
+	string proc = "/proc/self/fd/" + boost::lexical_cast<string>( fd );
+	if ( ::linkat( AT_FDCWD, proc.c_str(), AT_FDCWD, part.c_str(),
+		       AT_SYMLINK_FOLLOW ) < 0 ) {
+	    e = "Cannot link " + part + ": " + ::strerror( errno );
+	    ok = false;
+	    part.clear();
+	}
+    }
+    ::close( fd );
+    if ( ok && ::rename( part.c_str(), filename.c_str() ) < 0 ) {
+	e = "Cannot rename " + part + ": " + ::strerror( errno );
+	ok = false;
+    }
+    if ( !ok && !part.empty() )
+	::unlink( part.c_str() );
+
+    if ( ok )
+	debug << "nodee: Fetched " << url << " (" << have << " bytes)"
+	      << endl;
+    else
+	debug << "nodee: Could not fetch " << url << ": " << e << endl;
+    return ok;
+}
+
+
+/*! Records that \a peers are other nodees that may have artifacts
+    to share. Each is host:port, or [address]:port for IPv6, and the
+    list replaces any earlier list.
+*/
+
+void Fetcher::setPeers( const vector<string> & peers )
+{
+    boost::lock_guard<boost::mutex> lock( peerMutex );
+    knownPeers = peers;
+}
+
+
+/*! Returns the list of peers set by setPeers(). */
+
+vector<string> Fetcher::peers()
+{
+    boost::lock_guard<boost::mutex> lock( peerMutex );
+    return knownPeers;
+}
+
+
+/*! Returns true if \a url is one Fetcher can fetch, and false if the
+    download script has to do it.
+*/
+
+bool Fetcher::fetchable( const string & url )
+{
+    return parse( url ).valid;
+}
+
+
+/*! Computes the MD5 and SHA-256 sums of \a filename, in hex, and
+    stores them in \a md5 and \a sha256. Returns true if all went
+    well and false if the file couldn't be read.
+*/
+
+bool Fetcher::digest( const string & filename, string & md5, string & sha256 )
+{
+    int fd = ::open( filename.c_str(), O_RDONLY );
+    if ( fd < 0 )
+	return false;
+    FetchDigests digests;
+    char b[65536];
+    int n = 0;
+    do {
+	n = ::read( fd, b, sizeof( b ) );
+	if ( n > 0 )
+	    digests.update( b, n );
+    } while ( n > 0 || ( n < 0 && errno == EINTR ) );
+    ::close( fd );
+    if ( n < 0 )
+	return false;
+    digests.finish( md5, sha256 );
+    return true;
+}
+
+
+/*! Returns true if \a actual is the digest \a expected, or if nothing
+    is expected. Case doesn't matter.
+*/
+
+bool Fetcher::matches( const string & expected, const string & actual )
+{
+    if ( expected.empty() )
+	return true;
+    return expected.size() == actual.size() &&
+	!::strcasecmp( expected.c_str(), actual.c_str() );
+}
+
+
+/*! \fn string Fetcher::md5() const
+
+    Returns the MD5 sum of the fetched file, in lower-case hex, or an
+    empty string if fetch() hasn't computed one.
+*/
+
+/*! \fn string Fetcher::sha256() const
+
+    Returns the SHA-256 sum of the fetched file, in lower-case hex, or
+    an empty string if fetch() hasn't computed one.
+*/
+
+/*! \fn string Fetcher::error() const
+
+    Returns a description of the last problem fetch() had, or an empty
+    string.
+*/
+
+/*! \fn int Fetcher::requests() const
+
+    Returns the number of HTTP requests fetch() has made.
+*/
@@ -0,0 +1,50 @@
+// Copyright Arnt Gulbrandsen <arnt@gulbrandsen.priv.no>; BSD-licensed.
+
+#ifndef FETCHER_H
+#define FETCHER_H
+
+#include <string>
+#include <vector>
+
+#include <boost/function.hpp>
+
+using namespace std;
+
+
+class Fetcher
+{
+public:
+    Fetcher( const string &, const string & );
+
+    void setMd5( const string & );
+    void setSha256( const string & );
+    void setAttempts( int );
+    void setProgress( boost::function<void (long long, long long)> );
+
+    bool fetch();
+
+    string md5() const { return m; }
+    string sha256() const { return s; }
+    string error() const { return e; }
+    int requests() const { return r; }
+
+    static bool fetchable( const string & );
+    static void setPeers( const vector<string> & );
+    static vector<string> peers();
+    static bool digest( const string &, string &, string & );
+    static bool matches( const string &, const string & );
+
+private:
+    string url;
+    string filename;
+    string expectedMd5;
+    string expectedSha256;
+    int attempts;
+    boost::function<void (long long, long long)> progress;
+    string m;
+    string s;
+    string e;
+    int r;
+};
+
+#endif
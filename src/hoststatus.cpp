@@ -2,6 +2,9 @@
 
 #include "hoststatus.h"
 
+#include "launcher.h"
+#include "artifact.h"
+
 #include <unistd.h>
 
 #include <boost/property_tree/json_parser.hpp>
@@ -21,6 +24,10 @@ using namespace std;
   The point of this is to store nodee information in a zookeeper
   ephemeral node. As a side benefit, we'll also hand it out to anyone
   who asks nicely via HTTP.
+
+  Besides the host's own numbers, the status includes the depth of
+  each Launcher stage, so one can see whether launches are stuck, and
+  how much of the artifact quota is used.
 */
 
 
@@ -50,6 +57,19 @@ HostStatus::HostStatus()
 	pt.put( prefix + ".uptime", uptime );
     pt.put( prefix + ".cores", cores( "/proc/cpuinfo" ) );
 
+    int stage = Launcher::Download;
+    while ( stage < Launcher::Stages ) {
+	Launcher::Stage s = (Launcher::Stage)stage;
+	string p = prefix + ".launches." + Launcher::name( s );
+	pt.put( p + ".queued", Launcher::queued( s ) );
+	pt.put( p + ".running", Launcher::running( s ) );
+	pt.put( p + ".limit", Launcher::limit( s ) );
+	stage++;
+    }
+    pt.put( prefix + ".launches.fetching", Launcher::fetching() );
+    pt.put( prefix + ".artifacts.bytes", Artifact::bytes() );
+    pt.put( prefix + ".artifacts.quota", Artifact::quota() );
+
     write_json( os, pt );
 
     j = os.str();
@@ -3,13 +3,20 @@
 #include "httplistener.h"
 
 #include "httpserver.h"
+#include "workerpool.h"
+#include "journal.h"
+#include "log.h"
 
 #include <boost/thread.hpp>
+#include <boost/bind.hpp>
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
 #include <netinet/in.h>
 
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 
 
@@ -18,7 +25,29 @@
 
   The HttpListener class listens for connections from clients on a
   single socket, and when one arrives, it creates a suitable
-  HttpServer in a thread of its own.
+  HttpServer to talk to the client.
+
+  HttpListener used to start a thread for each HttpServer, which was
+  simple and worked well until someone opened a few hundred
+  connections at once. Now it runs a single thread with an epoll
+  loop: The listening socket and all the client sockets are
+  nonblocking and registered with the same epoll instance, and the
+  loop reads whatever arrives into each HttpServer's buffer. When an
+  HttpServer has a complete request, it's handed to a WorkerPool,
+  which parses, acts and responds. While a worker has the
+  HttpServer, the listener doesn't look at its socket (that's what
+  EPOLLONESHOT is for), so no HttpServer is ever touched by two
+  threads at once.
+
+  The number of threads is thus the I/O thread plus the size of the
+  pool, no matter how many clients there are.
+
+  Connections are kept open after each response if the client wants
+  that (see HttpServer::keepAlive()). A worker answers all the
+  requests a client has pipelined, in order, and then gives the
+  connection back to the listener to wait for more. A client that
+  leaves a connection idle, or takes too long to send a request, is
+  disconnected after IdleTimeout seconds.
 
   HttpListener has one particular weakness: Since it listens on one
   socket, if nodee is run in a mixed ipv4/6 environment, nodee has to
@@ -30,11 +59,13 @@
 
 
 /*! Constructs an HTTP listener for \a port using \a family (V4 or V6),
-    creating HttpServers connected to \a i when clients connect.
+    creating HttpServers connected to \a i when clients connect, and
+    running their requests on \a pool.
 */
 
-HttpListener::HttpListener( HttpListener::Family family, int port, Init & i )
-    : init( i )
+HttpListener::HttpListener( HttpListener::Family family, int port, Init & i,
+			    WorkerPool & pool )
+    : e( -1 ), init( i ), workers( pool )
 {
     int retcode;
 
@@ -80,48 +111,213 @@ HttpListener::HttpListener( HttpListener::Family family, int port, Init & i )
     // just go on.
     (void)::listen( f, 64 );
 
-    boost::thread( *this );
-    // this lets the thread run unmanaged; when run() exits the object
-    // will be deallocated.
-}
+    (void)::fcntl( f, F_SETFL, ::fcntl( f, F_GETFL ) | O_NONBLOCK );
 
+    e = ::epoll_create( 64 );
+    if ( e < 0 ) {
+	::close( f );
+	f = -1;
+	return;
+    }
 
-/*! Called to start the thread. Does all that the listener needs, which
-    doesn't involve very many lines of code.
+    // the listening socket is registered with a null pointer, the
+    // clients with their HttpServer.
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = 0;
+    (void)::epoll_ctl( e, EPOLL_CTL_ADD, f, &ev );
+
+    boost::thread( boost::bind( &HttpListener::start, this ) );
+    // this lets the thread run unmanaged. the object has to outlive
+    // the thread, which is fine since main() never returns.
+}
 
-    Never exits, which seems like a modest problem. I don't see any
-    reason why the
 
+/*! Called to start the thread. Waits for something to happen on any
+    socket and reacts.
+
+    Never exits, which seems like a modest problem.
 */
 
 void HttpListener::start()
 {
+    struct epoll_event events[64];
+    time_t swept = time( 0 );
     while( f >= 0 ) {
-	int i = ::accept( f, 0, 0 );
-	if ( i >= 0 )
-	    boost::thread( HttpServer( i, init ) );
-	else if ( errno != EAGAIN )
+	int n = ::epoll_wait( e, events, 64, 1000 );
+	if ( n < 0 && errno != EINTR )
 	    f = -1;
+	int i = 0;
+	while ( i < n ) {
+	    HttpServer * s = (HttpServer *)events[i].data.ptr;
+	    if ( s )
+		receive( s );
+	    else
+		accept();
+	    i++;
+	}
+	if ( time( 0 ) != swept ) {
+	    sweep();
+	    swept = time( 0 );
+	}
     }
 }
 
 
+/*! Accepts all pending connections and starts watching them. */
 
-/*! Returns true if the listener actually is listening to something,
-    and false if some problem prevents it from achieving anything.
+void HttpListener::accept()
+{
+    while ( true ) {
+	int i = ::accept( f, 0, 0 );
+	if ( i < 0 ) {
+	    if ( errno != EAGAIN && errno != EWOULDBLOCK &&
+		 errno != EINTR && errno != ECONNABORTED )
+		debug << "nodee: accept() failed, errno " << errno << endl;
+	    return;
+	}
+	(void)::fcntl( i, F_SETFL, ::fcntl( i, F_GETFL ) | O_NONBLOCK );
+	HttpServer * s = new HttpServer( i, init );
+	s->setResumer( boost::bind( &HttpListener::resume, this, s ) );
+	{
+	    boost::lock_guard<boost::mutex> lock( mutex );
+	    waiting[s] = time( 0 ) + IdleTimeout;
+	}
+	watch( s, true );
+    }
+}
+
+
+/*! Reads whatever \a s's client has sent, and either hands \a s to a
+    worker, goes on waiting for more input, or gives up on \a s.
+
+    A partial request doesn't restart the idle timer; the client has
+    IdleTimeout seconds to send the entire request.
 */
 
-bool HttpListener::valid() const
+void HttpListener::receive( HttpServer * s )
 {
-    return f > 1;
+    HttpServer::Input r = s->receive();
+    if ( r == HttpServer::Partial ) {
+	watch( s, false );
+	return;
+    }
+
+    {
+	boost::lock_guard<boost::mutex> lock( mutex );
+	waiting.erase( s );
+    }
+
+    if ( r == HttpServer::Complete ) {
+	workers.submit( boost::bind( &HttpListener::serve, this, s ) );
+    } else {
+	s->close();
+	delete s;
+    }
+}
+
+
+/*! Runs in a worker thread to respond to \a s's request, and to any
+    further requests the client has pipelined. When this is done, the
+    client has been answered, and either \a s is waiting for the next
+    request or the connection is closed and \a s is gone.
+
+    If a handler defers its request, the worker forgets about \a s
+    until HttpServer::resume() brings it back via resume(). Neither
+    the listener nor the sweep looks at \a s in the meantime.
+*/
+
+void HttpListener::serve( HttpServer * s )
+{
+    HttpServer::Input r = HttpServer::Complete;
+    while ( r == HttpServer::Complete ) {
+	s->start();
+	if ( !s->deferred() )
+	    r = s->next();
+	else if ( s->release() )
+	    return;
+	// else it's been resumed already, so we just go around again
+    }
+
+    if ( r == HttpServer::Partial ) {
+	{
+	    boost::lock_guard<boost::mutex> lock( mutex );
+	    waiting[s] = time( 0 ) + IdleTimeout;
+	}
+	watch( s, false );
+    } else {
+	s->close();
+	delete s;
+    }
+}
+
+
+/*! Gets the deferred request in \a s handled again, by a worker. */
+
+void HttpListener::resume( HttpServer * s )
+{
+    workers.submit( boost::bind( &HttpListener::serve, this, s ) );
 }
 
 
-/*! boost::thread wants to call start() by this name, so here's a
-    wrapper around start().
+/*! Tells epoll to report on the next input for \a s. \a add is true
+    if \a s is new and false if it's already known to epoll.
+
+    Each report is good for only one wakeup; afterwards the socket is
+    ignored until watch() is called again.
 */
 
-void HttpListener::operator()()
+void HttpListener::watch( HttpServer * s, bool add )
 {
-    start();
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+    ev.data.ptr = s;
+    if ( ::epoll_ctl( e, add ? EPOLL_CTL_ADD : EPOLL_CTL_MOD,
+		      s->fd(), &ev ) < 0 ) {
+	{
+	    boost::lock_guard<boost::mutex> lock( mutex );
+	    waiting.erase( s );
+	}
+	s->close();
+	delete s;
+    }
+}
+
+
+/*! Closes all connections whose clients have had more than
+    IdleTimeout seconds to send a request and haven't done so.
+
+    Only connections that wait for the client are looked at. One that
+    a worker is busy with doesn't time out.
+
+    This also wakes long-polling requests whose time is up.
+*/
+
+void HttpListener::sweep()
+{
+    time_t now = time( 0 );
+    Journal::expire( now );
+    boost::lock_guard<boost::mutex> lock( mutex );
+    std::map<HttpServer *, time_t>::iterator i = waiting.begin();
+    while ( i != waiting.end() ) {
+	HttpServer * s = i->first;
+	if ( i->second < now ) {
+	    (void)::epoll_ctl( e, EPOLL_CTL_DEL, s->fd(), 0 );
+	    s->close();
+	    delete s;
+	    waiting.erase( i++ );
+	} else {
+	    ++i;
+	}
+    }
+}
+
+
+/*! Returns true if the listener actually is listening to something,
+    and false if some problem prevents it from achieving anything.
+*/
+
+bool HttpListener::valid() const
+{
+    return f > 1;
 }
@@ -5,23 +5,46 @@
 
 #include "init.h"
 
+#include <map>
+#include <time.h>
+
+#include <boost/thread/mutex.hpp>
+
+
+class HttpServer;
+class WorkerPool;
+
 
 class HttpListener
 {
 public:
     enum Family { V4, V6 };
 
-    HttpListener( Family f, int port, Init & );
-
-    void operator()();
+    HttpListener( Family f, int port, Init &, WorkerPool & );
 
     void start();
 
     bool valid() const;
 
+private:
+    void accept();
+    void receive( HttpServer * );
+    void serve( HttpServer * );
+    void resume( HttpServer * );
+    void watch( HttpServer *, bool );
+    void sweep();
+
 public:
+    static const int IdleTimeout = 30;
+
     volatile int f;
+    int e;
     Init & init;
+    WorkerPool & workers;
+
+private:
+    std::map<HttpServer *, time_t> waiting;
+    boost::mutex mutex;
 };
 
 #endif
@@ -7,19 +7,37 @@
 #include "service.h"
 #include "artifact.h"
 #include "process.h"
-
+#include "router.h"
+#include "journal.h"
+#include "events.h"
+#include "launcher.h"
+#include "conf.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
 
 #include <algorithm>
+#include <stdexcept>
 
 #include <boost/lexical_cast.hpp>
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
 
 
 /*! \class HttpServer httpserver.h
 
-  The HttpServer class provdes a HTTP server for Nodee's API. It
-  expects to run in a thread of its own; the start() function does all
-  the work, then exits.
+  The HttpServer class provdes a HTTP server for Nodee's API. There
+  is one HttpServer per client connection. HttpListener calls
+  receive() whenever the client has sent something, and when
+  receive() says a request is complete, a worker thread calls start()
+  to act on it.
 
   I couldn't find embeddable HTTP server source I liked (technically
   plus BSD), so on the advice of James Antill, I applied some
@@ -31,12 +49,17 @@
   is to avoid allocating memory. Memory never allocated is memory
   never leaked.
 
-  The member functions may be sorted into three groups: start() is the
-  do-it-all function (operator()() is a wrapper for start()),
-  readRequest(), parseRequest(), readBody() and respond() contain the
-  bulk of the code and are separated out for proper testing, and the
-  four accessors operation(), path(), body() and and contentLength()
-  exist for testing.
+  The member functions may be sorted into three groups: receive() and
+  start() are the do-it-all functions, readRequest(), parseRequest(),
+  readBody() and respond() contain the bulk of the code and are
+  separated out for proper testing, and the four accessors
+  operation(), path(), body() and and contentLength() exist for
+  testing.
+
+  A handler that can't answer at once (such as a long-poll) may
+  defer() the request instead of sending a response, and arrange for
+  resume() to be called later. The request is then handled again, and
+  resumed() returns true while it is.
 */
 
 
@@ -44,89 +67,205 @@
 */
 
 HttpServer::HttpServer( int fd, Init & i )
-    : init( i ), o( Invalid ), cl( 0 ), f ( fd )
+    : init( i ), used( 0 ), scanned( 0 ), h( 0 ),
+      o( Invalid ), cl( 0 ), f ( fd ), k( false ), served( 0 ),
+      d( Answering ), a( false )
 {
     // nothing needed (yet?)
 }
 
 
-/*! Parses input, acts on it. Returns only in case of error.
+/*! Reads whatever the client has sent, without blocking, and returns
+    Complete if a complete request (header and body) has arrived,
+    Partial if more is needed, and Broken if the client has closed the
+    connection or misbehaved. Throws nothing.
+
+    Aborts after 32k of header; the common requests will be <500 bytes
+    and practically all <2k, so 32k is a good sanity limit.
+
+    All input goes into one buffer, which starts small and grows as
+    needed (but never shrinks). Each call reads as much as fits, so a
+    typical request costs one read(). The header is followed directly
+    by the body in the buffer, so any part of the body that arrives
+    along with the header is already where readBody() wants it.
+
+    When the header is complete, receive() calls parseRequest(), so
+    that it knows how long the body is.
+*/
+
+HttpServer::Input HttpServer::receive()
+{
+    // the buffer has to hold the header (at most 32k) and then the
+    // body (whatever parseRequest() found).
+    int limit = h ? h + cl : 32768; // parseRequest() caps cl
+    if ( used == (int)i.size() ) {
+	int n = i.size() * 2;
+	if ( n < 4096 )
+	    n = 4096;
+	if ( n > limit )
+	    n = limit;
+	i.resize( n );
+    }
+
+    int r = ::read( f, &i[used], i.size() - used );
+    if ( r < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK ||
+		    errno == EINTR ) )
+	return Partial;
+    if ( r <= 0 )
+	return Broken; // an error or EOF. we don't care which.
+    used += r;
+
+    return examine();
+}
+
+
+/*! Looks at the buffered input and decides whether it contains a
+    complete request. Returns the same as receive().
+*/
+
+HttpServer::Input HttpServer::examine()
+{
+    if ( !h ) {
+	int from = scanned;
+	findHeaderEnd();
+
+	// some fun-loving client may have sent us a null byte in the
+	// header. we have no patience with such games.
+	int end = h ? h : used;
+	if ( end > from && ::memchr( &i[from], 0, end - from ) )
+	    return Broken;
+
+	if ( !h && used < 32768 )
+	    return Partial;
+
+	if ( !h || h > 32768 ) {
+	    // the sender sent 32k and didn't actually send a valid
+	    // header. is the client buggy, blackhat or just
+	    // criminally talkative?
+	    return Broken;
+	}
+
+	// we found the end of the header just now
+	try {
+	    parseRequest( readRequest() );
+	} catch ( ... ) {
+	    return Broken;
+	}
+    }
+
+    if ( (size_t)used < (size_t)h + (size_t)cl )
+	return Partial;
+    return Complete;
+}
+
+
+/*! Looks for the end of the header in the data buffered by receive(),
+    and records where it is, if it's there. Each byte is looked at
+    only once, no matter how many reads the header needs.
+
+    There are two ways to end a header: LFLF and CRLFCRLF. We look
+    for LFLF and LFCRLF; arguably even the latter is allowed. Since
+    both start with LF, we let memchr() find each LF, and it's much
+    faster at that than a loop here would be.
+*/
+
+void HttpServer::findHeaderEnd()
+{
+    const char * s = &i[0];
+    while ( !h && scanned < used ) {
+	const char * lf = (const char *)::memchr( s + scanned, 10,
+						  used - scanned );
+	if ( !lf ) {
+	    scanned = used;
+	    return;
+	}
+	int n = lf - s;
+	if ( n + 1 < used && s[n+1] == 10 )
+	    h = n + 2;
+	else if ( n + 2 < used && s[n+1] == 13 && s[n+2] == 10 )
+	    h = n + 3;
+	else if ( n + 2 >= used && ( n + 1 == used || s[n+1] == 13 ) ) {
+	    scanned = n;
+	    return; // we need another byte or two to decide
+	}
+	scanned = n + 1;
+    }
+}
+
+
+/*! Acts on the request receive() has buffered and sends a response.
 
     This function is not testable.
 */
 
 void HttpServer::start()
 {
-    try {
-	while ( true ) {
-	    parseRequest( readRequest() );
-	    if ( f >= 0 && cl > 0 )
-		readBody();
+    {
+	boost::lock_guard<boost::mutex> lock( m );
+	a = ( d == Again );
+	d = Answering;
+    }
 
-	    if ( f < 0 )
-		return;
+    // the last request on a connection is answered with
+    // Connection: close, so the client knows. a resumed request has
+    // been counted already.
+    if ( !a )
+	served++;
+    if ( served >= MaxRequests )
+	k = false;
 
+    try {
+	readBody();
+	if ( f >= 0 )
 	    respond();
-	}
     } catch (...) {
 	close();
     }
 }
 
 
-/*! Reads and returns a single request. Throws nothing.
-
-    Aborts after 32k; the common requests will be <500 bytes and
-    practically all <2k, so 32k is a good sanity limit.
-
+/*! Prepares for the next request on the same connection, and returns
+    Complete if the client has already sent it (ie. if it pipelines),
+    Partial if we have to wait for it, and Broken if there won't be
+    another request on this connection.
 
+    Anything the client sent after the last request is moved to the
+    start of the buffer, so the buffer is reused for the next request.
 */
 
-string HttpServer::readRequest()
+HttpServer::Input HttpServer::next()
 {
-    // first, we read the header, one byte at a time. this is
-    // generally considered inefficient, but if we're going to spin up
-    // a JVM as a result of this request, who cares about a few hundred
-    // system calls more or less?
-    string s;
-
-    bool done = false;
-    int i = 0;
-    while ( i < 32768 && !done ) {
-	char x[2];
-	int r = ::read( f, &x, 1 );
-	if ( r < 0 ) {
-	    // an error. we don't care.
-	    close();
-	    return string();
-	}
-
-	if ( r > 0 && x == 0 ) {
-	    // some fun-loving client sent us a null byte. we have no
-	    // patience with such games.
-	    close();
-	    return string();
-	}
+    if ( f < 0 || !k )
+	return Broken;
+
+    int done = h + cl;
+    if ( done < used )
+	::memmove( &i[0], &i[done], used - done );
+    used -= done;
+    scanned = 0;
+    h = 0;
+    cl = 0;
+    o = Invalid;
+    p.erase();
+    b.erase();
+    inm.erase();
+    rg.erase();
 
-	x[1] = 0;
-	s += x;
-	i++;
+    if ( !used )
+	return Partial;
+    return examine();
+}
 
-	// there are two ways to end a header: LFLF and CRLFCRLF
-	if ( i >= 2 && s[i-1] == 10 && s[i-2] == 10 )
-	    done = true;
-	if ( i >= 3 && s[i-1] == 10 && s[i-2] == 13 && s[i-3] == 10 )
-	    done = true; // LFCRLF. arguably even that's allowed.
 
-	if ( i >= 32768 && !done ) {
-	    // the sender sent 32k and didn't actually send a valid header.
-	    // is the client buggy, blackhat or just criminally talkative?
-	    close();
-	    return string();
-	}
-    }
+/*! Returns the header of the request buffered by receive(), or an
+    empty string if receive() hasn't seen a complete header yet.
+*/
 
-    return s;
+string HttpServer::readRequest()
+{
+    if ( !h )
+	return string();
+    return string( &i[0], h );
 }
 
 
@@ -138,16 +277,23 @@ string HttpServer::readRequest()
     mostly it doesn't. The client can tell us what Content-Type it
     wants for the report about its RESTfulness, but we're don't
     atually care what it says, so we don't even parse its sayings. As
-    I write these words, the only header field we really parse is
-    Content-Length, which is necessary for POST.
+    I write these words, the only header fields we really parse are
+    Content-Length, which is necessary for POST, Connection, which
+    decides whether the connection stays open after the response,
+    If-None-Match, which lets pollers avoid fetching the same service
+    list again and again, and Range, which lets other nodees resume
+    artifact downloads.
 */
 
 void HttpServer::parseRequest( string h )
 {
     o = Invalid;
     cl = 0;
+    k = false;
     p.erase();
     b.erase();
+    inm.erase();
+    rg.erase();
 
     if ( !h.compare( 0, 4, "GET " ) ) {
 	o = Get;
@@ -169,13 +315,58 @@ void HttpServer::parseRequest( string h )
 
     p = h.substr( s, n-s );
 
+    // HTTP/1.1 and later keep the connection open by default, 1.0
+    // closes it. either way the client can say what it wants.
+    while( n < l && h[n] == ' ' )
+	n++;
+    if ( !h.compare( n, 7, "HTTP/1." ) && n + 7 < l &&
+	 h[n+7] >= '1' && h[n+7] <= '9' )
+	k = true;
+    else if ( !h.compare( n, 5, "HTTP/" ) && n + 5 < l &&
+	      h[n+5] >= '2' && h[n+5] <= '9' )
+	k = true;
+
+    // ETags are case-sensitive, so we pick out If-None-Match before
+    // smashing case.
+    size_t pos = 0;
+    while ( ( pos = h.find( '\n', pos ) ) != string::npos &&
+	    h.compare( pos + 1, 14, "If-None-Match:" ) &&
+	    h.compare( pos + 1, 14, "if-none-match:" ) )
+	pos++;
+    if ( pos != string::npos ) {
+	size_t v = h.find_first_not_of( " \t", pos + 15 );
+	size_t e = h.find_first_of( "\r\n", pos + 15 );
+	if ( v != string::npos && v < e )
+	    inm = h.substr( v, e == string::npos ? e : e - v );
+    }
+
+    // the rest is entirely case-insensitive, so we can smash case
+    // and ignore non-ascii.
+    std::transform( h.begin(), h.end(), h.begin(), ::tolower );
+
+    pos = h.find( "\nconnection:" );
+    if ( pos != string::npos ) {
+	size_t e = h.find( '\n', pos + 1 );
+	string c = h.substr( pos + 12, e == string::npos ? e : e - pos - 12 );
+	if ( c.find( "close" ) != string::npos )
+	    k = false;
+	else if ( c.find( "keep-alive" ) != string::npos )
+	    k = true;
+    }
+
+    pos = h.find( "\nrange:" );
+    if ( pos != string::npos ) {
+	size_t v = h.find_first_not_of( " \t", pos + 7 );
+	size_t e = h.find_first_of( "\r\n", pos + 7 );
+	if ( v != string::npos && v < e )
+	    rg = h.substr( v, e == string::npos ? e : e - v );
+    }
+
     if ( o != Post )
 	return;
 
-    // we need content-length. it's entirely case-insensitive, so we
-    // can smash case and ignore non-ascii.
-    std::transform( h.begin(), h.end(), h.begin(), ::tolower );
-    size_t pos = h.find( "\ncontent-length:" );
+    // we need content-length.
+    pos = h.find( "\ncontent-length:" );
     if ( pos == string::npos )
 	return;
     n = pos + 16;
@@ -184,11 +375,17 @@ void HttpServer::parseRequest( string h )
     s = n;
     while ( n < l && h[n] >= '0' && h[n] <= '9' )
 	n++;
+    // a body larger than MaxBody isn't anything we want, and a
+    // larger number might overflow when added to the header's size.
+    if ( n - s > 9 )
+	throw std::runtime_error( "Content-Length too large" );
     cl = boost::lexical_cast<int>( h.substr( s, n-s ) );
+    if ( cl < 0 || cl > MaxBody )
+	throw std::runtime_error( "Content-Length too large" );
 }
 
 
-/*! Reads a body, for POST.
+/*! Picks the body, for POST, out of the data buffered by receive().
 
     On return, either body() will be set, or the operation() will be
     Invalid.
@@ -199,27 +396,19 @@ void HttpServer::readBody()
     if ( !cl )
 	return;
 
-    char * tmp = new char[cl+1];
-    int l = 0;
-    while ( l < cl ) {
-	int r = ::read( f, l+tmp, cl-l );
-	if ( r < 0 ) {
-	    close();
-	    delete[] tmp;
-	    return;
-	}
-	l += r;
+    if ( (size_t)used < (size_t)h + (size_t)cl ) {
+	o = Invalid;
+	return;
     }
-    tmp[cl] = '\0';
-    b = tmp;
-    delete[] tmp;
+
+    b.assign( &i[h], cl );
 }
 
 
-/*! Responds to the request, such as it is.
+/*! Responds to the request, such as it is, by calling the Handler
+    the Router finds for it.
 
-    Effectively untestable. Could be separated out into smaller
-    chunks, but I don't care right now.
+    Effectively untestable.
 */
 
 void HttpServer::respond()
@@ -229,123 +418,291 @@ void HttpServer::respond()
 	return;
     }
 
-    // start, stop, list services
-    // install, uninstall, list artifacts
+    Router::Captures c;
+    Router::Handler handler = Router::find( o, p, c );
+    if ( handler )
+	handler( *this, c );
+    else if ( o == Post )
+	send( httpResponse( 404, "text/plain", "No such response" ) );
+    else
+	send( httpResponse( 404, "text/plain", "No such page" ) );
+}
 
-    if ( o == Post && p == "/service/start" ) {
-	ServerSpec s = ServerSpec::parseJson( b, init );
-	if ( !s.valid() ) {
-	    string e = s.error();
-	    if ( e.empty() )
-		e = "Parse error for the JSON body";
-	    send( httpResponse( 400, "text/plain", e ) );
-	} else {
-	    Process::launch( s, init );
-	    send( httpResponse( 200, "application/json",
-				"Will launch, or try to",
-				s.json() ) );
-	}
-	return;
+
+// start, stop, list services
+// install, prefetch, uninstall, list and serve artifacts
+
+static void startService( HttpServer & server, const Router::Captures & )
+{
+    ServerSpec s = ServerSpec::parseJson( server.body(), server.manager() );
+    if ( !s.valid() ) {
+	string e = s.error();
+	if ( e.empty() )
+	    e = "Parse error for the JSON body";
+	server.send( server.httpResponse( 400, "text/plain", e ) );
+    } else {
+	Process::launch( s, server.manager() );
+	server.send( server.httpResponse( 200, "application/json",
+					  "Will launch, or try to",
+					  s.json() ) );
     }
+}
+
+
+static void stopService( HttpServer & server, const Router::Captures & c )
+{
+    boost::shared_ptr<Process> s = server.manager().find( c.number( 0 ) );
+    if ( s ) {
+	s->stop();
+	server.send( server.httpResponse( 200, "application/json",
+					  "Will stop, or try to",
+					  s->spec().json() ) );
+    } else {
+	server.send( server.httpResponse( 400, "text/plain",
+					  "No such service" ) );
+    }
+}
+
 
-    if ( o == Post && p.substr( 0, 14 ) == "/service/stop/" ) {
-	Process * s = 0;
+static void listServices( HttpServer & server, const Router::Captures & )
+{
+    Service::Snapshot s = Service::snapshot( server.manager() );
+    if ( server.matches( s.etag ) )
+	server.send( server.httpResponse( 304, "application/json",
+					  "Not modified", "", s.etag ) );
+    else
+	server.send( server.httpResponse( 200, "application/json",
+					  "Service list follows",
+					  *s.json, s.etag ) );
+}
+
+
+// a watch that sees no change answers after this many seconds, so
+// that proxies and such don't time out first.
+static const int watchPatience = 25;
+
+static void watchServices( HttpServer & server, const Router::Captures & )
+{
+    string s = server.parameter( "since" );
+    unsigned int since = Journal::version();
+    if ( !s.empty() ) {
 	try {
-	    s = init.find( boost::lexical_cast<int>( p.substr( 14 ) ) );
+	    since = boost::lexical_cast<unsigned int>( s );
 	} catch ( boost::bad_lexical_cast ) {
+	    server.send( server.httpResponse( 400, "text/plain",
+					      "Bad since parameter" ) );
+	    return;
 	}
-	if ( s ) {
-	    s->stop();
-	    send( httpResponse( 200, "application/json",
-				"Will stop, or try to",
-				s->spec().json() ) );
-	} else {
-	    send( httpResponse( 400, "text/plain",
-				"No such service" ) );
-	}
-	return;
     }
 
-    if ( o == Post && p.substr( 18 ) == "/artifact/install/" ) {
-	ServerSpec s = ServerSpec::parseJson( b, init );
-	if ( !s.valid() ) {
-	    send( httpResponse( 400, "text/plain",
-				"Parse error for the JSON body" ) );
-	} else {
-	    Process::launch( s, init );
-	    send( httpResponse( 200, "text/plain",
-				"Will launch, or try to" ) );
-	}
-	return;
+    if ( !Journal::covers( since ) ) {
+	server.send( server.httpResponse( 410, "text/plain",
+					  "Too old, get /service/list" ) );
+    } else if ( s.empty() || server.resumed() ||
+		since < Journal::version() ) {
+	server.send( server.httpResponse( 200, "application/json",
+					  "Changes follow",
+					  Journal::changes( since ) ) );
+    } else {
+	server.defer();
+	Journal::watch( since, ::time( 0 ) + watchPatience,
+			boost::bind( &HttpServer::resume, &server ) );
     }
+}
 
-    if ( o == Post && p.substr( 0, 20 ) == "/artifact/uninstall/" ) {
-	string artifact = p.substr( 21 );
-	// ARNT
-	send( httpResponse( 200, "text/plain",
-			    "Will uninstall, or try to" ) );
+
+static void streamEvents( HttpServer & server, const Router::Captures & )
+{
+    // the response never ends, so there's no Content-Length and the
+    // connection can't be reused for anything else.
+    int fd = server.detach();
+    Events::subscribe( fd, server.httpResponse( 200, "text/event-stream",
+						"Events follow" ) );
+}
+
+
+// installing an artifact used to launch a service, which wasn't
+// what anyone wanted. now it's the same as prefetching.
+static void prefetchArtifacts( HttpServer & server, const Router::Captures & )
+{
+    vector<ServerSpec> specs = ServerSpec::parseArtifactJson( server.body() );
+    string e;
+    if ( specs.empty() )
+	e = "Parse error for the JSON body";
+    vector<ServerSpec>::const_iterator i = specs.begin();
+    while ( e.empty() && i != specs.end() ) {
+	e = i->error();
+	++i;
+    }
+    if ( !e.empty() ) {
+	server.send( server.httpResponse( 400, "text/plain", e ) );
 	return;
     }
 
-    if ( o == Post ) {
-	send( httpResponse( 404, "text/plain",
-			    "No such response" ) );
+    i = specs.begin();
+    while ( i != specs.end() ) {
+	Launcher::prefetch( *i, server.manager() );
+	++i;
+    }
+    server.send( server.httpResponse( 200, "application/json",
+				      "Will prefetch, or try to",
+				      Launcher::prefetches() ) );
+}
+
+
+static void listPrefetches( HttpServer & server, const Router::Captures & )
+{
+    server.send( server.httpResponse( 200, "application/json",
+				      "Prefetch progress follows",
+				      Launcher::prefetches() ) );
+}
+
+
+static void uninstallArtifact( HttpServer & server,
+			       const Router::Captures & c )
+{
+    switch ( Artifact::uninstall( c.text( 0 ) ) ) {
+    case Artifact::Uninstalled:
+	server.send( server.httpResponse( 200, "text/plain",
+					  "Uninstalled" ) );
+	break;
+    case Artifact::InUse:
+	server.send( server.httpResponse( 409, "text/plain",
+					  "In use by a service" ) );
+	break;
+    case Artifact::NoSuchArtifact:
+	server.send( server.httpResponse( 404, "text/plain",
+					  "No such artifact" ) );
+	break;
+    }
+}
+
+
+static void listArtifacts( HttpServer & server, const Router::Captures & )
+{
+    server.send( server.httpResponse( 200, "application/json",
+				      "Artifact list follows",
+				      Artifact::list() ) );
+}
+
+
+// serving artifacts to other nodees must not use up all the
+// workers, or this nodee can't be managed while it's being popular.
+static boost::mutex uploadMutex;
+static int uploads;
+
+static void serveArtifact( HttpServer & server, const Router::Captures & c )
+{
+    string name = c.text( 0 );
+    int fd = -1;
+    if ( Artifact::available( name ) )
+	fd = ::open( ( Conf::artefactDirectory() + "/" + name ).c_str(),
+		     O_RDONLY );
+    struct stat st;
+    if ( fd >= 0 && ( ::fstat( fd, &st ) < 0 || !S_ISREG( st.st_mode ) ) ) {
+	::close( fd );
+	fd = -1;
+    }
+    if ( fd < 0 ) {
+	server.send( server.httpResponse( 404, "text/plain",
+					  "No such artifact" ) );
 	return;
     }
 
-    // it's Get
-
-    if ( p == "/service/list" )
-	send( httpResponse( 200, "application/json",
-			    "Service list follows",
-			    Service::list( init ) ) );
-
-    if ( p == "/artifact/list" )
-	send( httpResponse( 200, "application/json",
-			    "Artifact list follows",
-			    Artifact::list() ) );
-
-    if ( p == "/nodee/status" )
-	send( httpResponse( 200, "application/json",
-			    "Let me tell you how I feel",
-			    HostStatus() ) );
-
-    if ( p == "/" )
-	send( httpResponse( 200, "text/html",
-			    "This is not a web site",
-			    "<html>"
-			    "<head><title>Nodee</title><head>"
-			    "<body style='text-align: center;'>"
-			    "<h1>Nodee</h1>"
-			    "<p>This is the home page of a nodee server. "
-			    "There are no web pages to see here, only a few JSON "
-			    "API things, and those aren't really something you'll "
-			    "want to look at, if you understand."
-			    "<p>Have a look at the "
-			    "<a href=\"http://cloudname.org\">Cloudname</a> "
-			    "home page or perhaps the "
-			    "<a href=\"https://github.com/Cloudname/nodee\">Nodee source</a> "
-			    "instead, that'll be much more fun."
-			    "<p><img src=\"http://rant.gulbrandsen.priv.no/images/under-construction.gif\">"
-			    "</body>"
-			    "</html>\n" ) );
-
-    if ( p == "/robots.txt" )
-	send( httpResponse( 200, "text/plain",
-			    "This is not a web site",
-			    "User-Agent: *\r\nDisallow: /\r\n" ) );
-
-    if ( p == "/sitemap.xml" )
-	send( httpResponse( 200, "application/xml",
-			    "This is not a web site",
-			    "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
-			    "<urlset xmlns=\"http://www.sitemaps.org/schemas/sitemap/0.9\"\n"
-			    "</urlset nicetry=true>\n" ) );
-
-    send( httpResponse( 404, "text/plain", "No such page" ) );
+    bool busy = false;
+    {
+	boost::lock_guard<boost::mutex> lock( uploadMutex );
+	int limit = Conf::httpworkers / 2;
+	if ( uploads >= ( limit > 0 ? limit : 1 ) )
+	    busy = true;
+	else
+	    uploads++;
+    }
+    if ( busy ) {
+	// the other nodee will try elsewhere
+	server.send( server.httpResponse( 503, "text/plain",
+					  "Too busy to share" ) );
+    } else {
+	server.sendFile( fd, st.st_size );
+	boost::lock_guard<boost::mutex> lock( uploadMutex );
+	uploads--;
+    }
+    ::close( fd );
+}
+
+
+static void nodeeStatus( HttpServer & server, const Router::Captures & )
+{
+    server.send( server.httpResponse( 200, "application/json",
+				      "Let me tell you how I feel",
+				      HostStatus() ) );
+}
+
+
+static void homePage( HttpServer & server, const Router::Captures & )
+{
+    server.send( server.httpResponse(
+		     200, "text/html",
+		     "This is not a web site",
+		     "<html>"
+		     "<head><title>Nodee</title><head>"
+		     "<body style='text-align: center;'>"
+		     "<h1>Nodee</h1>"
+		     "<p>This is the home page of a nodee server. "
+		     "There are no web pages to see here, only a few JSON "
+		     "API things, and those aren't really something you'll "
+		     "want to look at, if you understand."
+		     "<p>Have a look at the "
+		     "<a href=\"http://cloudname.org\">Cloudname</a> "
+		     "home page or perhaps the "
+		     "<a href=\"https://github.com/Cloudname/nodee\">Nodee source</a> "
+		     "instead, that'll be much more fun."
+		     "<p><img src=\"http://rant.gulbrandsen.priv.no/images/under-construction.gif\">"
+		     "</body>"
+		     "</html>\n" ) );
+}
+
+
+static void robots( HttpServer & server, const Router::Captures & )
+{
+    server.send( server.httpResponse( 200, "text/plain",
+				      "This is not a web site",
+				      "User-Agent: *\r\nDisallow: /\r\n" ) );
+}
+
+
+static void sitemap( HttpServer & server, const Router::Captures & )
+{
+    server.send( server.httpResponse(
+		     200, "application/xml",
+		     "This is not a web site",
+		     "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+		     "<urlset xmlns=\"http://www.sitemaps.org/schemas/sitemap/0.9\"\n"
+		     "</urlset nicetry=true>\n" ) );
 }
 
 
+static const Router::Route routes[] = {
+    { HttpServer::Post, "/service/start", startService },
+    { HttpServer::Post, "/service/stop/{pid:int}", stopService },
+    { HttpServer::Get, "/service/list", listServices },
+    { HttpServer::Get, "/service/watch", watchServices },
+    { HttpServer::Get, "/service/events", streamEvents },
+    { HttpServer::Post, "/artifact/install", prefetchArtifacts },
+    { HttpServer::Post, "/artifact/prefetch", prefetchArtifacts },
+    { HttpServer::Get, "/artifact/prefetch", listPrefetches },
+    { HttpServer::Post, "/artifact/uninstall/{name}", uninstallArtifact },
+    { HttpServer::Get, "/artifact/list", listArtifacts },
+    { HttpServer::Get, "/artifact/file/{name}", serveArtifact },
+    { HttpServer::Get, "/nodee/status", nodeeStatus },
+    { HttpServer::Get, "/", homePage },
+    { HttpServer::Get, "/robots.txt", robots },
+    { HttpServer::Get, "/sitemap.xml", sitemap }
+};
+
+static Router::Table table( routes, sizeof( routes ) / sizeof( routes[0] ) );
+
+
 /*! Closes the socket and updates the state machine as needed. */
 
 void HttpServer::close()
@@ -355,29 +712,57 @@ void HttpServer::close()
 }
 
 
+/*! Gives the socket to the caller and returns it. Afterwards this
+    object behaves as if the connection were closed, but the socket
+    is the caller's to write to and eventually close.
+*/
+
+int HttpServer::detach()
+{
+    int r = f;
+    f = -1;
+    k = false;
+    return r;
+}
+
+
 /*! Returns a HTTP response string with \a numeric status, \a textual
     explanation (302 Found, etc), \a contentType and optionally \a
-    body.
+    body and \a etag.
 
     This function does most of what send() ought to do, but this is
     easily testable and the same logic in send() would not be.
+
+    If the connection is to be kept open, the response is HTTP/1.1
+    and always includes Content-Length, since that's how the client
+    knows where the next response starts. Otherwise it's a plain old
+    HTTP/1.0 response. A 304 response never has a body, so it never
+    has Content-Length either.
 */
 
 string HttpServer::httpResponse( int numeric, const string & contentType,
 				 const string & textual,
-				 const string & body )
+				 const string & body,
+				 const string & etag )
 {
-    string r = "HTTP/1.0 ";
+    string r = k ? "HTTP/1.1 " : "HTTP/1.0 ";
     // we blithely assume that 100<=numeric<=999
     r += boost::lexical_cast<string>( numeric );
     r += " ";
     r += textual;
-    r += "\r\n"
-	 "Connection: close\r\n"
-	 "Server: nodee\r\n"
+    r += k ? "\r\n"
+	     "Connection: keep-alive\r\n"
+	   : "\r\n"
+	     "Connection: close\r\n";
+    r += "Server: nodee\r\n"
 	 "Content-Type: ";
     r += contentType;
-    if ( !body.empty() ) {
+    if ( !etag.empty() ) {
+	r += "\r\n"
+	     "ETag: ";
+	r += etag;
+    }
+    if ( numeric != 304 && ( !body.empty() || k ) ) {
 	r += "\r\n"
 	     "Content-Length: ";
 	r += boost::lexical_cast<string>( body.length() );
@@ -390,33 +775,285 @@ string HttpServer::httpResponse( int numeric, const string & contentType,
 }
 
 
-/*! Sends \a response. This function is untested, borderline
-    untestable, which is why it's simple.
+/*! Returns the value of the query parameter \a name, or an empty
+    string if the path has no such parameter. Does not decode %
+    escapes, since none of our parameters need them.
 */
 
-void HttpServer::send( string response )
+string HttpServer::parameter( const string & name ) const
+{
+    size_t q = p.find( '?' );
+    while ( q != string::npos ) {
+	size_t e = p.find( '&', q + 1 );
+	if ( !p.compare( q + 1, name.size(), name ) &&
+	     q + 1 + name.size() < p.size() &&
+	     p[q + 1 + name.size()] == '=' ) {
+	    size_t v = q + 2 + name.size();
+	    return p.substr( v, e == string::npos ? e : e - v );
+	}
+	q = e;
+    }
+    return string();
+}
+
+
+/*! Records that the handler won't answer the current request now,
+    but will call resume() later. Only a handler may call this.
+*/
+
+void HttpServer::defer()
+{
+    boost::lock_guard<boost::mutex> lock( m );
+    d = Deferred;
+}
+
+
+/*! Returns true if the handler has called defer() and the request
+    hasn't been handled again yet, even if resume() has been called.
+*/
+
+bool HttpServer::deferred() const
+{
+    boost::lock_guard<boost::mutex> lock( m );
+    return d == Deferred || d == Woken;
+}
+
+
+/*! Called by HttpListener when the worker that ran a deferred request
+    is done with this object. Returns true if the object now waits for
+    resume(), and false if resume() has been called already and the
+    request should be handled again at once.
+
+    Splitting this from defer() means that resume() can be called at
+    any time, even before the handler has returned, without two
+    threads using the object at once.
+*/
+
+bool HttpServer::release()
+{
+    boost::lock_guard<boost::mutex> lock( m );
+    if ( d == Woken ) {
+	d = Again;
+	return false;
+    }
+    d = Released;
+    return true;
+}
+
+
+/*! Causes a deferred request to be handled again. May be called by
+    any thread. If the object has been released, the function set
+    using setResumer() is called to get the request to a worker.
+*/
+
+void HttpServer::resume()
+{
+    boost::function<void()> r;
+    {
+	boost::lock_guard<boost::mutex> lock( m );
+	if ( d == Deferred ) {
+	    d = Woken;
+	} else if ( d == Released ) {
+	    d = Again;
+	    r = resumer;
+	}
+    }
+    if ( r )
+	r();
+}
+
+
+/*! Records that resume() should call \a r to get a released request
+    handled again. HttpListener uses this to submit the request to
+    its WorkerPool.
+*/
+
+void HttpServer::setResumer( const boost::function<void()> & r )
+{
+    resumer = r;
+}
+
+
+/*! Returns true if the client's If-None-Match says that it already
+    has the version identified by \a etag, and false if not.
+*/
+
+bool HttpServer::matches( const string & etag ) const
+{
+    if ( inm.empty() || etag.empty() )
+	return false;
+    if ( inm == "*" )
+	return true;
+
+    // If-None-Match may list several tags, and a weak W/ prefix on
+    // any of them doesn't matter for a GET.
+    size_t pos = inm.find( etag );
+    while ( pos != string::npos ) {
+	size_t e = pos + etag.size();
+	if ( ( pos == 0 || inm[pos-1] == ' ' || inm[pos-1] == ',' ||
+	       inm[pos-1] == '/' ) &&
+	     ( e == inm.size() || inm[e] == ' ' || inm[e] == ',' ) )
+	    return true;
+	pos = inm.find( etag, pos + 1 );
+    }
+    return false;
+}
+
+
+// waits up to 30 seconds for the client to read. returns false if
+// it doesn't.
+static bool writable( int f )
+{
+    struct pollfd pfd;
+    pfd.fd = f;
+    pfd.events = POLLOUT;
+    return ::poll( &pfd, 1, 30000 ) > 0;
+}
+
+
+/*! Writes \a l bytes at \a b to the client, or closes the connection
+    if that isn't possible.
+*/
+
+void HttpServer::write( const char * b, int l )
 {
     int o = 0;
-    int l = response.length();
-    while ( o < l ) {
-	int r = ::write( f, o + response.data(), l - o );
-	if ( r <= 0 ) {
+    while ( f >= 0 && o < l ) {
+	int r = ::write( f, o + b, l - o );
+	if ( r < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK ) ) {
+	    if ( !writable( f ) )
+		close();
+	} else if ( r < 0 && errno == EINTR ) {
+	    // just try again
+	} else if ( r <= 0 ) {
+	    // EPIPE or ECONNRESET: the client has gone away
 	    close();
-	    return;
+	} else {
+	    o += r;
 	}
-	o += r;
     }
-    close();
 }
 
 
-/*! boost::thread wants to call start() by this name, so here's a
-    wrapper around start().
+/*! Sends \a response. This function is untested, borderline
+    untestable, which is why it's simple.
+
+    The socket is nonblocking, so if the client is slow to read, we
+    wait up to 30 seconds for each write to be possible, and close the
+    connection if that's not enough.
+
+    Unless the connection is to be kept open, send() closes it
+    afterwards.
 */
 
-void HttpServer::operator()()
+void HttpServer::send( string response )
 {
-    start();
+    write( response.data(), response.length() );
+    if ( !k )
+	close();
+}
+
+
+// looks at a Range header field such as "bytes=100-199", "bytes=100-"
+// or "bytes=-100" and sets first and last accordingly. returns 0 if
+// the entire file should be sent (there was no range, or one we
+// don't bother with), 206 for a range and 416 if the range is
+// outside the file.
+static int byteRange( const string & range, long long size,
+		      long long & first, long long & last )
+{
+    first = 0;
+    last = size - 1;
+    if ( range.compare( 0, 6, "bytes=" ) ||
+	 range.find( ',' ) != string::npos )
+	return 0;
+    string::size_type dash = range.find( '-', 6 );
+    if ( dash == string::npos )
+	return 0;
+    string a = range.substr( 6, dash - 6 );
+    string b = range.substr( dash + 1 );
+    if ( a.find_first_not_of( "0123456789" ) != string::npos ||
+	 b.find_first_not_of( "0123456789" ) != string::npos ||
+	 ( a.empty() && b.empty() ) )
+	return 0;
+    if ( a.empty() ) {
+	// the last n bytes
+	long long n = ::atoll( b.c_str() );
+	if ( n == 0 || size == 0 )
+	    return 416;
+	if ( n < size )
+	    first = size - n;
+	return 206;
+    }
+    first = ::atoll( a.c_str() );
+    if ( !b.empty() && ::atoll( b.c_str() ) < last )
+	last = ::atoll( b.c_str() );
+    if ( first >= size || first > last )
+	return 416;
+    return 206;
+}
+
+
+/*! Sends the contents of \a file, which is \a size bytes long, or
+    the part of it that the client asked for using Range. The data is
+    sent with sendfile(), so it never passes through nodee.
+
+    Like send(), this closes the connection unless it's to be kept
+    open. \a file is left open.
+*/
+
+void HttpServer::sendFile( int file, long long size )
+{
+    long long first = 0;
+    long long last = size - 1;
+    int numeric = byteRange( rg, size, first, last );
+    long long length = numeric == 416 ? 0 : last + 1 - first;
+
+    string r = k ? "HTTP/1.1 " : "HTTP/1.0 ";
+    if ( numeric == 206 )
+	r += "206 Partial content";
+    else if ( numeric == 416 )
+	r += "416 Range not satisfiable";
+    else
+	r += "200 Artifact follows";
+    r += k ? "\r\n"
+	     "Connection: keep-alive\r\n"
+	   : "\r\n"
+	     "Connection: close\r\n";
+    r += "Server: nodee\r\n"
+	 "Content-Type: application/octet-stream\r\n"
+	 "Accept-Ranges: bytes\r\n";
+    if ( numeric == 206 )
+	r += "Content-Range: bytes " +
+	     boost::lexical_cast<string>( first ) + "-" +
+	     boost::lexical_cast<string>( last ) + "/" +
+	     boost::lexical_cast<string>( size ) + "\r\n";
+    else if ( numeric == 416 )
+	r += "Content-Range: bytes */" +
+	     boost::lexical_cast<string>( size ) + "\r\n";
+    r += "Content-Length: " + boost::lexical_cast<string>( length ) +
+	 "\r\n\r\n";
+    write( r.data(), r.size() );
+
+    off_t o = first;
+    while ( f >= 0 && length > 0 ) {
+	ssize_t n = ::sendfile( f, file, &o,
+				length > 1048576 ? 1048576 : length );
+	if ( n < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK ) ) {
+	    if ( !writable( f ) )
+		close();
+	} else if ( n < 0 && errno == EINTR ) {
+	    // just try again
+	} else if ( n <= 0 ) {
+	    // EPIPE when the peer has gone away, some other error, or
+	    // the file shrank under our feet
+	    close();
+	} else {
+	    length -= n;
+	}
+    }
+    if ( !k )
+	close();
 }
 
 /*! \fn int HttpServer::contentLength() const
@@ -446,10 +1083,43 @@ void HttpServer::operator()()
 */
 
 
-/*! Returns the client request body, or an empty string if no body was supplied     or the request hasn't been parsed yet.
+/*! \fn string HttpServer::ifNoneMatch() const
+
+  Returns the client's If-None-Match header field, or an empty string
+  if there wasn't one.
 */
 
-string HttpServer::body() const
-{
 
-}
+/*! \fn string HttpServer::range() const
+
+  Returns the client's Range header field, in lower case, or an empty
+  string if there wasn't one.
+*/
+
+
+/*! \fn bool HttpServer::resumed() const
+
+  Returns true if the current request was deferred and is now being
+  handled again, and false if this is the first try.
+*/
+
+
+/*! \fn bool HttpServer::keepAlive() const
+
+  Returns true if the connection should stay open after the current
+  response, and false if it should be closed. HTTP/1.1 clients get
+  keep-alive unless they ask otherwise, until MaxRequests requests
+  have been served on the connection.
+*/
+
+/*! \fn Init & HttpServer::manager() const
+
+  Returns the Init this HttpServer works on. The Router's handlers
+  need it.
+*/
+
+/*! \fn string HttpServer::body() const
+
+  Returns the client request body, or an empty string if no body was
+  supplied or the request hasn't been parsed yet.
+*/
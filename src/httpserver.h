@@ -4,9 +4,13 @@
 #define HTTPSERVER_H
 
 #include <string>
+#include <vector>
 
 #include "init.h"
 
+#include <boost/function.hpp>
+#include <boost/thread/mutex.hpp>
+
 using namespace std;
 
 
@@ -14,37 +18,78 @@ class HttpServer
 {
 public:
     enum Operation { Get, Post, Invalid };
+    enum Input { Partial, Complete, Broken };
 
     HttpServer( int, Init & );
 
-    void operator()();
+    static const int MaxRequests = 100;
+    static const int MaxBody = 16 * 1024 * 1024;
 
+    Input receive();
     void start();
+    Input next();
+
+    bool keepAlive() const { return k; }
+
+    Init & manager() const { return init; }
+
+    int fd() const { return f; }
 
     string readRequest();
     void parseRequest( string );
     void readBody();
 
-    string body() const;
+    string body() const { return b; }
     int contentLength() const { return cl; }
     Operation operation() const { return o; }
     string path() const { return p; }
+    string ifNoneMatch() const { return inm; }
+    string range() const { return rg; }
+    string parameter( const string & ) const;
+    bool matches( const string & ) const;
 
     void respond();
     void send( string );
+    void sendFile( int, long long );
+
+    void defer();
+    bool deferred() const;
+    bool resumed() const { return a; }
+    bool release();
+    void resume();
+    void setResumer( const boost::function<void()> & );
 
     string httpResponse( int, const string &, const string &,
-			 const string & = "" );
+			 const string & = "", const string & = "" );
 
     void close();
+    int detach();
 
 private:
+    enum Deferral { Answering, Deferred, Released, Woken, Again };
+
+    Input examine();
+    void findHeaderEnd();
+    void write( const char *, int );
+
     Init & init;
+    vector<char> i;
+    int used;
+    int scanned;
+    int h;
     string p;
     string b;
+    string inm;
+    string rg;
     Operation o;
     int cl;
     int f;
+    bool k;
+    int served;
+    Deferral d;
+    bool a;
+    boost::function<void()> resumer;
+    mutable boost::mutex m;
 };
 
 
@@ -2,16 +2,138 @@
 
 #include "init.h"
 #include "log.h"
+#include "service.h"
+#include "journal.h"
+#include "artifact.h"
 
 #include <boost/thread.hpp>
 
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <signal.h>
+#include <poll.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <time.h>
 
+#if defined(__linux__)
+#include <sys/signalfd.h>
+#endif
 
-static std::list<Process *> l;
-static boost::mutex mutex;
-static boost::condition_variable managing;
+#include <vector>
+#include <algorithm>
+
+#include <boost/unordered_map.hpp>
+#include <boost/version.hpp>
+
+
+struct ExitEvent
+{
+    int pid;
+    int status;
+    int signal;
+    int tries;
+};
+
+
+// the table is keyed by handle, and the two indexes point into it.
+// a ProcessTable is never changed once it's been published.
+struct ProcessTable
+{
+    boost::unordered_map<unsigned int, boost::shared_ptr<Process> > handles;
+    boost::unordered_map<int, unsigned int> pids;
+    boost::unordered_multimap<std::string, unsigned int> coordinates;
+    boost::shared_ptr<const Init::Processes> all;
+};
+
+
+static boost::shared_ptr<const ProcessTable> published;
+static unsigned int lastHandle = 0;
+
+// artifacts that forget() has dropped, which check() releases once
+// it's no longer holding the mutex, since releasing one writes to disk
+static std::vector<std::string> released;
+
+// only writers take this. it's recursive, since Process::handleExit()
+// is called with the mutex held and may fork, which calls reindex().
+static boost::recursive_mutex mutex;
+
+#if BOOST_VERSION < 105300
+// older boost has no atomic_load() for shared_ptr, so we guard the
+// pointer copy with a mutex, which is held only for that copy.
+static boost::mutex pointer;
+#endif
+
+
+static boost::shared_ptr<const ProcessTable> load()
+{
+#if BOOST_VERSION >= 105300
+    return boost::atomic_load( &published );
+#else
+    boost::lock_guard<boost::mutex> lock( pointer );
+    return published;
+#endif
+}
+
+
+static bool byHandle( const boost::shared_ptr<Process> & a,
+		      const boost::shared_ptr<Process> & b )
+{
+    return a->handle() < b->handle();
+}
+
+
+// returns a copy of the current table, for a writer to modify and
+// publish()
+static ProcessTable * copy()
+{
+    boost::shared_ptr<const ProcessTable> t = load();
+    if ( t )
+	return new ProcessTable( *t );
+    return new ProcessTable;
+}
+
+
+static void publish( ProcessTable * t )
+{
+    Init::Processes * all = new Init::Processes;
+    all->reserve( t->handles.size() );
+    boost::unordered_map<unsigned int, boost::shared_ptr<Process> >
+	::const_iterator i = t->handles.begin();
+    while ( i != t->handles.end() ) {
+	all->push_back( i->second );
+	++i;
+    }
+    std::sort( all->begin(), all->end(), byHandle );
+    t->all.reset( all );
+
+    boost::shared_ptr<const ProcessTable> p( t );
+#if BOOST_VERSION >= 105300
+    boost::atomic_store( &published, p );
+#else
+    boost::lock_guard<boost::mutex> lock( pointer );
+    published = p;
+#endif
+}
+
+static std::vector<ExitEvent> unclaimed;
+static int sfd = -1;
+
+
+// the restart timers live in a wheel with one slot per second. a
+// timer that's due more than WheelSize seconds ahead goes round the
+// wheel a few times first.
+struct RestartTimer
+{
+    unsigned int handle;
+    unsigned int rounds;
+};
+
+enum { WheelSize = 64, MaxBackoff = 600 };
+
+static std::vector<RestartTimer> wheel[WheelSize];
+static time_t wheelTime = 0;
 
 
 /*! \class Init init.h
@@ -26,16 +148,66 @@ static boost::condition_variable managing;
 
     Init is more or less a singleton. I don't like singletons, but in
     this case the unix design forces our hand: Making more than one
-    object call ::wait() works poorly. You can make more than one
-    Init, but they actually will operate on the same Process list.
+    object reap children works poorly. You can make more than one
+    Init, but they actually will operate on the same Process list, and
+    only the first starts a reaper thread.
+
+    The reaper thread waits for SIGCHLD using a signalfd (or, on
+    systems without that, by waking up once per second), then reaps
+    all the children that have exited using waitid(), and only then
+    takes the mutex, briefly, to tell the relevant Process objects.
+    It never holds the mutex while waiting, so manage() and find()
+    never have to wait for a child to exit.
+
+    The Process objects are kept in a table indexed by handle, with
+    hash indexes by pid and coordinate, so find(), lookup() and
+    byCoordinate() don't depend on how many processes there are. Each
+    managed Process gets a handle that stays the same as long as Init
+    manages it, even if the pid changes when the process is restarted.
+    Process calls reindex() whenever its pid changes.
+
+    The table is copy-on-write: A writer (manage(), reindex() and the
+    reaper) copies the current table, changes the copy and publishes
+    it. Readers pick up the latest published table without taking any
+    lock, and keep it for as long as they like, so neither ChoreKeeper
+    nor the HTTP handlers ever wait for the reaper, or vice versa.
+    The Process objects are shared, so a Process that Init has
+    forgotten lives on until the last reader lets go of it. Changes
+    are rare (a fork or an exit) and the table is small, so copying
+    is cheap.
+
+    SIGCHLD has to be blocked in all threads for the signalfd to see
+    it, so main() calls blockSignals() before starting any threads,
+    and Spawn clears the signal mask in each child.
+
+    Init also restarts crashing services after a delay. A Process that
+    wants that calls schedule(), and the reaper thread looks at a
+    timer wheel (one slot per second) each time it wakes, and calls
+    Process::fork() for each restart that's due. Until then the
+    Process has no child at all, so nothing lingers in the process
+    table and /service/list shows it as a pending restart. backoff()
+    computes the delays.
 */
 
 
 
-/*! Constructs an empty Init. */
+/*! Constructs an empty Init, and starts the reaper thread if it
+    isn't running yet.
+*/
 
 Init::Init()
 {
+    boost::lock_guard<boost::recursive_mutex> lock( mutex );
+    static bool started = false;
+    if ( started )
+	return;
+    started = true;
+#if defined(__linux__)
+    sigset_t s;
+    ::sigemptyset( &s );
+    ::sigaddset( &s, SIGCHLD );
+    sfd = ::signalfd( -1, &s, SFD_NONBLOCK | SFD_CLOEXEC );
+#endif
     boost::thread t( *this );
 }
 
@@ -44,7 +216,8 @@ Init::Init()
 
 Init::~Init()
 {
-    l.clear();
+    boost::lock_guard<boost::recursive_mutex> lock( mutex );
+    publish( new ProcessTable );
 }
 
 
@@ -52,89 +225,381 @@ Init::~Init()
 
 void Init::start()
 {
-    while ( true )
-	check();
+    while ( true ) {
+	try {
+	    check();
+	} catch ( ... ) {
+	    // if the reaper dies, nothing is ever reaped again, so
+	    // whatever went wrong, we go on.
+	}
+    }
 }
 
 
-/*! Waits for and processes a single child event. */
+/*! Waits for SIGCHLD (for at most a second) and processes all the
+    child exits that have happened.
+
+    If a child's pid isn't known yet, perhaps because it exited before
+    its parent had recorded the pid, the exit is remembered and
+    retried the next few times.
+
+    Finally releases the artifacts forget() has collected, after
+    dropping the mutex.
+*/
 
 void Init::check()
 {
-    boost::unique_lock<boost::mutex> lock( mutex );
-    while ( l.empty() )
-	managing.wait( lock );
+    if ( sfd >= 0 ) {
+	struct pollfd p;
+	p.fd = sfd;
+	p.events = POLLIN;
+	p.revents = 0;
+	(void)::poll( &p, 1, 1000 );
+#if defined(__linux__)
+	struct signalfd_siginfo si[16];
+	while ( ::read( sfd, si, sizeof( si ) ) > 0 )
+	    ;
+#endif
+    } else {
+	::sleep( 1 );
+    }
 
-    int status;
-    int pid = ::wait( &status );
+    // several children may have exited for each SIGCHLD, so we reap
+    // until there's nothing more to reap.
+    std::vector<ExitEvent> exits;
+    while ( true ) {
+	siginfo_t info;
+	info.si_pid = 0;
+	if ( ::waitid( P_ALL, 0, &info, WEXITED | WNOHANG ) < 0 ||
+	     !info.si_pid )
+	    break;
+	// we now have a pid. find out what happened to it.
+	ExitEvent e;
+	e.pid = info.si_pid;
+	e.status = -1;
+	e.signal = 0;
+	e.tries = 0;
+	if ( info.si_code == CLD_EXITED )
+	    e.status = info.si_status;
+	else
+	    e.signal = info.si_status;
+	exits.push_back( e );
+    }
 
-    if ( pid <= 0 )
-	return;
+    std::vector<std::string> artifacts;
+    {
+	boost::lock_guard<boost::recursive_mutex> lock( mutex );
+	exits.insert( exits.begin(), unclaimed.begin(), unclaimed.end() );
+	unclaimed.clear();
+
+	// find the relevant Process objects, ping them and forget
+	// about them.
+	std::vector<ExitEvent>::iterator e = exits.begin();
+	while ( e != exits.end() ) {
+	    boost::shared_ptr<Process> p = find( e->pid );
+	    if ( p ) {
+		p->handleExit( e->status, e->signal );
+		if ( !p->pid() && !p->pending() ) {
+		    Journal::record( Journal::Removed, e->pid,
+				     p->coordinate() );
+		    forget( p.get() );
+		}
+		Service::changed();
+	    } else if ( ++e->tries < 5 ) {
+		unclaimed.push_back( *e );
+	    }
+	    ++e;
+	}
 
-    // we now have a pid. find out what happened to it.
-    int exitStatus = -1;
-    if ( WIFEXITED( status ) )
-	exitStatus = WEXITSTATUS( status );
-    bool signalled = WIFSIGNALED( status );
-    int signal = 0;
-    if ( signalled )
-	signal = WTERMSIG( status );
-
-    // find the relevant Process object, ping it and forget about it.
-    std::list<Process *>::iterator i = l.begin();
-    while ( i != l.end() && (*i)->pid() != pid )
-	++i;
-    if ( i != l.end() && (*i)->pid() == pid ) {
-	(*i)->handleExit( exitStatus, signal );
-	if ( !(*i)->pid() ) {
-	    Process * tbd = *i;
-	    l.remove( *i );
-	    delete tbd;
+	restartDue( ::time( 0 ) );
+	artifacts.swap( released );
+    }
+
+    std::vector<std::string>::iterator a = artifacts.begin();
+    while ( a != artifacts.end() ) {
+	Artifact::release( *a );
+	++a;
+    }
+}
+
+
+/*! Restarts the processes whose restart timers expire at or before
+    \a now. A Process whose restart has been cancelled in the
+    meantime is forgotten instead.
+
+    If the clock moves backwards, the timers wait for it to catch up.
+*/
+
+void Init::restartDue( time_t now )
+{
+    boost::lock_guard<boost::recursive_mutex> lock( mutex );
+    if ( !wheelTime )
+	wheelTime = now;
+    std::vector<unsigned int> due;
+    while ( wheelTime < now ) {
+	wheelTime++;
+	std::vector<RestartTimer> & slot = wheel[wheelTime % WheelSize];
+	std::vector<RestartTimer>::iterator i = slot.begin();
+	while ( i != slot.end() ) {
+	    if ( i->rounds ) {
+		i->rounds--;
+		++i;
+	    } else {
+		due.push_back( i->handle );
+		i = slot.erase( i );
+	    }
 	}
     }
+
+    std::vector<unsigned int>::iterator h = due.begin();
+    while ( h != due.end() ) {
+	boost::shared_ptr<Process> p = lookup( *h );
+	bool started = p && p->pending() && p->fork();
+	if ( p && !started && !p->pid() && !p->pending() ) {
+	    Journal::record( Journal::Removed, 0, p->coordinate() );
+	    forget( p.get() );
+	    Service::changed();
+	}
+	++h;
+    }
 }
 
 
-/*! Returns a reference to Init's list of managed processes. Callers
-    should not change the list, but may change the included objects.
+/*! Records that \a p should be restarted in \a seconds seconds (at
+    least one). restartDue() calls Process::fork() then, unless \a p
+    is no longer pending() by that time.
 */
 
-std::list<Process *> & Init::processes()
+void Init::schedule( Process * p, int seconds )
 {
-    return l;
+    boost::lock_guard<boost::recursive_mutex> lock( mutex );
+    time_t now = ::time( 0 );
+    if ( !wheelTime )
+	wheelTime = now;
+    if ( seconds < 1 )
+	seconds = 1;
+    time_t due = now + seconds;
+    if ( due <= wheelTime )
+	due = wheelTime + 1;
+    RestartTimer t;
+    t.handle = p->h;
+    t.rounds = ( due - wheelTime - 1 ) / WheelSize;
+    wheel[due % WheelSize].push_back( t );
 }
 
 
-/*! Starts managing \a p. This is a copy operation; the managed object
-    is not yours.
+/*! Returns how many seconds to wait before restarting a service that
+    has crashed \a attempt times in a row, each time less than \a
+    period seconds after starting.
+
+    The delay starts at \a period and doubles with each attempt, up to
+    ten minutes. Half the delay is random, so that a fleet of services
+    that crashed at the same time (say, because a database went away)
+    don't all come back at the same time.
+*/
+
+int Init::backoff( int period, int attempt )
+{
+    int d = period > 0 ? period : 1;
+    while ( attempt > 1 && d < MaxBackoff ) {
+	d *= 2;
+	attempt--;
+    }
+    if ( d > MaxBackoff )
+	d = MaxBackoff;
+    return d - d / 2 + ::rand() % ( d / 2 + 1 );
+}
+
 
-    Returns a pointer to the copied object.
+/*! Returns the managed processes, in the order they were handed
+    to manage(). The list is immutable and costs nothing to keep, but
+    it doesn't change when Init does, so callers should get a new one
+    for each job.
+*/
+
+boost::shared_ptr<const Init::Processes> Init::processes() const
+{
+    boost::shared_ptr<const ProcessTable> t = load();
+    if ( t )
+	return t->all;
+    return boost::shared_ptr<const Processes>( new Processes );
+}
+
+
+/*! Returns the number of managed processes. */
+
+int Init::count() const
+{
+    boost::shared_ptr<const ProcessTable> t = load();
+    return t ? t->handles.size() : 0;
+}
+
+
+/*! Starts managing \a p, which from now on belongs to Init, and
+    gives \a p a handle().
 */
 
 void Init::manage( Process * p )
 {
-    boost::lock_guard<boost::mutex> lock( mutex );
-    l.push_back( p );
+    boost::lock_guard<boost::recursive_mutex> lock( mutex );
+    ProcessTable * t = copy();
+    p->h = ++lastHandle;
+    t->handles[p->h] = boost::shared_ptr<Process>( p );
+    if ( p->pid() )
+	t->pids[p->pid()] = p->h;
+    t->coordinates.insert( std::make_pair( p->coordinate(), p->h ) );
+    int n = t->handles.size();
+    publish( t );
+    Service::changed();
     debug << "nodee: Process count is now "
-	  << l.size()
+	  << n
 	  << endl;
-    ::managing.notify_one();
+}
 
+
+/*! Stops managing \a p, which must not have a running child. Launcher
+    uses this to give up on a Process it couldn't start.
+*/
+
+void Init::discard( Process * p )
+{
+    boost::lock_guard<boost::recursive_mutex> lock( mutex );
+    if ( !p->h )
+	return;
+    Journal::record( Journal::Removed, p->pid(), p->coordinate() );
+    forget( p );
+    Service::changed();
 }
 
 
-/*! Returns a pointer to the Process object for \a pid, or an null
-    pointer if \a pid is not the pid of a managed service.
+/*! Removes \a p from the table. \a p is deleted when nobody uses it
+    any more. The artifact \a p used is released by the next check(),
+    since Artifact::release() may write to disk and this is called
+    with the mutex held.
 */
 
-Process * Init::find( int pid ) const
+void Init::forget( Process * p )
 {
-    std::list<Process *>::const_iterator i = l.begin();
-    while ( i != l.end() && (*i)->pid() != pid )
-	++i;
-    if ( i == l.end() )
-	return 0;
-    return *i;
+    boost::lock_guard<boost::recursive_mutex> lock( mutex );
+    ProcessTable * t = copy();
+    boost::unordered_map<int, unsigned int>::iterator i
+	= t->pids.find( p->pid() );
+    if ( i != t->pids.end() && i->second == p->h )
+	t->pids.erase( i );
+    typedef boost::unordered_multimap<std::string, unsigned int>::iterator C;
+    std::pair<C, C> r = t->coordinates.equal_range( p->coordinate() );
+    while ( r.first != r.second ) {
+	if ( r.first->second == p->h ) {
+	    t->coordinates.erase( r.first );
+	    break;
+	}
+	++r.first;
+    }
+    t->handles.erase( p->h );
+    p->h = 0;
+    publish( t );
+    if ( !p->artifact.empty() ) {
+	released.push_back( p->artifact );
+	p->artifact.clear();
+    }
+}
+
+
+/*! Returns the Process object for \a pid, or an null pointer if \a
+    pid is not the pid of a managed service.
+*/
+
+boost::shared_ptr<Process> Init::find( int pid ) const
+{
+    boost::shared_ptr<const ProcessTable> t = load();
+    if ( !pid || !t )
+	return boost::shared_ptr<Process>();
+    boost::unordered_map<int, unsigned int>::const_iterator i
+	= t->pids.find( pid );
+    if ( i == t->pids.end() )
+	return boost::shared_ptr<Process>();
+    boost::unordered_map<unsigned int, boost::shared_ptr<Process> >
+	::const_iterator p = t->handles.find( i->second );
+    if ( p == t->handles.end() )
+	return boost::shared_ptr<Process>();
+    return p->second;
+}
+
+
+/*! Returns the Process object whose handle() is \a handle, or a null
+    pointer if there is none.
+*/
+
+boost::shared_ptr<Process> Init::lookup( unsigned int handle ) const
+{
+    boost::shared_ptr<const ProcessTable> t = load();
+    if ( !t )
+	return boost::shared_ptr<Process>();
+    boost::unordered_map<unsigned int, boost::shared_ptr<Process> >
+	::const_iterator i = t->handles.find( handle );
+    if ( i == t->handles.end() )
+	return boost::shared_ptr<Process>();
+    return i->second;
+}
+
+
+/*! Returns all the managed processes for \a coordinate. There may be
+    more than one, for instance while a service is being downloaded
+    and installed.
+*/
+
+Init::Processes Init::byCoordinate( const std::string & coordinate ) const
+{
+    Processes r;
+    boost::shared_ptr<const ProcessTable> t = load();
+    if ( !t )
+	return r;
+    typedef boost::unordered_multimap<std::string, unsigned int>
+	::const_iterator C;
+    std::pair<C, C> range = t->coordinates.equal_range( coordinate );
+    while ( range.first != range.second ) {
+	boost::unordered_map<unsigned int, boost::shared_ptr<Process> >
+	    ::const_iterator i = t->handles.find( range.first->second );
+	if ( i != t->handles.end() )
+	    r.push_back( i->second );
+	++range.first;
+    }
+    return r;
+}
+
+
+/*! Records that \a p's pid has changed from \a old to whatever it is
+    now. Process calls this; if \a p isn't managed, nothing happens.
+*/
+
+void Init::reindex( Process * p, int old )
+{
+    boost::lock_guard<boost::recursive_mutex> lock( mutex );
+    boost::shared_ptr<const ProcessTable> current = load();
+    if ( !p->h || !current ||
+	 current->handles.find( p->h ) == current->handles.end() )
+	return;
+    ProcessTable * t = copy();
+    boost::unordered_map<int, unsigned int>::iterator i
+	= t->pids.find( old );
+    if ( old && i != t->pids.end() && i->second == p->h )
+	t->pids.erase( i );
+    if ( p->pid() )
+	t->pids[p->pid()] = p->h;
+    publish( t );
+}
+
+
+/*! Blocks SIGCHLD in the calling thread, and in all threads it
+    starts later. main() calls this before starting any threads.
+*/
+
+void Init::blockSignals()
+{
+    sigset_t s;
+    ::sigemptyset( &s );
+    ::sigaddset( &s, SIGCHLD );
+    ::pthread_sigmask( SIG_BLOCK, &s, 0 );
 }
 
 
@@ -4,7 +4,13 @@
 #define INIT_H
 
 #include "process.h"
-#include <list>
+
+#include <string>
+#include <vector>
+
+#include <time.h>
+
+#include <boost/shared_ptr.hpp>
 
 
 class Init
@@ -18,11 +24,27 @@ public:
     void start();
     void check();
 
-    std::list<Process *>& processes();
+    typedef std::vector< boost::shared_ptr<Process> > Processes;
+
+    boost::shared_ptr<const Processes> processes() const;
+    int count() const;
 
     void manage( Process * p );
+    void discard( Process * p );
+
+    boost::shared_ptr<Process> find( int ) const;
+    boost::shared_ptr<Process> lookup( unsigned int ) const;
+    Processes byCoordinate( const std::string & ) const;
+
+    static void reindex( Process *, int );
+    static void schedule( Process *, int );
+    static int backoff( int, int );
+
+    static void blockSignals();
 
-    Process * find( int ) const;
+private:
+    void forget( Process * );
+    void restartDue( time_t );
 };
 
 #endif
@@ -0,0 +1,251 @@
+// Copyright Arnt Gulbrandsen <arnt@gulbrandsen.priv.no>; BSD-licensed.
+
+#include "journal.h"
+
+#include "events.h"
+
+#include <deque>
+#include <list>
+
+#include <boost/property_tree/ptree.hpp>
+#include <boost/property_tree/json_parser.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/thread.hpp>
+
+using boost::property_tree::ptree;
+
+
+struct JournalEntry
+{
+    unsigned int version;
+    Journal::Event event;
+    int pid;
+    string coordinate;
+    int status;
+    int signal;
+};
+
+
+struct JournalWatcher
+{
+    time_t deadline;
+    boost::function<void()> wake;
+};
+
+
+static boost::mutex mutex;
+static unsigned int current = 0;
+static std::deque<JournalEntry> entries;
+static std::list<JournalWatcher> watchers;
+
+
+static ptree describe( const JournalEntry & e )
+{
+    ptree c;
+    switch ( e.event ) {
+    case Journal::Started:
+	c.put( "event", "started" );
+	break;
+    case Journal::Exited:
+	c.put( "event", "exited" );
+	c.put( "status", e.status );
+	if ( e.signal )
+	    c.put( "signal", e.signal );
+	break;
+    case Journal::Pending:
+	c.put( "event", "pending" );
+	c.put( "delay", e.status );
+	break;
+    case Journal::Killed:
+	c.put( "event", "killed" );
+	break;
+    case Journal::Removed:
+	c.put( "event", "removed" );
+	break;
+    }
+    c.put( "pid", e.pid );
+    if ( !e.coordinate.empty() )
+	c.put( "coordinate", e.coordinate );
+    return c;
+}
+
+
+/*! \class Journal journal.h
+
+    The Journal class records changes to the set of running services,
+    so that clients can learn what happened without fetching the
+    entire service list again and again.
+
+    Each change gets a version number one higher than the last, and
+    the Journal remembers the last MaxEntries changes. A client that
+    knows version N can ask for changes() since N, or can watch() for
+    the next change after N. If the client has fallen so far behind
+    that the Journal has forgotten some of what it missed, covers()
+    returns false, and the client has to start over with
+    Service::list().
+
+    Process records Started, Exited and Pending (a restart has been
+    scheduled for later), ChoreKeeper records Killed
+    when it kills a service, and Init records Removed when it gives up
+    on a Process. Each change is also published via Events.
+
+    The versions start at 0 when nodee starts, so a client that
+    survives a nodee restart will either find that covers() returns
+    false, or miss some changes. Clients should ask for the service
+    list when they reconnect.
+*/
+
+
+/*! Records that \a event has happened to the process \a pid, which
+    serves \a coordinate, and wakes any watchers. If the process has
+    exited, \a status and \a signal are as for Process::handleExit().
+    If a restart is pending, \a status is the delay in seconds.
+*/
+
+void Journal::record( Event event, int pid, const string & coordinate,
+		      int status, int signal )
+{
+    std::list<JournalWatcher> woken;
+    JournalEntry e;
+    {
+	boost::lock_guard<boost::mutex> lock( mutex );
+	e.version = ++current;
+	e.event = event;
+	e.pid = pid;
+	e.coordinate = coordinate;
+	e.status = status;
+	e.signal = signal;
+	entries.push_back( e );
+	while ( (int)entries.size() > MaxEntries )
+	    entries.pop_front();
+	// every watcher waits for something after its version, and
+	// this is after all of them.
+	woken.swap( watchers );
+    }
+
+    // the watchers are woken after the mutex is released, so that
+    // they may look at the journal at once.
+    std::list<JournalWatcher>::iterator i = woken.begin();
+    while ( i != woken.end() ) {
+	i->wake();
+	++i;
+    }
+
+    if ( Events::subscribers() ) {
+	ptree c = describe( e );
+	c.put( "version", e.version );
+	ostringstream os;
+	write_json( os, c, false );
+	Events::publish( c.get<string>( "event" ), os.str() );
+    }
+}
+
+
+/*! Returns the version of the latest change, or 0 if nothing has
+    happened yet.
+*/
+
+unsigned int Journal::version()
+{
+    boost::lock_guard<boost::mutex> lock( mutex );
+    return current;
+}
+
+
+/*! Returns true if the Journal remembers all changes since \a since,
+    and false if some have been forgotten or \a since is in the
+    future (perhaps because nodee restarted).
+*/
+
+bool Journal::covers( unsigned int since )
+{
+    boost::lock_guard<boost::mutex> lock( mutex );
+    if ( since > current )
+	return false;
+    if ( entries.empty() )
+	return true;
+    return since + 1 >= entries.front().version;
+}
+
+
+/*! Returns a JSON object describing all changes since \a since. The
+    object contains the current version and, unless there are no
+    changes, a map from version to change.
+*/
+
+string Journal::changes( unsigned int since )
+{
+    ptree pt;
+    ptree all;
+    {
+	boost::lock_guard<boost::mutex> lock( mutex );
+	pt.put( "version", current );
+	std::deque<JournalEntry>::iterator i = entries.begin();
+	while ( i != entries.end() ) {
+	    if ( i->version > since )
+		all.push_back(
+		    ptree::value_type(
+			boost::lexical_cast<string>( i->version ),
+			describe( *i ) ) );
+	    ++i;
+	}
+    }
+
+    // write_json would write an empty map as "", so we leave it out
+    if ( !all.empty() )
+	pt.put_child( "changes", all );
+
+    ostringstream os;
+    write_json( os, pt );
+    return os.str();
+}
+
+
+/*! Calls \a wake once something has happened after \a since, or once
+    \a deadline has passed, whichever happens first. If something
+    already has happened, \a wake is called at once.
+
+    \a wake may be called by any thread, and should be quick.
+*/
+
+void Journal::watch( unsigned int since, time_t deadline,
+		     const boost::function<void()> & wake )
+{
+    {
+	boost::lock_guard<boost::mutex> lock( mutex );
+	if ( since >= current ) {
+	    JournalWatcher w;
+	    w.deadline = deadline;
+	    w.wake = wake;
+	    watchers.push_back( w );
+	    return;
+	}
+    }
+    wake();
+}
+
+
+/*! Wakes all watchers whose deadline is before \a now. HttpListener
+    calls this every second.
+*/
+
+void Journal::expire( time_t now )
+{
+    std::list<JournalWatcher> woken;
+    {
+	boost::lock_guard<boost::mutex> lock( mutex );
+	std::list<JournalWatcher>::iterator i = watchers.begin();
+	while ( i != watchers.end() ) {
+	    std::list<JournalWatcher>::iterator w = i;
+	    ++i;
+	    if ( w->deadline < now )
+		woken.splice( woken.end(), watchers, w );
+	}
+    }
+
+    std::list<JournalWatcher>::iterator i = woken.begin();
+    while ( i != woken.end() ) {
+	i->wake();
+	++i;
+    }
+}
@@ -0,0 +1,32 @@
+// Copyright Arnt Gulbrandsen <arnt@gulbrandsen.priv.no>; BSD-licensed.
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <string>
+
+#include <time.h>
+
+#include <boost/function.hpp>
+
+using namespace std;
+
+
+class Journal
+{
+public:
+    enum Event { Started, Exited, Pending, Killed, Removed };
+
+    static const int MaxEntries = 4096;
+
+    static void record( Event, int, const string &, int = 0, int = 0 );
+
+    static unsigned int version();
+    static bool covers( unsigned int );
+    static string changes( unsigned int );
+
+    static void watch( unsigned int, time_t, const boost::function<void()> & );
+    static void expire( time_t );
+};
+
+#endif
@@ -0,0 +1,808 @@
+// Copyright Arnt Gulbrandsen <arnt@gulbrandsen.priv.no>; BSD-licensed.
+
+#include "launcher.h"
+
+#include "process.h"
+#include "init.h"
+#include "conf.h"
+#include "log.h"
+#include "fetcher.h"
+#include "store.h"
+#include "extractor.h"
+#include "artifact.h"
+
+#include <limits.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include <algorithm>
+#include <deque>
+#include <list>
+#include <map>
+#include <vector>
+
+#include <boost/thread.hpp>
+#include <boost/bind.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/property_tree/ptree.hpp>
+#include <boost/property_tree/json_parser.hpp>
+
+
+// one service on its way to being started
+struct LaunchJob
+{
+    Init * init;
+    unsigned int handle;
+    ServerSpec spec;
+    int uid;
+    int gid;
+    string root;
+    string filename;
+};
+
+
+// one artifact being downloaded, verified and installed, on behalf
+// of one or more LaunchJobs, or of no one if it's being prefetched.
+// background is true while a prefetch downloads outside the Download
+// limit.
+struct Fetch
+{
+    Fetch()
+	: init( 0 ), uid( 0 ), gid( 0 ), unpacked( false ),
+	  prefetch( false ), background( false ),
+	  bytes( 0 ), size( -1 ), state( "queued" ) {}
+
+    Init * init;
+    ServerSpec spec;
+    int uid;
+    int gid;
+    string filename;
+    string md5;
+    string sha256;
+    string staging;
+    bool unpacked;
+    bool prefetch;
+    bool background;
+    long long bytes;
+    long long size;
+    const char * state;
+    std::list<LaunchJob *> jobs;
+};
+
+
+// what prefetches() says about one artifact
+struct Prefetched
+{
+    string state;
+    long long bytes;
+    long long size;
+};
+
+
+// a helper process that runs one stage's script
+class LaunchStep: public Process
+{
+public:
+    LaunchStep( Launcher::Stage s, const ServerSpec & spec, int uid, int gid )
+	: Process( spec, uid, gid ), stage( s ), fetch( 0 ) {}
+
+    void handleExit( int status, int signal ) {
+	Launcher::finished( this, status, signal );
+    }
+
+    Launcher::Stage stage;
+    Fetch * fetch;
+};
+
+
+// something pump() has decided to do, once the mutex is released
+struct LaunchAction
+{
+    Launcher::Stage stage;
+    Init * init;
+    LaunchStep * step;
+    Fetch * fetch;
+    unsigned int handle;
+};
+
+
+static boost::mutex mutex;
+static std::deque<Fetch *> downloading;
+static std::deque<Fetch *> prefetching;
+static std::deque<Fetch *> verifying;
+static std::deque<Fetch *> installing;
+static std::deque<LaunchJob *> starting;
+static int active[Launcher::Stages];
+static std::map<string, Fetch *> fetches;
+static std::map<string, Prefetched> prefetched;
+static int background;
+static long long throttle;
+
+
+/*! \class Launcher launcher.h
+
+    The Launcher class starts services, in four stages: Download,
+    Verify, Install and Start.
+
+    launch() hands each new service to the Download stage. Each stage
+    has a queue and a limit on how many jobs it runs at once (see
+    limit()), so starting fifty services doesn't start fifty wgets and
+    fifty unzips at once. When a job finishes one stage it's queued
+    for the next, and if a stage fails, the service is given up.
+
+    Download, Verify and Install work per artifact file, not per
+    service: If ten services that use the same artifact are launched
+    at once, the first one starts a download and the other nine wait
+    for it, so the file is fetched, checked and unpacked only once.
+    fetching() returns the number of files being fetched.
+
+    Download uses a Fetcher, in a thread of its own, for http URLs,
+    and the download script for anything else. Verify compares the
+    digests the Fetcher computed with those in the ServerSpec, so it
+    needn't read the file again unless the script fetched it. Install
+    unpacks the file into the Store, unless the Store already has it,
+    using an Extractor for the file types it knows and the install
+    script (from Conf::scriptdir) in a helper Process for the rest.
+    Helpers are managed by Init like any other Process. Then Install
+    populates each service's root directory from the Store, which is
+    mostly a matter of making hard links. Start just calls
+    Process::fork() for the service itself.
+
+    The Launcher never calls Init while holding its own mutex. Init
+    calls the Launcher (when a helper exits) while holding Init's
+    mutex, so doing the opposite could deadlock.
+
+    queued() and running() report the depth of each stage, for
+    monitoring.
+
+    prefetch() downloads and installs an artifact before any service
+    needs it, so that a later launch() only has to populate and start.
+    Prefetches wait until no launch is waiting to download, run one at
+    a time outside the Download limit and share a bandwidth limit
+    (Conf::prefetchrate), so they don't slow down real launches. If a
+    service needs an artifact while it's being prefetched, the service
+    waits for the prefetch, which is no longer held back.
+    prefetches() reports how they're going.
+*/
+
+
+/*! Launches a new Process based on \a what, managed by \a init.
+    Returns quickly; the new Process will go on its way.
+
+    The Process is managed by \a init at once, so it's visible in the
+    service list, but it has no pid until it reaches the Start stage.
+*/
+
+void Launcher::launch( const ServerSpec & what, Init & init )
+{
+    Process * useful = new Process( what );
+    useful->assignUidGid();
+    // the artifact can't be evicted until Init forgets the Process
+    Artifact::acquire( what.artifactFilename() );
+    useful->artifact = what.artifactFilename();
+    init.manage( useful );
+
+    LaunchJob * j = new LaunchJob;
+    j->init = &init;
+    j->handle = useful->handle();
+    j->spec = what;
+    j->uid = useful->u;
+    j->gid = useful->g;
+    j->root = useful->root();
+    j->filename = Conf::artefactDirectory() + "/" + what.artifactFilename();
+
+    {
+	boost::lock_guard<boost::mutex> lock( mutex );
+	std::map<string, Fetch *>::iterator i = fetches.find( j->filename );
+	if ( i == fetches.end() ) {
+	    Fetch * f = new Fetch;
+	    f->init = &init;
+	    f->spec = what;
+	    f->uid = j->uid;
+	    f->gid = j->gid;
+	    f->filename = j->filename;
+	    fetches[f->filename] = f;
+	    downloading.push_back( f );
+	    i = fetches.find( j->filename );
+	} else {
+	    debug << "nodee: Waiting for download of "
+		  << j->filename
+		  << endl;
+	}
+	i->second->jobs.push_back( j );
+	std::deque<Fetch *>::iterator p =
+	    std::find( prefetching.begin(), prefetching.end(), i->second );
+	if ( p != prefetching.end() ) {
+	    // it was being prefetched, but now someone needs it
+	    prefetching.erase( p );
+	    downloading.push_back( i->second );
+	}
+    }
+
+    pump();
+}
+
+
+// the next four functions expect the caller to hold the mutex.
+// advance() records that f has reached state, and tells prefetches()
+// if anyone asked. drop() forgets a Fetch and gives up on the jobs
+// that are still waiting for it, if any.
+
+static void advance( Fetch * f, const char * state )
+{
+    f->state = state;
+    if ( !f->prefetch )
+	return;
+    Prefetched & p = prefetched[f->spec.artifactFilename()];
+    p.state = state;
+    p.bytes = f->bytes;
+    p.size = f->size;
+}
+
+
+static LaunchStep * step( Launcher::Stage stage, const ServerSpec & spec,
+			  int uid, int gid, const string & script,
+			  const map<string,string> & options )
+{
+    ServerSpec copy( spec );
+    copy.setStartupScript( Conf::scriptdir + "/" + script, options );
+    return new LaunchStep( stage, copy, uid, gid );
+}
+
+
+static void drop( Fetch * f, std::vector<LaunchJob *> & failed )
+{
+    advance( f, "failed" );
+    failed.insert( failed.end(), f->jobs.begin(), f->jobs.end() );
+    fetches.erase( f->filename );
+    delete f;
+}
+
+
+static void settle( Launcher::Stage stage, Fetch * f, bool ok,
+		    std::vector<LaunchJob *> & failed )
+{
+    if ( stage == Launcher::Download && f->background ) {
+	f->background = false;
+	background--;
+    } else {
+	active[stage]--;
+    }
+    switch ( stage ) {
+    case Launcher::Download:
+	if ( ok ) {
+	    advance( f, "verifying" );
+	    verifying.push_back( f );
+	} else {
+	    drop( f, failed );
+	}
+	break;
+    case Launcher::Verify:
+	if ( ok ) {
+	    // the next launch can use the file without downloading it
+	    fetches.erase( f->filename );
+	    advance( f, "installing" );
+	    installing.push_back( f );
+	} else {
+	    drop( f, failed );
+	}
+	break;
+    case Launcher::Install:
+	// f is no longer in fetches, so drop() won't do
+	advance( f, ok ? "done" : "failed" );
+	if ( ok )
+	    starting.insert( starting.end(), f->jobs.begin(), f->jobs.end() );
+	else
+	    failed.insert( failed.end(), f->jobs.begin(), f->jobs.end() );
+	delete f;
+	break;
+    case Launcher::Start:
+    case Launcher::Stages:
+	break;
+    }
+}
+
+
+// gives up on the services in \a failed.
+static void abandon( const std::vector<LaunchJob *> & failed )
+{
+    std::vector<LaunchJob *>::const_iterator i = failed.begin();
+    while ( i != failed.end() ) {
+	LaunchJob * j = *i;
+	debug << "nodee: Could not launch "
+	      << j->spec.artifactFilename()
+	      << endl;
+	boost::shared_ptr<Process> p = j->init->lookup( j->handle );
+	if ( p )
+	    j->init->discard( p.get() );
+	delete j;
+	++i;
+    }
+}
+
+
+/*! Downloads and installs the artifact described by \a what in the
+    background, so that it's in the Store when a service needs it.
+    Script helpers, if any, are managed by \a init. Returns quickly.
+
+    \a what need only specify url, filename and digests. If the
+    artifact is being fetched already, that fetch is reported by
+    prefetches() and nothing more happens.
+*/
+
+void Launcher::prefetch( const ServerSpec & what, Init & init )
+{
+    string filename = Conf::artefactDirectory() + "/" +
+		      what.artifactFilename();
+    {
+	boost::lock_guard<boost::mutex> lock( mutex );
+	std::map<string, Fetch *>::iterator i = fetches.find( filename );
+	if ( i != fetches.end() ) {
+	    i->second->prefetch = true;
+	    advance( i->second, i->second->state );
+	} else {
+	    Fetch * f = new Fetch;
+	    f->init = &init;
+	    f->spec = what;
+	    f->filename = filename;
+	    f->prefetch = true;
+	    fetches[filename] = f;
+	    prefetching.push_back( f );
+	    advance( f, "queued" );
+	}
+    }
+
+    pump();
+}
+
+
+/*! Returns a JSON object describing each artifact prefetch() has
+    been asked to fetch, keyed by file name: Its state (queued,
+    downloading, verifying, installing, done or failed), the number of
+    bytes downloaded so far and its size, or -1 if that isn't known
+    yet.
+*/
+
+string Launcher::prefetches()
+{
+    using boost::property_tree::ptree;
+
+    ptree pt;
+    {
+	boost::lock_guard<boost::mutex> lock( mutex );
+	std::map<string, Prefetched>::const_iterator i = prefetched.begin();
+	while ( i != prefetched.end() ) {
+	    ptree p;
+	    p.put( "state", i->second.state );
+	    p.put( "bytes", i->second.bytes );
+	    p.put( "size", i->second.size );
+	    // push_back, since put() would treat the dots as paths
+	    pt.push_back( ptree::value_type( i->first, p ) );
+	    ++i;
+	}
+    }
+    ostringstream os;
+    write_json( os, pt );
+    return os.str();
+}
+
+
+/*! Records that the helper \a s has exited with \a status and \a
+    signal (as for Process::handleExit()), and moves its job on to the
+    next stage, or gives it up.
+*/
+
+void Launcher::finished( LaunchStep * s, int status, int signal )
+{
+    // a helper is never restarted, whatever the spec says
+    s->starts = INT_MAX;
+    s->Process::handleExit( status, signal );
+
+    bool ok = status == 0 && signal == 0;
+    if ( s->stage == Install && ok ) {
+	// the Install stage isn't done until install() says so
+	s->fetch->unpacked = true;
+	boost::thread( boost::bind( &Launcher::install, s->fetch ) );
+	return;
+    }
+    if ( s->stage == Install )
+	Store::remove( s->fetch->staging );
+
+    std::vector<LaunchJob *> failed;
+    {
+	boost::lock_guard<boost::mutex> lock( mutex );
+	settle( s->stage, s->fetch, ok, failed );
+    }
+    abandon( failed );
+    pump();
+}
+
+
+/*! Records that \a stage has finished working on \a f, successfully
+    if \a ok is true, and moves on.
+*/
+
+void Launcher::done( Stage stage, Fetch * f, bool ok )
+{
+    std::vector<LaunchJob *> failed;
+    {
+	boost::lock_guard<boost::mutex> lock( mutex );
+	settle( stage, f, ok, failed );
+    }
+    abandon( failed );
+    pump();
+}
+
+
+/*! Downloads \a f using a Fetcher. Runs in a thread of its own.
+
+    If the file is there and Store knows its digests, as it does
+    after a prefetch, the file isn't even read.
+*/
+
+void Launcher::download( Fetch * f )
+{
+    if ( ::access( f->filename.c_str(), R_OK ) == 0 &&
+	 Store::digests( f->filename, f->md5, f->sha256 ) &&
+	 Fetcher::matches( f->spec.md5(), f->md5 ) &&
+	 Fetcher::matches( f->spec.sha256(), f->sha256 ) ) {
+	done( Download, f, true );
+	return;
+    }
+
+    Fetcher fetcher( f->spec.artifactUrl(), f->filename );
+    fetcher.setMd5( f->spec.md5() );
+    fetcher.setSha256( f->spec.sha256() );
+    fetcher.setProgress( boost::bind( &Launcher::progress, f, _1, _2 ) );
+    bool ok = fetcher.fetch();
+    f->md5 = fetcher.md5();
+    f->sha256 = fetcher.sha256();
+    if ( ok )
+	Store::remember( f->filename, f->md5, f->sha256 );
+    done( Download, f, ok );
+}
+
+
+/*! Records that \a bytes of \a f's file have been downloaded, of \a
+    size in all (or -1 if not known). Called by the Fetcher.
+
+    If no service is waiting for \a f, this sleeps long enough to keep
+    all such downloads together below Conf::prefetchrate kilobytes per
+    second.
+*/
+
+void Launcher::progress( Fetch * f, long long bytes, long long size )
+{
+    long long pause = 0;
+    {
+	boost::lock_guard<boost::mutex> lock( mutex );
+	long long n = bytes - f->bytes;
+	f->bytes = bytes;
+	f->size = size;
+	advance( f, f->state );
+	if ( f->jobs.empty() && Conf::prefetchrate > 0 && n > 0 ) {
+	    struct timeval tv;
+	    ::gettimeofday( &tv, 0 );
+	    long long now = tv.tv_sec * 1000000LL + tv.tv_usec;
+	    // unused bandwidth isn't saved up for later
+	    if ( throttle < now )
+		throttle = now;
+	    throttle += n * 1000000 / ( Conf::prefetchrate * 1024LL );
+	    pause = throttle - now;
+	}
+    }
+    if ( pause > 0 )
+	boost::this_thread::sleep( boost::posix_time::microseconds( pause ) );
+}
+
+
+/*! Checks that \a f's file has the digests its ServerSpec demands.
+    Runs in a thread of its own.
+
+    If the file was fetched by Fetcher, the digests are already
+    known, so this is quick. If the download script fetched it, the
+    file has to be read once.
+*/
+
+void Launcher::verify( Fetch * f )
+{
+    string md5 = f->spec.md5();
+    string sha256 = f->spec.sha256();
+    bool ok = ::access( f->filename.c_str(), R_OK ) == 0;
+    // the Store needs the SHA-256 even if the ServerSpec doesn't
+    if ( ok && f->sha256.empty() )
+	ok = Store::digests( f->filename, f->md5, f->sha256 );
+    if ( ok && !( Fetcher::matches( md5, f->md5 ) &&
+		  Fetcher::matches( sha256, f->sha256 ) ) ) {
+	debug << "nodee: " << f->filename
+	      << " does not have the right digest" << endl;
+	::unlink( f->filename.c_str() );
+	ok = false;
+    }
+    if ( ok && !Store::has( f->sha256 ) ) {
+	f->staging = Store::staging( f->sha256 );
+	ok = !f->staging.empty();
+    }
+    done( Verify, f, ok );
+}
+
+
+/*! Unpacks \a f's file into the Store, if the Store doesn't have it
+    and the install script hasn't done it, and populates the root
+    directory of each of \a f's services from the Store. Runs in a
+    thread of its own.
+
+    A service whose root can't be populated is given up, the others
+    go on to the Start stage.
+*/
+
+void Launcher::install( Fetch * f )
+{
+    bool ok = true;
+    if ( !f->staging.empty() && !f->unpacked ) {
+	Extractor x( f->filename, f->staging );
+	try {
+	    ok = x.extract();
+	    if ( !ok )
+		debug << "nodee: " << x.error() << endl;
+	} catch ( ... ) {
+	    // an exception escaping this thread would kill nodee
+	    debug << "nodee: Could not extract " << f->filename << endl;
+	    ok = false;
+	}
+	if ( !ok )
+	    Store::remove( f->staging );
+    }
+    if ( ok && !f->staging.empty() )
+	ok = Store::commit( f->staging, f->sha256 );
+    if ( ok ) {
+	Artifact::record( f->spec.artifactFilename(), f->sha256 );
+	Artifact::trim();
+    }
+
+    std::vector<LaunchJob *> failed;
+    std::list<LaunchJob *>::iterator j = f->jobs.begin();
+    while ( j != f->jobs.end() ) {
+	if ( ok && Store::populate( f->sha256, (*j)->root,
+				    (*j)->uid, (*j)->gid ) ) {
+	    ++j;
+	} else {
+	    failed.push_back( *j );
+	    j = f->jobs.erase( j );
+	}
+    }
+    abandon( failed );
+    done( Install, f, ok );
+}
+
+
+// returns what to do to download f. expects the caller to hold the
+// mutex.
+static LaunchAction fetchAction( Fetch * f )
+{
+    LaunchAction a;
+    a.stage = Launcher::Download;
+    a.init = f->init;
+    a.step = 0;
+    a.fetch = f;
+    a.handle = 0;
+    if ( !Fetcher::fetchable( f->spec.artifactUrl() ) ) {
+	// not http. perhaps the script knows how.
+	map<string,string> options;
+	options["--url"] = f->spec.artifactUrl();
+	options["--filename"] = f->filename;
+	if ( !f->spec.md5().empty() )
+	    options["--md5"] = f->spec.md5();
+	a.step = step( Launcher::Download, f->spec, f->uid, f->gid,
+		       "download", options );
+	a.step->fetch = f;
+    }
+    advance( f, "downloading" );
+    return a;
+}
+
+
+/*! Starts as much work as the limits allow, and keeps doing that
+    until nothing more can be started.
+*/
+
+void Launcher::pump()
+{
+    while ( true ) {
+	std::vector<LaunchAction> actions;
+	{
+	    boost::lock_guard<boost::mutex> lock( mutex );
+	    while ( !downloading.empty() &&
+		    active[Download] < limit( Download ) ) {
+		Fetch * f = downloading.front();
+		downloading.pop_front();
+		actions.push_back( fetchAction( f ) );
+		active[Download]++;
+	    }
+	    // one prefetch at a time, and only if no launch is waiting
+	    if ( !prefetching.empty() && downloading.empty() && !background ) {
+		Fetch * f = prefetching.front();
+		prefetching.pop_front();
+		f->background = true;
+		actions.push_back( fetchAction( f ) );
+		background++;
+	    }
+	    while ( !verifying.empty() && active[Verify] < limit( Verify ) ) {
+		Fetch * f = verifying.front();
+		verifying.pop_front();
+		LaunchAction a;
+		a.stage = Verify;
+		a.init = f->init;
+		a.step = 0;
+		a.fetch = f;
+		a.handle = 0;
+		actions.push_back( a );
+		active[Verify]++;
+	    }
+	    while ( !installing.empty() &&
+		    active[Install] < limit( Install ) ) {
+		Fetch * f = installing.front();
+		installing.pop_front();
+		LaunchAction a;
+		a.stage = Install;
+		a.init = f->init;
+		a.step = 0;
+		a.fetch = f;
+		a.handle = 0;
+		if ( !f->staging.empty() &&
+		     !Extractor::extractable( f->filename ) ) {
+		    // not in the Store yet, and not a file type we
+		    // know. unpack it as nodee, so that the Store
+		    // belongs to nodee.
+		    map<string,string> options;
+		    options["--filename"] = f->filename;
+		    options["--uid"] =
+			boost::lexical_cast<string>( ::geteuid() );
+		    options["--gid"] =
+			boost::lexical_cast<string>( ::getegid() );
+		    options["--rootdir"] = f->staging;
+		    a.step = step( Install, f->spec, 0, 0, "install", options );
+		    a.step->fetch = f;
+		}
+		actions.push_back( a );
+		active[Install]++;
+	    }
+	    while ( !starting.empty() && active[Start] < limit( Start ) ) {
+		LaunchJob * j = starting.front();
+		starting.pop_front();
+		LaunchAction a;
+		a.stage = Start;
+		a.init = j->init;
+		a.step = 0;
+		a.fetch = 0;
+		a.handle = j->handle;
+		actions.push_back( a );
+		active[Start]++;
+		delete j;
+	    }
+	}
+	if ( actions.empty() )
+	    return;
+
+	std::vector<LaunchJob *> failed;
+	std::vector<LaunchAction>::iterator a = actions.begin();
+	while ( a != actions.end() ) {
+	    if ( a->step ) {
+		a->init->manage( a->step );
+		// once the child runs, the reaper owns the step and may
+		// have settled and deleted it by the time fork() returns
+		if ( !a->step->fork() ) {
+		    if ( a->stage == Install )
+			Store::remove( a->step->fetch->staging );
+		    {
+			boost::lock_guard<boost::mutex> lock( mutex );
+			settle( a->stage, a->step->fetch, false, failed );
+		    }
+		    a->init->discard( a->step );
+		}
+	    } else if ( a->fetch && a->stage == Download ) {
+		boost::thread( boost::bind( &Launcher::download, a->fetch ) );
+	    } else if ( a->fetch && a->stage == Verify ) {
+		boost::thread( boost::bind( &Launcher::verify, a->fetch ) );
+	    } else if ( a->fetch ) {
+		boost::thread( boost::bind( &Launcher::install, a->fetch ) );
+	    } else {
+		boost::shared_ptr<Process> p = a->init->lookup( a->handle );
+		if ( p && !p->fork() && !p->pending() )
+		    a->init->discard( p.get() );
+		boost::lock_guard<boost::mutex> lock( mutex );
+		active[Start]--;
+	    }
+	    ++a;
+	}
+	abandon( failed );
+    }
+}
+
+
+/*! Returns the number of jobs waiting for \a stage. For Download,
+    Verify and Install, that's the number of files, not services.
+*/
+
+int Launcher::queued( Stage stage )
+{
+    boost::lock_guard<boost::mutex> lock( mutex );
+    switch ( stage ) {
+    case Download:
+	return downloading.size();
+    case Verify:
+	return verifying.size();
+    case Install:
+	return installing.size();
+    case Start:
+	return starting.size();
+    case Stages:
+	break;
+    }
+    return 0;
+}
+
+
+/*! Returns the number of jobs \a stage is working on right now. */
+
+int Launcher::running( Stage stage )
+{
+    if ( stage < Download || stage >= Stages )
+	return 0;
+    boost::lock_guard<boost::mutex> lock( mutex );
+    return active[stage];
+}
+
+
+/*! Returns the number of jobs \a stage may work on at once. The
+    limits are configurable, with defaults of 4 for Download and Start
+    and 2 for Verify and Install (which use more CPU and disk).
+*/
+
+int Launcher::limit( Stage stage )
+{
+    switch ( stage ) {
+    case Download:
+	return Conf::downloadlimit > 0 ? Conf::downloadlimit : 4;
+    case Verify:
+	return Conf::verifylimit > 0 ? Conf::verifylimit : 2;
+    case Install:
+	return Conf::installlimit > 0 ? Conf::installlimit : 2;
+    case Start:
+	return Conf::startlimit > 0 ? Conf::startlimit : 4;
+    case Stages:
+	break;
+    }
+    return 0;
+}
+
+
+/*! Returns the number of artifact files being downloaded or verified,
+    or waiting to be.
+*/
+
+int Launcher::fetching()
+{
+    boost::lock_guard<boost::mutex> lock( mutex );
+    return fetches.size();
+}
+
+
+/*! Returns the name of \a stage, in lower case, as used in JSON. */
+
+const char * Launcher::name( Stage stage )
+{
+    switch ( stage ) {
+    case Download:
+	return "download";
+    case Verify:
+	return "verify";
+    case Install:
+	return "install";
+    case Start:
+	return "start";
+    case Stages:
+	break;
+    }
+    return "";
+}
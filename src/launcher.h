@@ -0,0 +1,44 @@
+// Copyright Arnt Gulbrandsen <arnt@gulbrandsen.priv.no>; BSD-licensed.
+
+#ifndef LAUNCHER_H
+#define LAUNCHER_H
+
+#include <string>
+
+using namespace std;
+
+
+class Init;
+class Process;
+class ServerSpec;
+class LaunchStep;
+struct Fetch;
+
+
+class Launcher
+{
+public:
+    enum Stage { Download, Verify, Install, Start, Stages };
+
+    static void launch( const ServerSpec &, Init & );
+    static void prefetch( const ServerSpec &, Init & );
+    static string prefetches();
+
+    static int queued( Stage );
+    static int running( Stage );
+    static int limit( Stage );
+    static int fetching();
+    static const char * name( Stage );
+
+private:
+    friend class LaunchStep;
+    static void finished( LaunchStep *, int, int );
+    static void done( Stage, Fetch *, bool );
+    static void download( Fetch * );
+    static void progress( Fetch *, long long, long long );
+    static void verify( Fetch * );
+    static void install( Fetch * );
+    static void pump();
+};
+
+#endif
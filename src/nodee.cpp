@@ -1,16 +1,19 @@
 // Copyright Arnt Gulbrandsen <arnt@gulbrandsen.priv.no>; BSD-licensed.
 
+#include <signal.h>
 #include <sysexits.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
 
 #include "httplistener.h"
+#include "workerpool.h"
 #include "chorekeeper.h"
 #include "zkclient.h"
 #include "init.h"
 #include "conf.h"
 #include "log.h"
+#include "fetcher.h"
 
 #include <iostream>
 #include <fstream>
@@ -36,6 +39,16 @@ int main( int argc, char ** argv )
 {
     Conf::setDefaults();
 
+    // this has to happen before any threads are started, so they all
+    // leave SIGCHLD to Init.
+    Init::blockSignals();
+
+    // a client or peer that closes its connection while we write
+    // must not kill nodee. sendfile() has no MSG_NOSIGNAL, so the
+    // signal is ignored, and the writers treat EPIPE as a closed
+    // connection. Spawn restores the default for services.
+    ::signal( SIGPIPE, SIG_IGN );
+
     int port;
     vector<string> depots;
     string cf( CONFFILE );
@@ -54,6 +67,8 @@ int main( int argc, char ** argv )
 	  "set nodee TCP port" )
 	( "depot", value<vector<string> >( &depots )->composing(),
 	  "add artefact depot (e.g. example=http://artefactory.example.com/)" )
+	( "peer", value<vector<string> >( &Conf::peers )->composing(),
+	  "add a nodee that may share artefacts (e.g. 192.0.2.8:40)" )
 	( "dir",
 	  value<string>( &Conf::basedir )->default_value( "/usr/local/nodee" ),
 	  "specify base directory" )
@@ -62,12 +77,35 @@ int main( int argc, char ** argv )
 	  "specify work directory, relative to the base directory" )
 	( "artefact-dir",
 	  value<string>( &Conf::artefactdir )->default_value( "artefacts" ),
-	  "specify where to store artefacts, relative to the base directory" )
+	  "specify where to store artefacts, relative to the base directory "
+	  "unless absolute" )
 	( "script-dir",
 	  value<string>( &Conf::scriptdir )->default_value( "/etc/nodee/scripts" ),
 	  "specify where the download and install scripts live" )
 	( "zookeeper", value<string>( &Conf::zk ),
-	  "zookeeper location (e.g. FIXME)" );
+	  "zookeeper location (e.g. FIXME)" )
+	( "http-workers",
+	  value<int>( &Conf::httpworkers )->default_value( 4 ),
+	  "set the number of threads serving HTTP requests" )
+	( "download-limit",
+	  value<int>( &Conf::downloadlimit )->default_value( 4 ),
+	  "set how many artefacts may be downloaded at once" )
+	( "verify-limit",
+	  value<int>( &Conf::verifylimit )->default_value( 2 ),
+	  "set how many artefacts may be verified at once" )
+	( "install-limit",
+	  value<int>( &Conf::installlimit )->default_value( 2 ),
+	  "set how many services may be installed at once" )
+	( "start-limit",
+	  value<int>( &Conf::startlimit )->default_value( 4 ),
+	  "set how many services may be started at once" )
+	( "artefact-quota",
+	  value<int>( &Conf::artefactquota )->default_value( 0 ),
+	  "set how many megabytes the artefacts may use (0 for no limit)" )
+	( "prefetch-rate",
+	  value<int>( &Conf::prefetchrate )->default_value( 4096 ),
+	  "set how many kilobytes per second prefetching may use "
+	  "(0 for no limit)" );
 
     variables_map vm;
 
@@ -140,7 +178,7 @@ int main( int argc, char ** argv )
 	     << endl;
 	fail = true;
     }
-    if ( !boost::filesystem::is_directory( Conf::basedir + "/" + Conf::artefactdir ) ) {
+    if ( !boost::filesystem::is_directory( Conf::artefactDirectory() ) ) {
 	cerr << "Nodee: Cannot start up, artefact directory does not exist"
 	     << endl;
 	fail = true;
@@ -153,8 +191,8 @@ int main( int argc, char ** argv )
 	     << "nodee: basedir is '" << Conf::basedir << "'" <<  endl
 	     << "nodee: workdir is '" << Conf::basedir << '/'
 	     << Conf::workdir << "'" << endl
-	     << "nodee: artefactdir is '" << Conf::basedir << '/'
-	     << Conf::artefactdir <<  "'" << endl
+	     << "nodee: artefactdir is '" << Conf::artefactDirectory()
+	     <<  "'" << endl
 	     << "nodee: zk is '" << Conf::zk <<  "'" << endl;
     }
 
@@ -190,12 +228,15 @@ int main( int argc, char ** argv )
 	        "All services will use the same UID as nodee."
 	     << endl;
 
-    ZkClient zk( Conf::zk );
+    Fetcher::setPeers( Conf::peers );
+    ZkClient zk( Conf::zk, port );
 
     Init i;
 
-    HttpListener h6( HttpListener::V6, port, i );
-    HttpListener h4( HttpListener::V4, port, i );
+    WorkerPool workers( Conf::httpworkers );
+
+    HttpListener h6( HttpListener::V6, port, i, workers );
+    HttpListener h4( HttpListener::V4, port, i, workers );
 
     if ( !h6.valid() && !h4.valid() ) {
 	cerr << "nodee: Unable to listen to port "
@@ -233,6 +274,8 @@ int main( int argc, char ** argv )
 
     HttpListener helps HttpServer and creates new HttpServer objects
     as needed; HttpListener is one of nodee's long-running threads.
+    The HttpServers do their work in a WorkerPool shared by the
+    listeners.
 
     HostStatus and ChoreKeeper look at the host nodee runs
     on. HostStatus merely tells all comers about the host ("it has
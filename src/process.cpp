@@ -7,12 +7,16 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <signal.h>
-#include <sysexits.h>
+#include <string.h>
 
 #include <boost/lexical_cast.hpp>
 
 #include "conf.h"
 #include "init.h"
+#include "service.h"
+#include "journal.h"
+#include "spawn.h"
+#include "launcher.h"
 #include "uid.h"
 
 
@@ -25,9 +29,9 @@
     Most of Process manages information about the process; very few
     functions can be used to change the process.
 
-    fork() forks and starts the class.  assignUidGid() assigns
-    otherwise unused IDs for the process, so that no two services use
-    the same UID or GID.
+    fork() starts the child process, using Spawn and prepare().
+    assignUidGid() assigns otherwise unused IDs for the process, so
+    that no two services use the same UID or GID.
 
     setCurrentRss() and setPageFaults() are used by the ChoreKeeper to
     store information for the later use by the ChoreKeeper itself.
@@ -39,8 +43,9 @@
     The remaining functions all return information, from pid() and
     gid() to spec().
 
-    Implementation note: This class never kills or otherwise affects
-    the child process, it merely records information about it.
+    Implementation note: Apart from stop() and signal(), this class
+    never kills or otherwise affects the child process, it merely
+    records information about it.
 */
 
 /*! Constructs a naked, invalid Process.
@@ -50,60 +55,64 @@
 */
 
 Process::Process()
-    : p( 0 ), mp( ::getpid() ),
+    : p( 0 ), h( 0 ), pfd( -1 ),
       faults( 0 ), prevFaults( 0 ),
       rss( 0 ), next( 0 ),
-      starts( 0 ), waitUntil( 0 )
+      starts( 0 ), crashes( 0 ), waitUntil( 0 ), restartAt( 0 )
 {
 }
 
 
-/*! Fork a child process, redirect its stdin/stdout/stderr
-    appriopriately, and call start() in the child.
+/*! Starts a child process as described by prepare(), running as
+    uid() and gid(). The child is started at once; restart() decides
+    whether it's time to call this.
+
+    Returns false if the child could not be started, true if it was
+    (or if one was already running). Callers should use this rather
+    than pid(), since a child that exits at once may have been reaped
+    and pid() reset before this returns.
 */
 
-void Process::fork()
+bool Process::fork()
 {
     if ( p )
-	return;
+	return true;
 
     time_t now = time( 0 );
     starts++;
+    restartAt = 0;
 
-    int tmp = ::fork();
+    Spawn spawn;
+    spawn.setUid( u );
+    spawn.setGid( g );
+    prepare( spawn );
+
+    int tmp = spawn.run();
     if ( tmp < 0 ) {
 	debug << "nodee: unknown error: fork failed" << endl;
 	// an error. record the problem somehow, then just return.
 	p = 0;
-	return;
-    } else if ( tmp == 0 ) {
-	// we're in the child.
-
-	// the setregid and setreuid calls will return failure if
-	// nodee is being debugged as non-root. I think that's
-	// fine, so I just cast to void to underscore the point.
-	if ( g )
-	    (void)::setregid( g, g );
-	if ( u )
-	    (void)::setreuid( u, u );
-	if ( now < waitUntil ) {
-	    debug << "nodee: Restarting child in "
-		  << waitUntil - now
-		  << " seconds"
-		  << endl;
-	    ::sleep( waitUntil - now );
-	}
-	start();
-    } else {
-	// we're in the parent.
-	p = tmp;
-	debug << "nodee: Forked coordinate "
-	      << s.coordinate()
-	      << " to pid "
-	      << p
-	      << endl;
-	waitUntil = now + s.restartPeriod();
+	return false;
     }
+
+    p = tmp;
+    pfd = spawn.pidfd();
+    Init::reindex( this, 0 );
+    Service::changed();
+    Journal::record( Journal::Started, p, coordinate() );
+    debug << "nodee: Forked coordinate "
+	  << coordinate()
+	  << " to pid "
+	  << p
+	  << endl;
+    if ( spawn.error() )
+	debug << "nodee: Could not execute "
+	      << spawn.program()
+	      << ": "
+	      << strerror( spawn.error() )
+	      << endl;
+    waitUntil = now + s.restartPeriod();
+    return true;
 }
 
 
@@ -129,22 +138,64 @@ void Process::handleExit( int status, int signal )
 	  << status
 	  << endl;
 
+    Journal::record( Journal::Exited, p, coordinate(), status, signal );
+    int old = p;
     p = 0;
+    if ( pfd >= 0 )
+	::close( pfd );
+    pfd = -1;
+    Init::reindex( this, old );
+    Service::changed();
 
     if ( next )
 	next->fork();
     else if ( starts < s.maxRestarts() )
-        fork();
+	restart();
 }
 
 
-/*! Called in the child process to start the child's work. */
+/*! Restarts the process, either at once or later.
+
+    If the process ran for at least the ServerSpec's restart period,
+    it's restarted at once. If not, it's crashing, and Init is asked
+    to restart it after a delay that grows with each consecutive
+    crash (see Init::backoff()). Meanwhile the Process is pending(),
+    has no pid, and is listed as a pending restart.
+*/
 
-void Process::start()
+void Process::restart()
 {
-    if ( ::getpid() == mp )
+    time_t now = time( 0 );
+    if ( now >= waitUntil ) {
+	crashes = 0;
+	fork();
 	return;
+    }
+
+    crashes++;
+    int delay = Init::backoff( s.restartPeriod(), crashes );
+    restartAt = now + delay;
+    debug << "nodee: Restarting "
+	  << coordinate()
+	  << " in "
+	  << delay
+	  << " seconds"
+	  << endl;
+    Init::schedule( this, delay );
+    Journal::record( Journal::Pending, 0, coordinate(), delay );
+    Service::changed();
+}
+
+
+/*! Tells \a spawn which program to run, and with which arguments.
+    fork() calls this in the parent, before the child exists.
+
+    The default runs the ServerSpec's startup script, with the
+    startup options as arguments. Subclasses may do something else.
+*/
 
+void Process::prepare( Spawn & spawn )
+{
     string script = s.startupScript();
     if ( script[0] == '/' ) {
 	// nothing needed, it's an absolute path
@@ -157,26 +208,17 @@ void Process::start()
     debug << "nodee: Executing startup script "
 	  << script;
 
-    char * args[1025];
-    args[0] = const_cast<char*>(script.c_str());
-    int n = 1;
+    spawn.setProgram( script );
     map<string,string> o( s.startupOptions() );
     map<string,string>::iterator i( o.begin() );
-    while ( i != o.end() && n < 1023 ) {
-	args[n++] = const_cast<char*>( i->first.c_str() );
-	args[n++] = const_cast<char*>( i->second.c_str() );
+    while ( i != o.end() ) {
+	spawn.addArgument( i->first );
+	spawn.addArgument( i->second );
 	debug << " " << i->first << " " << i->second;
 	++i;
     }
-    args[n++] = 0;
-
-    debug << " using pid "
-	  << ::getpid()
-	  << endl;
 
-    ::execv( script.c_str(), args );
-
-    ::exit( EX_NOINPUT );
+    debug << endl;
 }
 
 
@@ -184,63 +226,31 @@ void Process::start()
 /*! Launches a new Process based on \a what, managed by \a init.
     Returns quickly; the new Process will go on its way.
 
-    This may/will also start some helper processes to download and/or
-    install the software specified by \a what.
+    This is just a wrapper for Launcher::launch(), which also starts
+    some helper processes to download and install the software
+    specified by \a what.
 */
 
 void Process::launch( const ServerSpec & what, Init & init )
 {
-    // we have three processes: A useful process and two preliminary
-    // chores (I only just managed to avoid the word foreplay, oops,
-    // it snuck its way in, I'll be more disciplined from now on)
-    Process * useful = new Process;
-    useful->assignUidGid();
-
-    Process * install = new Process( useful->u, useful->g );
-    Process * download = new Process( useful->u, useful->g );
-
-    // each of them receive basically the same spec
-    useful->s = what;
-    download->s = what;
-    install->s = what;
-
-    install->next = useful;
-    download->next = install;
-
-    // but we change the prelimiaries so they'll do their chores
-    // instead of trying to start the real thing
-    map<string,string> options;
-    options["--url"] = what.artifactUrl();
-    options["--filename"] = Conf::basedir + "/" + Conf::artefactdir + "/" +
-			    what.artifactFilename();
-    if ( !what.md5().empty() )
-	options["--md5"] = what.md5();
-    download->s.setStartupScript( Conf::scriptdir + "/download", options );
-    options.erase( "--url" );
-    options.erase( "--md5" );
-    options["--uid"] = boost::lexical_cast<string>( useful->u );
-    options["--gid"] = boost::lexical_cast<string>( useful->u );
-    options["--rootdir"] = useful->root();
-    install->s.setStartupScript( Conf::scriptdir + "/install", options );
-
-    // all three are managed by init.
-    init.manage( download );
-    init.manage( install );
-    init.manage( useful );
-    download->fork();
+    Launcher::launch( what, init );
 }
 
 
-/*! Constructs a copy of \a other. Deep copy, no sharing. */
+/*! Constructs a copy of \a other. Deep copy, no sharing. The copy
+    isn't managed by Init, so it has no handle(), and it doesn't share
+    \a other's pidfd, so signal() falls back to using the pid.
+*/
 
 Process::Process( const Process & other )
-    : p( other.p ), mp( other.mp ), s( other.s ),
+    : p( other.p ), h( 0 ), pfd( -1 ), s( other.s ),
       faults( other.faults ),
       prevFaults( other.prevFaults ),
       rss( other.rss ),
       u( other.u ), g( other.g ),
       next( other.next ),
-      starts( other.starts ), waitUntil( other.waitUntil )
+      starts( other.starts ), crashes( other.crashes ),
+      waitUntil( other.waitUntil ), restartAt( other.restartAt )
 {
 }
 
@@ -248,24 +258,44 @@ Process::Process( const Process & other )
 /*! Constructs a Process without any ServerSpec and with uid() \a uid
     and gid() \a gid.
 
-    This is a helper for Script, which needs to start() using those
+    This is a helper for Script, which needs to fork() using those
     IDs.
 */
 
 Process::Process( int uid, int gid )
-    : p( 0 ), mp( ::getpid() ),
+    : p( 0 ), h( 0 ), pfd( -1 ),
       faults( 0 ), prevFaults( 0 ),
       rss( 0 ), u( uid ), g( gid ),
       next( 0 ),
-      starts( 0 ), waitUntil( 0 )
+      starts( 0 ), crashes( 0 ), waitUntil( 0 ), restartAt( 0 )
 {
 }
 
-/*! Makes this Process into an exact copy of \a other.
+/*! Constructs a Process for \a spec, running as \a uid and \a gid
+    (by default, nodee's own). launch() is the usual way to make a
+    Process; this is simpler and doesn't download anything.
+*/
+
+Process::Process( const ServerSpec & spec, int uid, int gid )
+    : p( 0 ), h( 0 ), pfd( -1 ), s( spec ),
+      faults( 0 ), prevFaults( 0 ),
+      rss( 0 ), u( uid ), g( gid ),
+      next( 0 ),
+      starts( 0 ), crashes( 0 ), waitUntil( 0 ), restartAt( 0 )
+{
+}
+
+
+/*! Makes this Process into an exact copy of \a other, except that
+    neither the handle(), the pidfd nor the reference to the Artifact
+    cache is copied.
 */
 
 void Process::operator=( const Process & other )
 {
+    if ( pfd >= 0 )
+	::close( pfd );
+    pfd = -1;
     p = other.p;
     s = other.s;
     faults = other.faults;
@@ -273,7 +303,9 @@ void Process::operator=( const Process & other )
     rss = other.rss;
     next = other.next;
     starts = other.starts;
+    crashes = other.crashes;
     waitUntil = other.waitUntil;
+    restartAt = other.restartAt;
 }
 
 
@@ -316,7 +348,10 @@ int Process::recentPageFaults() const
 
 void Process::fakefork( int fakepid )
 {
+    int old = p;
     p = fakepid;
+    Init::reindex( this, old );
+    Service::changed();
 }
 
 
@@ -324,10 +359,20 @@ void Process::fakefork( int fakepid )
     ServerSpec or by killing it. If the latter, then the kill is
     rude. Anyone who wants a pleasant kill can supply a suitable
     script.
+
+    If a restart is pending(), it's cancelled instead.
 */
 
 void Process::stop()
 {
+    if ( pending() ) {
+	// Init forgets us when the restart would have happened
+	starts = INT_MAX;
+	restartAt = 0;
+	Service::changed();
+	return;
+    }
+
     if ( !valid() )
 	return;
 
@@ -335,7 +380,7 @@ void Process::stop()
 
     string script = s.shutdownScript();
     if ( script.empty() ) {
-	::kill( 9, p );
+	signal( SIGKILL );
     } else {
 	// trouble here. need new functionality.  the uid used needs
 	// to be visible to the c++, not assigned by sh at startup
@@ -344,6 +389,21 @@ void Process::stop()
 }
 
 
+/*! Sends \a sig to the process and returns true if that worked.
+
+    If Spawn got a pidfd for the process, the signal is sent using
+    that, so it can't hit an unrelated process that happens to have
+    inherited the pid.
+*/
+
+bool Process::signal( int sig )
+{
+    if ( !valid() )
+	return false;
+    return Spawn::signal( pfd, p, sig );
+}
+
+
 /*! Returns the UID used by this child, or 0 if the Process is not
     valid(). In theory, even valid() processes may run as root, but in
     practice that should not happen.
@@ -407,15 +467,29 @@ const ServerSpec & Process::spec() const
 }
 
 
-/*! Destroys the object. Frees nothing.
+/*! Returns the coordinate of this Process' service, or an empty
+    string if the ServerSpec has none. Unlike ServerSpec::coordinate(),
+    this never throws, so Init and ChoreKeeper can use it freely.
+*/
 
-    Exists only because compilers tend to moan and wail if there is no
-    constructor, and I like zero-warning code.
+string Process::coordinate() const
+{
+    try {
+	return s.coordinate();
+    } catch ( ... ) {
+	return string();
+    }
+}
+
+
+/*! Destroys the object and closes the pidfd, if any. The child
+    process, if any, is not affected.
 */
 
 Process::~Process()
 {
-
+    if ( pfd >= 0 )
+	::close( pfd );
 }
 
 
@@ -426,10 +500,29 @@ Process::~Process()
     There is no process before fork() or after handleExit().
 */
 
+/*! \fn unsigned int Process::handle() const
+
+    Returns the handle Init gave this Process when it started managing
+    it, or 0 if Init doesn't manage this Process. Unlike pid(), the
+    handle doesn't change when the process is restarted.
+*/
+
 /*! \fn bool Process::valid() const
     Returns true if this Process represents a real unix process.
 */
 
+/*! \fn bool Process::pending() const
+
+    Returns true if the process has exited and Init is waiting to
+    restart it, and false otherwise.
+*/
+
+/*! \fn time_t Process::restartTime() const
+
+    Returns the time at which Init will restart this pending() Process,
+    or 0 if none.
+*/
+
 
 /*! \fn bool Process::operator==( const Process & other )
 
@@ -5,6 +5,8 @@
 
 #include "serverspec.h"
 
+class Spawn;
+
 
 class Process
 {
@@ -12,18 +14,24 @@ public:
     Process();
     Process( const Process & );
     Process( int, int );
+    Process( const ServerSpec &, int = 0, int = 0 );
     virtual ~Process();
 
     int pid() const { return p; }
+    unsigned int handle() const { return h; }
     bool valid() const { return p > 0; }
+    bool pending() const { return restartAt != 0; }
+    time_t restartTime() const { return restartAt; }
 
-    void fork();
-    virtual void start();
+    bool fork();
+    virtual void prepare( Spawn & );
     virtual void handleExit( int, int );
+    void restart();
 
     void fakefork( int fakepid );
 
     void stop();
+    bool signal( int );
 
     void setCurrentRss( int );
     int currentRss() const;
@@ -42,10 +50,16 @@ public:
     string root() const;
 
     const ServerSpec & spec() const;
+    string coordinate() const;
 
 private:
+    friend class Init;
+    friend class Launcher;
+
     int p;
-    int mp;
+    unsigned int h;
+    int pfd;
+    string artifact;
     ServerSpec s;
     int faults;
     int prevFaults;
@@ -55,7 +69,9 @@ private:
     Process * next;
 
     int starts;
+    int crashes;
     time_t waitUntil;
+    time_t restartAt;
 };
 
 
@@ -0,0 +1,279 @@
+// Copyright Arnt Gulbrandsen <arnt@gulbrandsen.priv.no>; BSD-licensed.
+
+#include "router.h"
+
+#include <string.h>
+
+#include <vector>
+#include <utility>
+
+
+/*! \class Router router.h
+
+    The Router class decides which function handles an HTTP request.
+
+    Each HTTP API endpoint is described by a Route: An operation (GET
+    or POST), a path pattern and a Handler function. The pattern is a
+    path in which some segments may be captures, written as {name} or
+    {name:int}. A {name} capture matches any nonempty segment, an
+    {name:int} capture matches only digits. The Handler gets the
+    captured values via Captures, and is expected to send a response.
+
+    Routes are registered at startup, typically by making a static
+    Table of them in the file that contains the handlers. There's no
+    need to touch HttpServer in order to add an endpoint.
+
+    The routes are kept in a trie with one node per path segment.
+    find() walks the trie using the path as it is, without copying it
+    or any part of it, so dispatching a request allocates no memory.
+    Literal segments take precedence over {name:int} captures, which
+    take precedence over {name} captures, so /service/list,
+    /service/{pid:int} and /service/{name} can coexist.
+
+    Anything after a ? in the path is ignored, as are empty segments
+    (so /a//b/ is the same as /a/b).
+
+    All the routes must be registered before the first request is
+    served; there's no locking.
+*/
+
+
+struct Router::Node
+{
+    Node(): number( 0 ), text( 0 ) {
+	handlers[0] = 0;
+	handlers[1] = 0;
+    }
+
+    std::vector< std::pair<string, Node *> > children;
+    Node * number;
+    Node * text;
+    Router::Handler handlers[2];
+};
+
+
+/*! Returns the root of the trie. */
+
+Router::Node & Router::root()
+{
+    // allocated on first use, so that Tables in other files can be
+    // constructed in any order.
+    static Node * r = new Node;
+    return *r;
+}
+
+
+/*! Registers \a handler as the Handler for \a operation on paths
+    matching \a pattern. If another Handler has already been
+    registered for the same pattern, \a handler replaces it.
+
+    The names of the captures don't matter, only their positions and
+    types.
+*/
+
+void Router::add( HttpServer::Operation operation, const char * pattern,
+		  Router::Handler handler )
+{
+    if ( operation != HttpServer::Get && operation != HttpServer::Post )
+	return;
+
+    Node * n = &root();
+    const char * p = pattern;
+    while ( *p ) {
+	if ( *p == '/' ) {
+	    p++;
+	    continue;
+	}
+	const char * e = p;
+	while ( *e && *e != '/' )
+	    e++;
+	string segment( p, e - p );
+	if ( segment[0] == '{' ) {
+	    Node * & c = segment.find( ":int}" ) != string::npos
+			 ? n->number : n->text;
+	    if ( !c )
+		c = new Node;
+	    n = c;
+	} else {
+	    std::vector< std::pair<string, Node *> >::iterator i
+		= n->children.begin();
+	    while ( i != n->children.end() && i->first != segment )
+		++i;
+	    if ( i == n->children.end() ) {
+		n->children.push_back( std::make_pair( segment, new Node ) );
+		n = n->children.back().second;
+	    } else {
+		n = i->second;
+	    }
+	}
+	p = e;
+    }
+    n->handlers[operation] = handler;
+}
+
+
+/*! Returns the Handler for \a operation on \a path, or a null pointer
+    if there isn't any. Any captured segments are recorded in \a
+    captures, which refers to \a path and is valid only as long as \a
+    path is.
+*/
+
+Router::Handler Router::find( HttpServer::Operation operation,
+			      const string & path,
+			      Router::Captures & captures )
+{
+    captures.s = path.data();
+    captures.n = 0;
+    if ( operation != HttpServer::Get && operation != HttpServer::Post )
+	return 0;
+
+    int end = 0;
+    int l = path.size();
+    while ( end < l && path[end] != '?' )
+	end++;
+    int depth = 0;
+    return match( &root(), path.data(), 0, end, operation, captures, depth );
+}
+
+
+/*! This private helper of find() matches the part of \a s from \a
+    pos to \a end against \a n and its descendants, and returns the
+    Handler for \a o, recording captures in \a c.
+
+    \a depth exists only to stop absurdly long paths from recursing
+    too deep.
+*/
+
+Router::Handler Router::match( const Router::Node * n, const char * s,
+			       int pos, int end,
+			       HttpServer::Operation o,
+			       Router::Captures & c, int & depth )
+{
+    while ( pos < end && s[pos] == '/' )
+	pos++;
+    if ( pos >= end )
+	return n->handlers[o];
+    if ( ++depth > 32 )
+	return 0;
+
+    int e = pos;
+    while ( e < end && s[e] != '/' )
+	e++;
+    int l = e - pos;
+
+    std::vector< std::pair<string, Node *> >::const_iterator i
+	= n->children.begin();
+    while ( i != n->children.end() ) {
+	if ( (int)i->first.size() == l &&
+	     !::memcmp( i->first.data(), s + pos, l ) ) {
+	    Router::Handler h = match( i->second, s, e, end, o, c, depth );
+	    if ( h )
+		return h;
+	    break;
+	}
+	++i;
+    }
+
+    if ( c.n >= Router::Captures::Max )
+	return 0;
+
+    // nine digits fit in an int
+    bool digits = l <= 9;
+    int d = pos;
+    while ( digits && d < e ) {
+	if ( s[d] < '0' || s[d] > '9' )
+	    digits = false;
+	d++;
+    }
+
+    int saved = c.n;
+    c.start[c.n] = pos;
+    c.length[c.n] = l;
+    c.n++;
+    Router::Handler h = 0;
+    if ( digits && n->number )
+	h = match( n->number, s, e, end, o, c, depth );
+    if ( !h && n->text )
+	h = match( n->text, s, e, end, o, c, depth );
+    if ( !h )
+	c.n = saved;
+    return h;
+}
+
+
+/*! \class Router::Captures router.h
+
+    The Router::Captures class records the parts of a path that
+    matched the captures in a Route's pattern, without copying them.
+
+    The captures are numbered from 0, left to right.
+*/
+
+
+/*! Constructs an empty Captures. */
+
+Router::Captures::Captures()
+    : s( 0 ), n( 0 )
+{
+}
+
+
+/*! Returns capture \a i as a number, or 0 if there is no such
+    capture or it isn't a number. {name:int} captures are always
+    numbers.
+*/
+
+int Router::Captures::number( int i ) const
+{
+    if ( i < 0 || i >= n )
+	return 0;
+    int r = 0;
+    int x = 0;
+    while ( x < length[i] ) {
+	char d = s[start[i] + x];
+	if ( d < '0' || d > '9' || x >= 9 )
+	    return 0;
+	r = r * 10 + d - '0';
+	x++;
+    }
+    return r;
+}
+
+
+/*! Returns capture \a i as a string, or an empty string if there is
+    no such capture.
+*/
+
+string Router::Captures::text( int i ) const
+{
+    if ( i < 0 || i >= n )
+	return string();
+    return string( s + start[i], length[i] );
+}
+
+
+/*! \fn int Router::Captures::count() const
+
+    Returns the number of captures recorded.
+*/
+
+
+/*! \class Router::Table router.h
+
+    The Router::Table class registers a set of routes when it's
+    constructed. Make a static Table in the file that contains the
+    handlers, and the routes exist before main() starts.
+*/
+
+
+/*! Registers the \a n Routes in \a routes. */
+
+Router::Table::Table( const Router::Route * routes, int n )
+{
+    int i = 0;
+    while ( i < n ) {
+	Router::add( routes[i].operation, routes[i].pattern,
+		     routes[i].handler );
+	i++;
+    }
+}
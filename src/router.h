@@ -0,0 +1,59 @@
+// Copyright Arnt Gulbrandsen <arnt@gulbrandsen.priv.no>; BSD-licensed.
+
+#ifndef ROUTER_H
+#define ROUTER_H
+
+#include <string>
+
+#include "httpserver.h"
+
+using namespace std;
+
+
+class Router
+{
+public:
+    class Captures
+    {
+    public:
+	Captures();
+
+	enum { Max = 4 };
+
+	int count() const { return n; }
+	int number( int ) const;
+	string text( int ) const;
+
+    private:
+	friend class Router;
+	const char * s;
+	int n;
+	int start[Max];
+	int length[Max];
+    };
+
+    typedef void (*Handler)( HttpServer &, const Captures & );
+
+    struct Route {
+	HttpServer::Operation operation;
+	const char * pattern;
+	Handler handler;
+    };
+
+    class Table
+    {
+    public:
+	Table( const Route *, int );
+    };
+
+    static void add( HttpServer::Operation, const char *, Handler );
+    static Handler find( HttpServer::Operation, const string &, Captures & );
+
+private:
+    struct Node;
+    static Node & root();
+    static Handler match( const Node *, const char *, int, int,
+			  HttpServer::Operation, Captures &, int & );
+};
+
+#endif
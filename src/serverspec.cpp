@@ -81,9 +81,9 @@ ServerSpec ServerSpec::parseJson( const string & specification,
     } catch ( ... ) {
 	set<int> used;
 
-	list<Process *> & pl = init.processes();
-	list<Process *>::iterator m( pl.begin() );
-	while ( m != pl.end() ) {
+	boost::shared_ptr<const Init::Processes> pl = init.processes();
+	Init::Processes::const_iterator m( pl->begin() );
+	while ( m != pl->end() ) {
 	    used.insert( (*m)->spec().port() );
 	    ++m;
 	}
@@ -117,6 +117,68 @@ ServerSpec ServerSpec::parseJson( const string & specification,
 }
 
 
+/*! Parses \a specification, which is a JSON list of artifacts (or a
+    single artifact), and returns one ServerSpec for each. Only url,
+    filename, md5 and sha256 matter, and they mean the same as in a
+    full specification, so a full specification is also acceptable.
+
+    The returned ServerSpecs are good enough for downloading and
+    installing, not for starting anything. An artifact without url or
+    filename, or with a filename that isn't a plain file name, gets a
+    ServerSpec with an error(). If the JSON can't be parsed at all,
+    the returned list is empty.
+*/
+
+vector<ServerSpec> ServerSpec::parseArtifactJson( const string & specification )
+{
+    using boost::property_tree::ptree;
+
+    vector<ServerSpec> r;
+    ptree all;
+    try {
+	istringstream i( specification );
+	read_json( i, all );
+    } catch ( boost::property_tree::json_parser::json_parser_error e ) {
+	return r;
+    }
+
+    // read_json turns a list into children with empty names
+    vector<ptree> artifacts;
+    if ( all.count( "url" ) || all.count( "filename" ) ) {
+	artifacts.push_back( all );
+    } else {
+	ptree::const_iterator i = all.begin();
+	while ( i != all.end() ) {
+	    artifacts.push_back( i->second );
+	    ++i;
+	}
+    }
+
+    vector<ptree>::const_iterator a = artifacts.begin();
+    while ( a != artifacts.end() ) {
+	ServerSpec s;
+	s.pt = *a;
+	string f = s.pt.get<string>( "filename", "" );
+	if ( s.pt.get<string>( "url", "" ).empty() ) {
+	    s.setError( "Problem regarding url" );
+	} else if ( f.empty() || f[0] == '.' ||
+		    f.find( '/' ) != string::npos ) {
+	    s.setError( "Problem regarding filename" );
+	} else {
+	    if ( !s.pt.count( "artifact" ) && !s.pt.count( "artefact" ) )
+		s.pt.put( "artifact", f );
+	    if ( !s.pt.count( "coordinate" ) )
+		s.pt.put( "coordinate", f );
+	    // nothing listens, but port() must not throw
+	    s.pt.put( "port", 0 );
+	}
+	r.push_back( s );
+	++a;
+    }
+    return r;
+}
+
+
 /*! Returns a json object corresponding to this ServerSpec. If this
     object is !valid(), then the return value is "{}".
 */
@@ -406,3 +468,14 @@ string ServerSpec::md5() const
 {
     return pt.get<string>( "md5", "" );
 }
+
+
+/*! Returns the SHA-256 sum specified, in hex, or an empty string if
+    none is specified. If both md5() and this are specified, the
+    artifact has to match both.
+*/
+
+string ServerSpec::sha256() const
+{
+    return pt.get<string>( "sha256", "" );
+}
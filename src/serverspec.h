@@ -5,6 +5,7 @@
 
 #include <map>
 #include <string>
+#include <vector>
 
 #include <boost/property_tree/ptree.hpp>
 
@@ -20,6 +21,7 @@ public:
     ServerSpec( const ServerSpec & );
 
     static ServerSpec parseJson( const string &, class Init & );
+    static vector<ServerSpec> parseArtifactJson( const string & );
     string json() const;
 
     string coordinate() const;
@@ -33,6 +35,7 @@ public:
     int restartPeriod() const;
     int maxRestarts() const;
     string md5() const;
+    string sha256() const;
 
     void setStartupScript( const string &, const map<string,string> & );
 
@@ -6,34 +6,43 @@
 #include "process.h"
 
 #include <stdio.h>
+#include <time.h>
+#include <unistd.h>
 
 #include <algorithm>
 
-#include <list>
+#include <vector>
 
 #include <boost/property_tree/ptree.hpp>
 #include <boost/property_tree/json_parser.hpp>
 #include <boost/lexical_cast.hpp>
+#include <boost/thread.hpp>
 
 using boost::property_tree::ptree;
 
-// for some reason, using the type directly instead of via the hack
-// typedef bothers the compiler. I see nothing wrong. the expression
-// works as a global, works in a global function, and worked in
-// HttpServer::respond(), it just didn't work here. I have no
-// idea. but right now I don't want to bother about it, I want to run
-// on aewc-cn-01.
-typedef list<Process *> hack;
+
+static boost::mutex mutex;
+static unsigned int current = 1;
+static Service::Snapshot cache;
+static unsigned int cached = 0;
 
 /*! \class Service service.h
 
     Service is a tidiness class, a container for independent
     service-related functions so that they don't need to be global.
 
-    At present list() is the only function. It is possible that
-    functions to install and uninstall services may return, as well as
-    perhaps a function to provide detailed information for monitoring
-    purposes.
+    list() builds the JSON description of the running services (and
+    of those that have crashed and are waiting to be restarted), and
+    snapshot() keeps a copy of it so that it needn't be built for each
+    GET. Init, Process and ChoreKeeper call changed() whenever they
+    change something list() would show, and snapshot() builds a new
+    copy only when the last one is outdated. Since a fleet of pollers
+    mostly asks for the same list over and over, most GETs just share
+    the previous buffer.
+
+    It is possible that functions to install and uninstall services
+    may return, as well as perhaps a function to provide detailed
+    information for monitoring purposes.
 */
 
 /*! Returns a JSON foo describing the processes managed by \a init. */
@@ -44,11 +53,21 @@ std::string Service::list( Init & init )
 
     ptree pt;
 
-    hack & pl = init.processes(); // compiler protest at this line
-    hack::iterator m( pl.begin() );
+    boost::shared_ptr<const Init::Processes> pl = init.processes();
+    Init::Processes::const_iterator m( pl->begin() );
 
 
-    while ( m != pl.end() ) {
+    while ( m != pl->end() ) {
+	// a pending restart has no pid, so it's listed separately, by
+	// handle.
+	if ( (*m)->pending() ) {
+	    string prefix = "pending." +
+			    boost::lexical_cast<string>( (*m)->handle() );
+	    pt.put( prefix + ".coordinate", (*m)->coordinate() );
+	    pt.put( prefix + ".restart", (*m)->restartTime() );
+	    ++m;
+	    continue;
+	}
 	string prefix = "services." +
 			boost::lexical_cast<string>( (*m)->pid() );
 	try {
@@ -76,3 +95,65 @@ std::string Service::list( Init & init )
 
     return os.str();
 }
+
+
+/*! Returns a Snapshot of list() for \a init, along with an ETag that
+    identifies that version of the list. The Snapshot is shared and
+    immutable; if nothing has changed since the last call, this
+    returns the same buffer again.
+
+    The list is built without holding the lock, so changed() never
+    waits for it.
+*/
+
+Service::Snapshot Service::snapshot( Init & init )
+{
+    // the ETag has to differ from the ones an earlier nodee might
+    // have handed out, so it includes something that changes when
+    // nodee restarts.
+    static string boot = boost::lexical_cast<string>( ::time( 0 ) ) + "." +
+			 boost::lexical_cast<string>( ::getpid() );
+
+    unsigned int v;
+    {
+	boost::lock_guard<boost::mutex> lock( mutex );
+	if ( cached == current && cache.json )
+	    return cache;
+	v = current;
+    }
+
+    // the list reflects at least version v. if changed() is called
+    // while we build, current moves on and the next call builds
+    // again.
+    Snapshot s;
+    s.json.reset( new string( list( init ) ) );
+    s.etag = "\"" + boot + "." + boost::lexical_cast<string>( v ) + "\"";
+
+    boost::lock_guard<boost::mutex> lock( mutex );
+    // another thread may have published a newer list meanwhile
+    if ( cache.json && cached >= v )
+	return cache;
+    cache = s;
+    cached = v;
+    return s;
+}
+
+
+/*! Records that something list() would report has changed, so the
+    next snapshot() must build a new list. Cheap; may be called often.
+*/
+
+void Service::changed()
+{
+    boost::lock_guard<boost::mutex> lock( mutex );
+    current++;
+}
+
+
+/*! Returns a number that increases each time changed() is called. */
+
+unsigned int Service::version()
+{
+    boost::lock_guard<boost::mutex> lock( mutex );
+    return current;
+}
@@ -4,6 +4,8 @@
 
 #include <string>
 
+#include <boost/shared_ptr.hpp>
+
 #include "init.h"
 
 using namespace std;
@@ -12,7 +14,16 @@ using namespace std;
 class Service
 {
 public:
+    struct Snapshot {
+	string etag;
+	boost::shared_ptr<const string> json;
+    };
+
     static string list( Init & );
+
+    static Snapshot snapshot( Init & );
+    static void changed();
+    static unsigned int version();
 };
 
 #endif
@@ -0,0 +1,311 @@
+// Copyright Arnt Gulbrandsen <arnt@gulbrandsen.priv.no>; BSD-licensed.
+
+#include "spawn.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#if defined(__linux__)
+#include <sched.h>
+#endif
+
+#if defined(__linux__) && !defined(CLONE_PIDFD)
+#define CLONE_PIDFD 0x00001000
+#endif
+
+
+// everything the child needs, prepared by the parent so that the
+// child needn't allocate anything or take any lock.
+struct SpawnArguments
+{
+    const char * program;
+    char * const * argv;
+    const char * dir;
+    int uid;
+    int gid;
+    int maxfd;
+    volatile int error;
+};
+
+
+// glibc's setresuid() and friends take a lock and signal every
+// thread in the process, so that all threads change IDs together.
+// in a CLONE_VM child the "threads" are the parent's, one of which
+// is blocked waiting for the child, so we use the system calls
+// directly, as glibc's own posix_spawn does. only the child changes.
+static int changeGid( int gid )
+{
+#if defined(SYS_setresgid32)
+    return ::syscall( SYS_setresgid32, gid, gid, gid );
+#elif defined(SYS_setresgid)
+    return ::syscall( SYS_setresgid, gid, gid, gid );
+#else
+    return ::setregid( gid, gid );
+#endif
+}
+
+
+static int changeUid( int uid )
+{
+#if defined(SYS_setresuid32)
+    return ::syscall( SYS_setresuid32, uid, uid, uid );
+#elif defined(SYS_setresuid)
+    return ::syscall( SYS_setresuid, uid, uid, uid );
+#else
+    return ::setreuid( uid, uid );
+#endif
+}
+
+
+// runs in the child, between clone() and exec. everything here must
+// be async-signal-safe, since the parent's other threads may hold
+// locks (malloc's, the iostream's, anyone's) that will never be
+// released in the child.
+static int child( void * a )
+{
+    SpawnArguments * s = (SpawnArguments *)a;
+
+    sigset_t none;
+    ::sigemptyset( &none );
+    ::sigprocmask( SIG_SETMASK, &none, 0 );
+
+    // nodee ignores SIGPIPE, and ignored signals stay ignored across
+    // exec. the service should get the default.
+    struct sigaction dfl;
+    ::memset( &dfl, 0, sizeof( dfl ) );
+    dfl.sa_handler = SIG_DFL;
+    ::sigaction( SIGPIPE, &dfl, 0 );
+
+    // these calls will return failure if nodee is being debugged as
+    // non-root. I think that's fine, so I just cast to void to
+    // underscore the point.
+    if ( s->gid )
+	(void)changeGid( s->gid );
+    if ( s->uid )
+	(void)changeUid( s->uid );
+
+    if ( s->dir && ::chdir( s->dir ) < 0 ) {
+	s->error = errno;
+	::_exit( EX_NOINPUT );
+    }
+
+    // stdin is /dev/null, stdout and stderr are shared with nodee,
+    // and no other file descriptor leaks to the child.
+    int n = ::open( "/dev/null", O_RDONLY );
+    if ( n > 0 ) {
+	::dup2( n, 0 );
+	::close( n );
+    }
+    int fd = 3;
+#if defined(SYS_close_range)
+    if ( ::syscall( SYS_close_range, 3, ~0U, 0 ) == 0 )
+	fd = s->maxfd;
+#endif
+    while ( fd < s->maxfd )
+	::close( fd++ );
+
+    ::execv( s->program, s->argv );
+
+    s->error = errno;
+    ::_exit( EX_NOINPUT );
+    return 0;
+}
+
+
+/*! \class Spawn spawn.h
+
+    The Spawn class starts a program in a new process, safely and
+    quickly, from a process with many threads and much memory.
+
+    Nodee used to fork() and then do various things in the child
+    before exec. fork() copies the page tables of the entire daemon,
+    which costs more the bigger nodee gets, and the child could
+    deadlock on a lock some other thread happened to hold at the time
+    of the fork (debug logging needs locks, for instance).
+
+    Spawn uses clone() with CLONE_VM and CLONE_VFORK on Linux, so
+    nothing is copied and the parent's thread waits until the child
+    has called exec. Everything the child does between clone and exec
+    is prepared in advance, so the child only makes a few system
+    calls: It unblocks signals, restores the default SIGPIPE action,
+    changes UID and GID, changes directory, points stdin to
+    /dev/null, closes all other file descriptors beyond stderr and
+    calls exec. On other systems, Spawn uses fork() with the same
+    child code.
+
+    If the kernel supports it (Linux 5.2 and later), run() also
+    returns a pidfd for the child, which can be used to signal it
+    without any risk of hitting another process that happens to reuse
+    the pid. signal() does that.
+
+    The class doesn't wait for the child. Init does that.
+*/
+
+
+/*! Constructs an empty Spawn. setProgram() must be called before
+    run().
+*/
+
+Spawn::Spawn()
+    : uid( 0 ), gid( 0 ), p( 0 ), pfd( -1 ), e( 0 )
+{
+}
+
+
+/*! Records that run() should execute \a program, which must be an
+    absolute path.
+*/
+
+void Spawn::setProgram( const string & program )
+{
+    prog = program;
+}
+
+
+/*! Appends \a argument to the argument list. The program name is
+    argument 0, and is supplied automatically.
+*/
+
+void Spawn::addArgument( const string & argument )
+{
+    args.push_back( argument );
+}
+
+
+/*! Records that the child should run as UID \a u. 0 means not to
+    change UID.
+*/
+
+void Spawn::setUid( int u )
+{
+    uid = u;
+}
+
+
+/*! Records that the child should run as GID \a g. 0 means not to
+    change GID.
+*/
+
+void Spawn::setGid( int g )
+{
+    gid = g;
+}
+
+
+/*! Records that the child should run in directory \a d. If \a d is
+    empty (the default), the child inherits nodee's directory.
+*/
+
+void Spawn::setDirectory( const string & d )
+{
+    dir = d;
+}
+
+
+/*! Starts the child process. Returns its pid, or -1 if it could not
+    be created. If the child was created but could not execute the
+    program, the pid is returned anyway and error() returns the
+    errno; the child will exit with EX_NOINPUT, as a program that
+    can't be started always has.
+*/
+
+int Spawn::run()
+{
+    vector<string> a;
+    a.push_back( prog );
+    a.insert( a.end(), args.begin(), args.end() );
+
+    vector<char *> argv;
+    vector<string>::iterator i = a.begin();
+    while ( i != a.end() ) {
+	argv.push_back( const_cast<char *>( i->c_str() ) );
+	++i;
+    }
+    argv.push_back( 0 );
+
+    struct rlimit rl;
+    int maxfd = 1024;
+    if ( ::getrlimit( RLIMIT_NOFILE, &rl ) == 0 &&
+	 rl.rlim_cur != RLIM_INFINITY && rl.rlim_cur < 65536 )
+	maxfd = rl.rlim_cur;
+
+    SpawnArguments s;
+    s.program = argv[0];
+    s.argv = &argv[0];
+    s.dir = dir.empty() ? 0 : dir.c_str();
+    s.uid = uid;
+    s.gid = gid;
+    s.maxfd = maxfd;
+    s.error = 0;
+
+    p = -1;
+    pfd = -1;
+    e = 0;
+#if defined(__linux__)
+    // the child only runs until exec, and the parent thread is
+    // suspended meanwhile, so a small stack that we free afterwards
+    // suffices.
+    vector<char> stack( 65536 );
+    char * top = &stack[0] + stack.size();
+    int f = -1;
+    p = ::clone( child, top, CLONE_VM | CLONE_VFORK | CLONE_PIDFD | SIGCHLD,
+		 &s, &f );
+    if ( p < 0 && errno == EINVAL ) {
+	// an older kernel, without pidfds
+	p = ::clone( child, top, CLONE_VM | CLONE_VFORK | SIGCHLD, &s );
+	f = -1;
+    }
+    if ( p > 0 )
+	pfd = f;
+#else
+    p = ::fork();
+    if ( !p )
+	child( &s );
+#endif
+
+    if ( p < 0 )
+	e = errno;
+    else
+	e = s.error;
+    return p;
+}
+
+
+/*! Sends \a signal to the process \a pid, using \a pidfd if that's a
+    valid pidfd, and returns true if the signal was sent.
+*/
+
+bool Spawn::signal( int pidfd, int pid, int signal )
+{
+#if defined(SYS_pidfd_send_signal)
+    if ( pidfd >= 0 )
+	return ::syscall( SYS_pidfd_send_signal, pidfd, signal, 0, 0 ) == 0;
+#endif
+    if ( pid <= 0 )
+	return false;
+    return ::kill( pid, signal ) == 0;
+}
+
+
+/*! \fn int Spawn::pid() const
+
+    Returns the child's pid after run(), or 0 before.
+*/
+
+/*! \fn int Spawn::pidfd() const
+
+    Returns a pidfd for the child after run(), or -1 if there is none.
+    The caller is responsible for closing it.
+*/
+
+/*! \fn int Spawn::error() const
+
+    Returns the errno of the last problem run() had, or 0 if none.
+*/
@@ -0,0 +1,45 @@
+// Copyright Arnt Gulbrandsen <arnt@gulbrandsen.priv.no>; BSD-licensed.
+
+#ifndef SPAWN_H
+#define SPAWN_H
+
+#include <string>
+#include <vector>
+
+using namespace std;
+
+
+class Spawn
+{
+public:
+    Spawn();
+
+    void setProgram( const string & );
+    string program() const { return prog; }
+    void addArgument( const string & );
+    vector<string> arguments() const { return args; }
+
+    void setUid( int );
+    void setGid( int );
+    void setDirectory( const string & );
+
+    int run();
+
+    int pid() const { return p; }
+    int pidfd() const { return pfd; }
+    int error() const { return e; }
+
+    static bool signal( int, int, int );
+
+private:
+    string prog;
+    vector<string> args;
+    string dir;
+    int uid;
+    int gid;
+    int p;
+    int pfd;
+    int e;
+};
+
+#endif
@@ -0,0 +1,404 @@
+// Copyright Arnt Gulbrandsen <arnt@gulbrandsen.priv.no>; BSD-licensed.
+
+#include "store.h"
+
+#include "conf.h"
+#include "fetcher.h"
+#include "log.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#if defined(__linux__)
+#include <linux/fs.h>
+#endif
+
+#include <map>
+
+#include <boost/filesystem.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/thread.hpp>
+
+
+// the digests of one artifact file, as of the given size and mtime
+struct StoreDigests
+{
+    off_t size;
+    time_t mtime;
+    string md5;
+    string sha256;
+};
+
+
+static boost::mutex mutex;
+static std::map<string, StoreDigests> known;
+static unsigned int serial = 0;
+
+
+/*! \class Store store.h
+
+    The Store class keeps one extracted copy of each artifact, and
+    populates service directories from that copy.
+
+    The installation used to unpack each artifact into each service's
+    root directory and chown the lot, so ten instances of a service
+    meant ten extractions. Now each artifact is unpacked once, into
+    a directory under directory() named after the artifact's SHA-256
+    sum, and populate() fills a service's root from that.
+
+    populate() makes directories afresh (owned by the service) and
+    tries three ways to make each file, cheapest first that gives the
+    service a file of its own: A FICLONE reflink, which shares the
+    data blocks copy-on-write (btrfs, xfs and the like), a hard link,
+    which shares the file itself, and finally a plain copy. A hard
+    linked file belongs to nodee and is read-only to the service,
+    which can still replace it, since it owns the directory. commit()
+    removes group and other write permission from the extracted tree
+    so that no service can change a shared file.
+
+    Bind or overlay mounts would also work, but they need privileges
+    and cleanup at the wrong times, so I didn't.
+
+    The store's directory names are content addresses, so a tree is
+    never changed once it's been committed, and an artifact file with
+    a different name but the same content shares its tree.
+*/
+
+
+/*! Returns the name of the store directory, which is a subdirectory
+    of the artefact directory.
+*/
+
+string Store::directory()
+{
+    return Conf::artefactDirectory() + "/store";
+}
+
+
+/*! Returns the name of the directory containing the extracted
+    artifact whose SHA-256 sum is \a digest.
+*/
+
+string Store::tree( const string & digest )
+{
+    return directory() + "/" + digest;
+}
+
+
+/*! Returns true if the artifact whose SHA-256 sum is \a digest has
+    been extracted and committed.
+*/
+
+bool Store::has( const string & digest )
+{
+    struct stat st;
+    return !digest.empty() &&
+	::stat( tree( digest ).c_str(), &st ) == 0 && S_ISDIR( st.st_mode );
+}
+
+
+/*! Creates and returns a new, empty directory in which the artifact
+    whose SHA-256 sum is \a digest can be extracted, or an empty
+    string in case of trouble. commit() moves it into place.
+
+    The name is unique, so concurrent extractions of the same
+    artifact don't collide.
+*/
+
+string Store::staging( const string & digest )
+{
+    unsigned int n;
+    {
+	boost::lock_guard<boost::mutex> lock( mutex );
+	n = ++serial;
+    }
+    string d = directory();
+    ::mkdir( Conf::artefactDirectory().c_str(), 0755 );
+    ::mkdir( d.c_str(), 0755 );
+    string s = d + "/" + digest + "." +
+	       boost::lexical_cast<string>( ::getpid() ) + "." +
+	       boost::lexical_cast<string>( n ) + ".tmp";
+    if ( ::mkdir( s.c_str(), 0755 ) < 0 )
+	return string();
+    return s;
+}
+
+
+// removes write permission for group and other, and the setuid and
+// setgid bits, from everything in d
+static void protect( const string & d )
+{
+    DIR * dir = ::opendir( d.c_str() );
+    if ( !dir )
+	return;
+    struct dirent * e;
+    while ( ( e = ::readdir( dir ) ) != 0 ) {
+	string n = e->d_name;
+	if ( n == "." || n == ".." )
+	    continue;
+	string p = d + "/" + n;
+	struct stat st;
+	if ( ::lstat( p.c_str(), &st ) < 0 || S_ISLNK( st.st_mode ) )
+	    continue;
+	if ( st.st_mode & ( 022 | S_ISUID | S_ISGID ) )
+	    ::chmod( p.c_str(), st.st_mode & 01755 );
+	if ( S_ISDIR( st.st_mode ) )
+	    protect( p );
+    }
+    ::closedir( dir );
+}
+
+
+/*! Moves the extracted tree in \a staging into place as the tree for
+    \a digest. Returns true if the store has that tree afterwards,
+    even if someone else committed it first.
+*/
+
+bool Store::commit( const string & staging, const string & digest )
+{
+    protect( staging );
+    ::chmod( staging.c_str(), 0755 );
+    if ( ::rename( staging.c_str(), tree( digest ).c_str() ) == 0 )
+	return true;
+    // ENOTEMPTY or EEXIST: someone else got there first
+    remove( staging );
+    return has( digest );
+}
+
+
+/*! Removes \a directory and everything in it, ignoring errors. */
+
+void Store::remove( const string & directory )
+{
+    try {
+	boost::filesystem::remove_all( directory );
+    } catch ( ... ) {
+	// the next cleanup will have to do better
+    }
+}
+
+
+// makes the entry \a t in the directory \a dir a file with the same
+// contents as s, mode m and owned by uid/gid. t is never followed if
+// it's a symlink. clones is cleared if reflinks turn out not to work,
+// so the caller doesn't try again for each file.
+static bool place( const string & s, int dir, const string & t, mode_t m,
+		   int uid, int gid, bool & clones )
+{
+    ::unlinkat( dir, t.c_str(), 0 );
+    const int flags = O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW;
+
+#if defined(FICLONE)
+    if ( clones ) {
+	int in = ::open( s.c_str(), O_RDONLY );
+	int out = ::openat( dir, t.c_str(), flags, m );
+	bool ok = in >= 0 && out >= 0 && ::ioctl( out, FICLONE, in ) == 0;
+	if ( !ok && errno != ENOSPC && errno != EDQUOT )
+	    clones = false;
+	if ( ok && uid )
+	    (void)::fchown( out, uid, gid );
+	if ( in >= 0 )
+	    ::close( in );
+	if ( out >= 0 )
+	    ::close( out );
+	if ( ok )
+	    return true;
+	::unlinkat( dir, t.c_str(), 0 );
+    }
+#endif
+
+    // a hard link stays owned by root, so it's only good enough if
+    // others may read (and run) it as the owner could
+    mode_t needed = ( m & 0500 ) >> 6;
+    if ( ( !uid || ( m & needed ) == needed ) &&
+	 ::linkat( AT_FDCWD, s.c_str(), dir, t.c_str(), 0 ) == 0 )
+	return true;
+
+    int in = ::open( s.c_str(), O_RDONLY );
+    if ( in < 0 )
+	return false;
+    int out = ::openat( dir, t.c_str(), flags, m );
+    if ( out < 0 ) {
+	::close( in );
+	return false;
+    }
+    char b[65536];
+    int n = 0;
+    bool ok = true;
+    while ( ok && ( n = ::read( in, b, sizeof( b ) ) ) > 0 ) {
+	const char * p = b;
+	while ( ok && n > 0 ) {
+	    int w = ::write( out, p, n );
+	    ok = w > 0;
+	    p += w;
+	    n -= w;
+	}
+    }
+    if ( n < 0 )
+	ok = false;
+    if ( ok && uid )
+	(void)::fchown( out, uid, gid );
+    ::close( in );
+    ::close( out );
+    return ok;
+}
+
+
+// opens the directory t in dir, creating it with mode m if need be.
+// whatever the service may have left at t is removed unless it's a
+// real directory, so a symlink can't lead us out of its root.
+static int openDirectory( int dir, const string & t, mode_t m )
+{
+    const int flags = O_RDONLY | O_DIRECTORY | O_NOFOLLOW;
+    int fd = ::openat( dir, t.c_str(), flags );
+    if ( fd >= 0 )
+	return fd;
+    if ( errno == ENOTDIR || errno == ELOOP )
+	::unlinkat( dir, t.c_str(), 0 );
+    if ( ::mkdirat( dir, t.c_str(), m ) < 0 && errno != EEXIST )
+	return -1;
+    return ::openat( dir, t.c_str(), flags );
+}
+
+
+static bool populateTree( const string & from, int to,
+			  int uid, int gid, bool & clones )
+{
+    DIR * dir = ::opendir( from.c_str() );
+    if ( !dir )
+	return false;
+    bool ok = true;
+    struct dirent * e;
+    while ( ok && ( e = ::readdir( dir ) ) != 0 ) {
+	string n = e->d_name;
+	if ( n == "." || n == ".." )
+	    continue;
+	string s = from + "/" + n;
+	struct stat st;
+	if ( ::lstat( s.c_str(), &st ) < 0 ) {
+	    ok = false;
+	} else if ( S_ISDIR( st.st_mode ) ) {
+	    int t = openDirectory( to, n, ( st.st_mode & 01777 ) | 0700 );
+	    if ( t < 0 )
+		ok = false;
+	    else if ( uid )
+		(void)::fchown( t, uid, gid );
+	    ok = ok && populateTree( s, t, uid, gid, clones );
+	    if ( t >= 0 )
+		::close( t );
+	} else if ( S_ISLNK( st.st_mode ) ) {
+	    char l[4096];
+	    int r = ::readlink( s.c_str(), l, sizeof( l ) - 1 );
+	    ::unlinkat( to, n.c_str(), 0 );
+	    ok = r >= 0 &&
+		 ::symlinkat( string( l, r ).c_str(), to, n.c_str() ) == 0;
+	    if ( ok && uid )
+		(void)::fchownat( to, n.c_str(), uid, gid,
+				  AT_SYMLINK_NOFOLLOW );
+	} else if ( S_ISREG( st.st_mode ) ) {
+	    ok = place( s, to, n, st.st_mode & 0777, uid, gid, clones );
+	}
+	// sockets, devices and fifos have no business in an artifact
+    }
+    ::closedir( dir );
+    return ok;
+}
+
+
+/*! Fills \a root with the extracted artifact whose SHA-256 sum is \a
+    digest, creating \a root if necessary. Directories and (where
+    possible) files are owned by \a uid and \a gid, unless \a uid is
+    0. Files the artifact keeps private to their owner are always
+    copied, so the service can use them. Returns true if all went well.
+
+    Anything already in \a root stays, unless the artifact contains a
+    file with the same name. Since the service can write to \a root,
+    no symlink below it is ever followed; one that sits where the
+    artifact has a directory is replaced by that directory.
+*/
+
+bool Store::populate( const string & digest, const string & root,
+		      int uid, int gid )
+{
+    if ( !has( digest ) )
+	return false;
+    try {
+	boost::filesystem::create_directories( root );
+    } catch ( ... ) {
+	return false;
+    }
+    int to = ::open( root.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW );
+    if ( to < 0 )
+	return false;
+    if ( uid )
+	(void)::fchown( to, uid, gid );
+    bool clones = true;
+    bool ok = populateTree( tree( digest ), to, uid, gid, clones );
+    ::close( to );
+    if ( !ok )
+	debug << "nodee: Could not populate " << root << " from "
+	      << tree( digest ) << endl;
+    return ok;
+}
+
+
+/*! Computes the MD5 and SHA-256 sums of \a filename and stores them
+    in \a md5 and \a sha256, or returns false if the file can't be
+    read.
+
+    The sums are remembered, along with the file's size and
+    modification time, so a file that's used for many launches is
+    read only once.
+*/
+
+bool Store::digests( const string & filename, string & md5, string & sha256 )
+{
+    struct stat st;
+    if ( ::stat( filename.c_str(), &st ) < 0 )
+	return false;
+    {
+	boost::lock_guard<boost::mutex> lock( mutex );
+	std::map<string, StoreDigests>::iterator i = known.find( filename );
+	if ( i != known.end() && i->second.size == st.st_size &&
+	     i->second.mtime == st.st_mtime ) {
+	    md5 = i->second.md5;
+	    sha256 = i->second.sha256;
+	    return true;
+	}
+    }
+    if ( !Fetcher::digest( filename, md5, sha256 ) )
+	return false;
+    boost::lock_guard<boost::mutex> lock( mutex );
+    StoreDigests & d = known[filename];
+    d.size = st.st_size;
+    d.mtime = st.st_mtime;
+    d.md5 = md5;
+    d.sha256 = sha256;
+    return true;
+}
+
+
+/*! Records that \a filename, as it is now, has the MD5 sum \a md5
+    and the SHA-256 sum \a sha256, so that digests() needn't read it.
+    Fetcher computes both while downloading.
+*/
+
+void Store::remember( const string & filename,
+		      const string & md5, const string & sha256 )
+{
+    struct stat st;
+    if ( md5.empty() || sha256.empty() ||
+	 ::stat( filename.c_str(), &st ) < 0 )
+	return;
+    boost::lock_guard<boost::mutex> lock( mutex );
+    StoreDigests & d = known[filename];
+    d.size = st.st_size;
+    d.mtime = st.st_mtime;
+    d.md5 = md5;
+    d.sha256 = sha256;
+}
@@ -0,0 +1,28 @@
+// Copyright Arnt Gulbrandsen <arnt@gulbrandsen.priv.no>; BSD-licensed.
+
+#ifndef STORE_H
+#define STORE_H
+
+#include <string>
+
+using namespace std;
+
+
+class Store
+{
+public:
+    static string directory();
+    static string tree( const string & );
+    static bool has( const string & );
+
+    static string staging( const string & );
+    static bool commit( const string &, const string & );
+    static void remove( const string & );
+
+    static bool populate( const string &, const string &, int, int );
+
+    static bool digests( const string &, string &, string & );
+    static void remember( const string &, const string &, const string & );
+};
+
+#endif
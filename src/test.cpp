@@ -57,6 +57,180 @@ BOOST_AUTO_TEST_CASE( HttpResponse )
 }
 
 
+#include <unistd.h>
+#include <fcntl.h>
+
+static void feed( int fd, const string & s )
+{
+    (void)::write( fd, s.data(), s.size() );
+}
+
+BOOST_AUTO_TEST_CASE( HttpReceive )
+{
+    Init i;
+    int p[2];
+
+    // a header split across two writes, with a body arriving along
+    // with the header
+    BOOST_REQUIRE( ::pipe( p ) == 0 );
+    ::fcntl( p[0], F_SETFL, O_NONBLOCK );
+    HttpServer x( p[0], i );
+    feed( p[1], "POST /service/start HTTP/1.1\r\nContent-Length: 7\r" );
+    BOOST_CHECK_EQUAL( x.receive(), HttpServer::Partial );
+    feed( p[1], "\n\r\n{\"a\"" );
+    BOOST_CHECK_EQUAL( x.receive(), HttpServer::Partial );
+    BOOST_CHECK_EQUAL( x.operation(), HttpServer::Post );
+    BOOST_CHECK_EQUAL( x.path(), "/service/start" );
+    BOOST_CHECK_EQUAL( x.contentLength(), 7 );
+    feed( p[1], ":1}" );
+    BOOST_CHECK_EQUAL( x.receive(), HttpServer::Complete );
+    x.readBody();
+    BOOST_CHECK_EQUAL( x.body(), "{\"a\":1}" );
+    ::close( p[1] );
+    x.close();
+
+    // LFLF ends a header too
+    BOOST_REQUIRE( ::pipe( p ) == 0 );
+    ::fcntl( p[0], F_SETFL, O_NONBLOCK );
+    HttpServer y( p[0], i );
+    feed( p[1], "GET /nodee/status HTTP/1.0\n\n" );
+    BOOST_CHECK_EQUAL( y.receive(), HttpServer::Complete );
+    BOOST_CHECK_EQUAL( y.path(), "/nodee/status" );
+    ::close( p[1] );
+    y.close();
+
+    // null bytes in the header are not appreciated
+    BOOST_REQUIRE( ::pipe( p ) == 0 );
+    ::fcntl( p[0], F_SETFL, O_NONBLOCK );
+    HttpServer z( p[0], i );
+    feed( p[1], string( "GET /\0 HTTP/1.0\n\n", 18 ) );
+    BOOST_CHECK_EQUAL( z.receive(), HttpServer::Broken );
+    ::close( p[1] );
+    z.close();
+
+    // nor are bodies that would take two gigabytes
+    BOOST_REQUIRE( ::pipe( p ) == 0 );
+    ::fcntl( p[0], F_SETFL, O_NONBLOCK );
+    HttpServer v( p[0], i );
+    feed( p[1], "POST /artifact/prefetch HTTP/1.1\r\n"
+	  "Content-Length: 2147483600\r\n\r\n{}" );
+    BOOST_CHECK_EQUAL( v.receive(), HttpServer::Broken );
+    ::close( p[1] );
+    v.close();
+
+    // nor are 32k headers
+    BOOST_REQUIRE( ::pipe( p ) == 0 );
+    ::fcntl( p[0], F_SETFL, O_NONBLOCK );
+    ::fcntl( p[1], F_SETFL, O_NONBLOCK );
+    HttpServer w( p[0], i );
+    HttpServer::Input r = HttpServer::Partial;
+    int n = 0;
+    while ( r == HttpServer::Partial && n < 100 ) {
+	feed( p[1], "X-Padding: " + string( 1000, 'x' ) + "\r\n" );
+	r = w.receive();
+	n++;
+    }
+    BOOST_CHECK_EQUAL( r, HttpServer::Broken );
+    BOOST_CHECK( n > 30 );
+    ::close( p[1] );
+    w.close();
+}
+
+
+BOOST_AUTO_TEST_CASE( HttpKeepAlive )
+{
+    Init i;
+    HttpServer x( 0, i );
+
+    x.parseRequest( "GET / HTTP/1.0\r\n\r\n" );
+    BOOST_CHECK( !x.keepAlive() );
+    x.parseRequest( "GET / HTTP/1.0\r\nConnection: Keep-Alive\r\n\r\n" );
+    BOOST_CHECK( x.keepAlive() );
+    x.parseRequest( "GET / HTTP/1.1\r\nConnection: close\r\n\r\n" );
+    BOOST_CHECK( !x.keepAlive() );
+    x.parseRequest( "GET / HTTP/1.1\r\nHost: nodee\r\n\r\n" );
+    BOOST_CHECK( x.keepAlive() );
+
+    BOOST_CHECK_EQUAL( x.httpResponse( 200, "text/plain", "OK" ),
+		       "HTTP/1.1 200 OK\r\n"
+		       "Connection: keep-alive\r\n"
+		       "Server: nodee\r\n"
+		       "Content-Type: text/plain\r\n"
+		       "Content-Length: 0\r\n\r\n" );
+
+    // three pipelined requests, the third one incomplete
+    int p[2];
+    BOOST_REQUIRE( ::pipe( p ) == 0 );
+    ::fcntl( p[0], F_SETFL, O_NONBLOCK );
+    HttpServer y( p[0], i );
+    feed( p[1], "GET /a HTTP/1.1\r\n\r\n"
+	  "POST /b HTTP/1.1\r\nContent-Length: 2\r\n\r\nhi"
+	  "GET /c HTTP/1.1\r\n" );
+    BOOST_CHECK_EQUAL( y.receive(), HttpServer::Complete );
+    BOOST_CHECK_EQUAL( y.path(), "/a" );
+    BOOST_CHECK_EQUAL( y.next(), HttpServer::Complete );
+    BOOST_CHECK_EQUAL( y.path(), "/b" );
+    y.readBody();
+    BOOST_CHECK_EQUAL( y.body(), "hi" );
+    BOOST_CHECK_EQUAL( y.next(), HttpServer::Partial );
+    feed( p[1], "\r\n" );
+    BOOST_CHECK_EQUAL( y.receive(), HttpServer::Complete );
+    BOOST_CHECK_EQUAL( y.path(), "/c" );
+    ::close( p[1] );
+    y.close();
+    BOOST_CHECK_EQUAL( y.next(), HttpServer::Broken );
+}
+
+
+#include "router.h"
+
+static void routeA( HttpServer &, const Router::Captures & ) {}
+static void routeB( HttpServer &, const Router::Captures & ) {}
+static void routeC( HttpServer &, const Router::Captures & ) {}
+
+BOOST_AUTO_TEST_CASE( Routing )
+{
+    Router::add( HttpServer::Get, "/test/route/{id:int}", routeA );
+    Router::add( HttpServer::Get, "/test/route/list", routeB );
+    Router::add( HttpServer::Post, "/test/route/{name}/{n:int}", routeC );
+
+    // the captures point into the path, so the paths have to live
+    // as long as we look at the captures
+    string a( "/test/route/42" );
+    string b( "/test/route/7?x=y" );
+    string d( "/test/route/foo/12" );
+
+    Router::Captures c;
+    BOOST_CHECK( Router::find( HttpServer::Get, a, c ) == routeA );
+    BOOST_CHECK_EQUAL( c.count(), 1 );
+    BOOST_CHECK_EQUAL( c.number( 0 ), 42 );
+
+    // literals win over captures, trailing slashes and queries
+    // don't matter
+    BOOST_CHECK( Router::find( HttpServer::Get, "/test/route/list/", c ) ==
+		 routeB );
+    BOOST_CHECK_EQUAL( c.count(), 0 );
+    BOOST_CHECK( Router::find( HttpServer::Get, b, c ) == routeA );
+    BOOST_CHECK_EQUAL( c.number( 0 ), 7 );
+
+    // int captures want digits, and the operation matters
+    BOOST_CHECK( !Router::find( HttpServer::Get, "/test/route/x42", c ) );
+    BOOST_CHECK( !Router::find( HttpServer::Post, "/test/route/42", c ) );
+    BOOST_CHECK( !Router::find( HttpServer::Invalid, "/test/route/42", c ) );
+
+    BOOST_CHECK( Router::find( HttpServer::Post, d, c ) == routeC );
+    BOOST_CHECK_EQUAL( c.count(), 2 );
+    BOOST_CHECK_EQUAL( c.text( 0 ), "foo" );
+    BOOST_CHECK_EQUAL( c.number( 1 ), 12 );
+    BOOST_CHECK( !Router::find( HttpServer::Post, "/test/route/foo", c ) );
+
+    // the built-in routes are there
+    BOOST_CHECK( Router::find( HttpServer::Post, "/service/stop/123", c ) );
+    BOOST_CHECK( Router::find( HttpServer::Get, "/", c ) );
+    BOOST_CHECK( !Router::find( HttpServer::Get, "/service/stop/123", c ) );
+}
+
+
 #include "init.h"
 #include "chorekeeper.h"
 
@@ -161,11 +335,17 @@ BOOST_AUTO_TEST_CASE( ReadProcVmstat )
 	"thp_collapse_alloc_failed 0\n"
 	"thp_split 0\n";
 
-    int nfp = 1, pgmf = 2, pgpo = 3;
-    x.readProcVmstat( "/tmp/vmstat", nfp, pgmf, pgpo );
-    BOOST_CHECK_EQUAL( nfp, 741357 );
-    BOOST_CHECK_EQUAL( pgmf, 7814 );
-    BOOST_CHECK_EQUAL( pgpo, 5048644 );
+    VmstatSample s = x.readProcVmstat( "/tmp/vmstat" );
+    BOOST_CHECK_EQUAL( s.nr_free_pages, 741357 );
+    BOOST_CHECK_EQUAL( s.pgmajfault, 7814 );
+    BOOST_CHECK_EQUAL( s.pgpgout, 5048644 );
+
+    // the counters don't fit in an int on a host that's been up a while
+    string big = "pgmajfault 123456789012\npgpgout 9876543210987\n";
+    ChoreKeeper::parseProcVmstat( big.data(), big.size(), s );
+    BOOST_CHECK_EQUAL( s.pgmajfault, 123456789012LL );
+    BOOST_CHECK_EQUAL( s.pgpgout, 9876543210987LL );
+    BOOST_CHECK_EQUAL( s.nr_free_pages, 0 );
 }
 
 
@@ -186,6 +366,81 @@ BOOST_AUTO_TEST_CASE( ParseProcStat )
     BOOST_CHECK_EQUAL( r.ppid, 13820 );
     BOOST_CHECK_EQUAL( r.rss, 731 );
     BOOST_CHECK_EQUAL( r.majflt, 0 );
+
+    // a process can call itself anything, including ") 2 3"
+    r = x.parseProcStat( "4711 (a) 2 3) R 17 1 1 0 -1 0 0 0 5 6 0 0 0 0 20 0 1 0 3 0 99 0" );
+    BOOST_CHECK_EQUAL( r.pid, 4711 );
+    BOOST_CHECK_EQUAL( r.ppid, 17 );
+    BOOST_CHECK_EQUAL( r.rss, 99 );
+    BOOST_CHECK_EQUAL( r.majflt, 11 );
+
+    // truncated or garbled lines give nothing
+    r = x.parseProcStat( "4711 (a) R 17 1 1 0 -1 0 0 0 5 6" );
+    BOOST_CHECK_EQUAL( r.pid, 0 );
+    r = x.parseProcStat( "4711 (a) R x 1 1 0 -1 0 0 0 5 6 0 0 0 0 20 0 1 0 3 0 99 0" );
+    BOOST_CHECK_EQUAL( r.pid, 0 );
+    r = x.parseProcStat( "" );
+    BOOST_CHECK_EQUAL( r.pid, 0 );
+}
+
+
+BOOST_AUTO_TEST_CASE( OneBitOfThrashing )
+{
+    // plenty of free RAM
+    BOOST_CHECK( !ChoreKeeper::oneBitOfThrashing( 100000, 100000, 100000, 1 ) );
+    // little free RAM, but nothing much happening
+    BOOST_CHECK( !ChoreKeeper::oneBitOfThrashing( 1000, 10, 100, 1 ) );
+    // the same counts over a tenth of a second are a lot
+    BOOST_CHECK( ChoreKeeper::oneBitOfThrashing( 1000, 10, 100, 0.1 ) );
+    // paging in hard
+    BOOST_CHECK( ChoreKeeper::oneBitOfThrashing( 1000, 500, 0, 1 ) );
+    // writing hard, and paging in a little
+    BOOST_CHECK( ChoreKeeper::oneBitOfThrashing( 1000, 5, 100000, 1 ) );
+    // the same over ten seconds isn't much
+    BOOST_CHECK( !ChoreKeeper::oneBitOfThrashing( 1000, 50, 1000, 10 ) );
+    // counters that go backwards or no time says nothing
+    BOOST_CHECK( !ChoreKeeper::oneBitOfThrashing( 1000, -500, 0, 1 ) );
+    BOOST_CHECK( !ChoreKeeper::oneBitOfThrashing( 1000, 500, 0, 0 ) );
+}
+
+
+BOOST_AUTO_TEST_CASE( DetectThrashing )
+{
+    Init i;
+    ChoreKeeper x( i );
+
+    // a host that's been up a while has large counters, but if they
+    // don't grow, it's not thrashing, no matter how little RAM is free
+    VmstatSample s;
+    s.nr_free_pages = 1000;
+    s.pgmajfault = 123456789012LL;
+    s.pgpgout = 987654321098LL;
+    s.when = 1000;
+    int n = 0;
+    while ( n < 20 ) {
+	x.detectThrashing( s );
+	s.pgmajfault += 2;
+	s.when += 1;
+	n++;
+    }
+    BOOST_CHECK( !x.isThrashing() );
+
+    // paging in 1000 pages per second for eight seconds is thrashing
+    n = 0;
+    while ( n < 8 ) {
+	s.pgmajfault += 1000;
+	s.when += 1;
+	x.detectThrashing( s );
+	n++;
+    }
+    BOOST_CHECK( x.isThrashing() );
+    BOOST_CHECK( x.sample().find( "\"majfaults\":\"1000\"" ) != string::npos );
+
+    // but the same over a minute-long gap isn't
+    s.pgmajfault += 1000;
+    s.when += 60;
+    x.detectThrashing( s );
+    BOOST_CHECK( !x.isThrashing() );
 }
 
 
@@ -283,12 +538,127 @@ BOOST_AUTO_TEST_CASE( ScanProcesses )
     // should have observed 100, with majflt 1000+0+1+0 and rss 1532+1432,
     // and 200, with majflt 4576+0+69+0+42+0 and rss 3883+4231235+476238.
 
-    BOOST_CHECK( x.biggest() == mg2 );
-    BOOST_CHECK( x.thrashingMost() == mg2 );
+    BOOST_CHECK( x.biggest().get() == mg2 );
+    BOOST_CHECK( x.thrashingMost().get() == mg2 );
     BOOST_CHECK( !x.leastValuable() );
     // peak and expected are both zero, so...
-    BOOST_CHECK( x.furthestOverPeak() == mg2 );
-    BOOST_CHECK( x.furthestOverExpected() == mg2 );
+    BOOST_CHECK( x.furthestOverPeak().get() == mg2 );
+    BOOST_CHECK( x.furthestOverExpected().get() == mg2 );
+}
+
+
+static void fakeProcess( const string & proc, int pid, int rss,
+			 int ppid = 0 )
+{
+    string d = proc + "/" + boost::lexical_cast<string>( pid );
+    boost::filesystem::create_directories( d + "/task" );
+    ofstream stat( ( d + "/stat" ).c_str() );
+    stat << pid << " (fake) S " << ppid
+	 << " 0 0 0 0 0 0 0 1 0 0 0 0 0 0 0 0 0 0 0 " << rss << " 0" << endl;
+}
+
+
+static void fakeThread( const string & proc, int pid, int tid,
+			const string & children )
+{
+    string d = proc + "/" + boost::lexical_cast<string>( pid ) + "/task/" +
+	       boost::lexical_cast<string>( tid );
+    boost::filesystem::create_directories( d );
+    ofstream f( ( d + "/children" ).c_str() );
+    f << children;
+}
+
+
+BOOST_AUTO_TEST_CASE( ScanServiceTrees )
+{
+    Init i;
+    ChoreKeeper x( i );
+
+    string proc = "/tmp/nodee-proctree";
+    boost::filesystem::remove_all( proc );
+    // 42 is nodee and has a children file, so the scan walks down
+    // from 100, which has two threads and three descendants. 69 is
+    // unmanaged and must not be counted.
+    fakeProcess( proc, 42, 1 );
+    fakeThread( proc, 42, 42, "100 69 " );
+    fakeProcess( proc, 100, 1000 );
+    fakeThread( proc, 100, 100, "101 " );
+    fakeThread( proc, 100, 105, "102 " );
+    fakeProcess( proc, 101, 100 );
+    fakeThread( proc, 101, 101, "103 " );
+    fakeProcess( proc, 102, 10 );
+    fakeProcess( proc, 103, 1 );
+    fakeProcess( proc, 69, 50000 );
+    fakeThread( proc, 69, 69, "70 " );
+    fakeProcess( proc, 70, 50000 );
+
+    Process * p = new Process;
+    p->fakefork( 100 );
+    i.manage( p );
+
+    x.scanProcesses( proc.c_str(), 42 );
+    BOOST_CHECK_EQUAL( p->currentRss(), 1111 );
+    BOOST_CHECK_EQUAL( p->recentPageFaults(), 4 );
+
+    // 103 exits and is reaped. its stat file stays open, but can't
+    // be read any more.
+    fakeThread( proc, 101, 101, "" );
+    { ofstream gone( ( proc + "/103/stat" ).c_str() ); }
+    x.scanProcesses( proc.c_str(), 42 );
+    BOOST_CHECK_EQUAL( p->currentRss(), 1110 );
+    x.scanProcesses( proc.c_str(), 42 );
+    BOOST_CHECK_EQUAL( p->currentRss(), 1110 );
+
+    // 102 forks. that's noticed when the process table changes.
+    fakeProcess( proc, 104, 5 );
+    fakeThread( proc, 102, 102, "104 " );
+    Process * q = new Process;
+    q->fakefork( 300 );
+    i.manage( q );
+    x.scanProcesses( proc.c_str(), 42 );
+    BOOST_CHECK_EQUAL( p->currentRss(), 1115 );
+
+    boost::filesystem::remove_all( proc );
+}
+
+
+BOOST_AUTO_TEST_CASE( ScanProcessTree )
+{
+    Init i;
+    ChoreKeeper x( i );
+
+    // no children files, so this reads every stat file and folds
+    // the tree from the ppids. 42 is nodee, 100 and 200 are managed.
+    string proc = "/tmp/nodee-proctree";
+    boost::filesystem::remove_all( proc );
+    fakeProcess( proc, 1, 1 );
+    fakeProcess( proc, 42, 2, 1 );
+    fakeProcess( proc, 69, 50000, 1 );
+    fakeProcess( proc, 70, 50000, 69 );
+    fakeProcess( proc, 100, 1000, 42 );
+    fakeProcess( proc, 101, 100, 100 );
+    fakeProcess( proc, 102, 10, 101 );
+    fakeProcess( proc, 103, 1, 102 );
+    fakeProcess( proc, 104, 20000, 103 );
+    fakeProcess( proc, 200, 3000, 42 );
+    fakeProcess( proc, 201, 300, 200 );
+    // 500's parent isn't there, so it stands alone
+    fakeProcess( proc, 500, 700000, 499 );
+
+    Process * p1 = new Process;
+    p1->fakefork( 100 );
+    i.manage( p1 );
+    Process * p2 = new Process;
+    p2->fakefork( 200 );
+    i.manage( p2 );
+
+    x.scanProcesses( proc.c_str(), 42 );
+    BOOST_CHECK_EQUAL( p1->currentRss(), 21111 );
+    BOOST_CHECK_EQUAL( p1->recentPageFaults(), 5 );
+    BOOST_CHECK_EQUAL( p2->currentRss(), 3300 );
+    BOOST_CHECK_EQUAL( p2->recentPageFaults(), 2 );
+
+    boost::filesystem::remove_all( proc );
 }
 
 
@@ -320,6 +690,333 @@ BOOST_AUTO_TEST_CASE( ServiceList )
 }
 
 
+BOOST_AUTO_TEST_CASE( ServiceSnapshot )
+{
+    Init i;
+
+    Service::Snapshot a = Service::snapshot( i );
+    Service::Snapshot b = Service::snapshot( i );
+    BOOST_CHECK( a.json == b.json );
+    BOOST_CHECK_EQUAL( a.etag, b.etag );
+    BOOST_CHECK_EQUAL( *a.json, Service::list( i ) );
+
+    Service::changed();
+    Service::Snapshot c = Service::snapshot( i );
+    BOOST_CHECK( a.json != c.json );
+    BOOST_CHECK( a.etag != c.etag );
+
+    HttpServer x( 0, i );
+    x.parseRequest( "GET /service/list HTTP/1.1\r\n"
+		    "If-None-Match: W/" + c.etag + ", \"x\"\r\n\r\n" );
+    BOOST_CHECK_EQUAL( x.ifNoneMatch(), "W/" + c.etag + ", \"x\"" );
+    BOOST_CHECK( x.matches( c.etag ) );
+    BOOST_CHECK( !x.matches( a.etag ) );
+    BOOST_CHECK_EQUAL( x.httpResponse( 304, "application/json",
+				       "Not modified", "", "\"1\"" ),
+		       "HTTP/1.1 304 Not modified\r\n"
+		       "Connection: keep-alive\r\n"
+		       "Server: nodee\r\n"
+		       "Content-Type: application/json\r\n"
+		       "ETag: \"1\"\r\n\r\n" );
+}
+
+
+
+#include "journal.h"
+
+static int wakeups = 0;
+
+static void wakeUp()
+{
+    wakeups++;
+}
+
+
+BOOST_AUTO_TEST_CASE( ServiceJournal )
+{
+    unsigned int v = Journal::version();
+    BOOST_CHECK( Journal::covers( v ) );
+    BOOST_CHECK( !Journal::covers( v + 1 ) );
+
+    Journal::watch( v, ::time( 0 ) + 100, wakeUp );
+    Journal::watch( v, ::time( 0 ) - 1, wakeUp );
+    BOOST_CHECK_EQUAL( wakeups, 0 );
+    Journal::expire( ::time( 0 ) );
+    BOOST_CHECK_EQUAL( wakeups, 1 );
+
+    Journal::record( Journal::Exited, 4711, "a.b.c", 1, 9 );
+    BOOST_CHECK_EQUAL( wakeups, 2 );
+    BOOST_CHECK_EQUAL( Journal::version(), v + 1 );
+    Journal::watch( v, ::time( 0 ) + 100, wakeUp );
+    BOOST_CHECK_EQUAL( wakeups, 3 );
+
+    // write_json's layout varies between boost versions, so we
+    // look for bits and pieces
+    string n = boost::lexical_cast<string>( v + 1 );
+    string c = Journal::changes( v );
+    BOOST_CHECK( c.find( "\"version\": \"" + n + "\"" ) != string::npos );
+    BOOST_CHECK( c.find( "\"" + n + "\":" ) != string::npos );
+    BOOST_CHECK( c.find( "\"event\": \"exited\"" ) != string::npos );
+    BOOST_CHECK( c.find( "\"signal\": \"9\"" ) != string::npos );
+    BOOST_CHECK( c.find( "\"coordinate\": \"a.b.c\"" ) != string::npos );
+    BOOST_CHECK( Journal::changes( v + 1 ).find( "4711" ) == string::npos );
+
+    // a deferred request can be woken before or after it's released
+    Init i;
+    HttpServer x( 0, i );
+    x.setResumer( wakeUp );
+    x.parseRequest( "GET /service/watch?x=1&since=42 HTTP/1.1\r\n\r\n" );
+    BOOST_CHECK_EQUAL( x.parameter( "since" ), "42" );
+    BOOST_CHECK_EQUAL( x.parameter( "x" ), "1" );
+    BOOST_CHECK_EQUAL( x.parameter( "y" ), "" );
+    x.defer();
+    BOOST_CHECK( x.deferred() );
+    BOOST_CHECK( x.release() );
+    x.resume();
+    BOOST_CHECK_EQUAL( wakeups, 4 );
+    x.defer();
+    x.resume();
+    BOOST_CHECK( x.deferred() );
+    BOOST_CHECK( !x.release() );
+    BOOST_CHECK_EQUAL( wakeups, 4 );
+}
+
+
+
+BOOST_AUTO_TEST_CASE( ProcessTable )
+{
+    Init i;
+    Process * a = new Process;
+    Process * b = new Process;
+    a->fakefork( 200 );
+    i.manage( a );
+    i.manage( b );
+    BOOST_CHECK( a->handle() );
+    BOOST_CHECK( b->handle() != a->handle() );
+    BOOST_CHECK_EQUAL( i.count(), 2 );
+    BOOST_CHECK( i.find( 200 ).get() == a );
+    BOOST_CHECK( !i.find( 0 ) );
+    BOOST_CHECK( !i.find( 201 ) );
+
+    // a restart changes the pid, but not the handle
+    unsigned int h = b->handle();
+    b->fakefork( 201 );
+    BOOST_CHECK( i.find( 201 ).get() == b );
+    b->fakefork( 202 );
+    BOOST_CHECK( !i.find( 201 ) );
+    BOOST_CHECK( i.find( 202 ).get() == b );
+    BOOST_CHECK( i.lookup( h ).get() == b );
+    BOOST_CHECK_EQUAL( b->handle(), h );
+
+    BOOST_CHECK_EQUAL( i.byCoordinate( "" ).size(), 2u );
+    BOOST_CHECK( i.byCoordinate( "no.such.thing" ).empty() );
+    BOOST_CHECK_EQUAL( i.processes()->size(), 2u );
+
+    // a snapshot doesn't change, and keeps its processes alive
+    boost::shared_ptr<const Init::Processes> before = i.processes();
+    i.manage( new Process );
+    BOOST_CHECK_EQUAL( before->size(), 2u );
+    BOOST_CHECK_EQUAL( i.processes()->size(), 3u );
+    BOOST_CHECK( i.processes()->front().get() == a );
+    {
+	Init j;
+    }
+    BOOST_CHECK_EQUAL( i.count(), 0 );
+    BOOST_CHECK_EQUAL( before->back()->pid(), 202 );
+}
+
+
+#include "spawn.h"
+
+#include <errno.h>
+
+BOOST_AUTO_TEST_CASE( SpawnErrors )
+{
+    // the child is created even if the program can't be run, and
+    // reports why
+    Spawn s;
+    s.setProgram( "/no/such/program" );
+    s.addArgument( "x" );
+    BOOST_CHECK( s.run() > 0 );
+    BOOST_CHECK_EQUAL( s.error(), ENOENT );
+    if ( s.pidfd() >= 0 )
+	::close( s.pidfd() );
+
+    Spawn d;
+    d.setProgram( "/bin/true" );
+    d.setDirectory( "/no/such/directory" );
+    BOOST_CHECK( d.run() > 0 );
+    BOOST_CHECK_EQUAL( d.error(), ENOENT );
+    if ( d.pidfd() >= 0 )
+	::close( d.pidfd() );
+}
+
+
+// returns the value of the field in a /proc/<pid>/status file
+static string statusField( const string & file, const string & field )
+{
+    ifstream f( file.c_str() );
+    string line;
+    while ( getline( f, line ) )
+	if ( line.compare( 0, field.size() + 1, field + ":" ) == 0 )
+	    return line.substr( field.size() + 2 );
+    return "";
+}
+
+
+BOOST_AUTO_TEST_CASE( SpawnChild )
+{
+    // nodee ignores SIGPIPE, but its services mustn't. and when
+    // running as root, the child gets the uid and gid it's given.
+    ::unlink( "/tmp/nodee-status" );
+    void (*old)( int ) = ::signal( SIGPIPE, SIG_IGN );
+    Spawn s;
+    s.setProgram( "/bin/sh" );
+    s.addArgument( "-c" );
+    s.addArgument( "cat /proc/$$/status > /tmp/nodee-status.tmp;"
+		   "mv /tmp/nodee-status.tmp /tmp/nodee-status" );
+    if ( ::geteuid() == 0 ) {
+	s.setUid( 2000 );
+	s.setGid( 2001 );
+    }
+    BOOST_CHECK( s.run() > 0 );
+    ::signal( SIGPIPE, old );
+    if ( s.pidfd() >= 0 )
+	::close( s.pidfd() );
+    int n = 0;
+    while ( n++ < 100 && !boost::filesystem::exists( "/tmp/nodee-status" ) )
+	::usleep( 20000 );
+    string ignored = statusField( "/tmp/nodee-status", "SigIgn" );
+    BOOST_REQUIRE( !ignored.empty() );
+    BOOST_CHECK_EQUAL( ::strtoull( ignored.c_str(), 0, 16 ) &
+		       ( 1ULL << ( SIGPIPE - 1 ) ), 0u );
+    if ( ::geteuid() == 0 ) {
+	BOOST_CHECK_EQUAL( statusField( "/tmp/nodee-status", "Uid" ),
+			   "2000\t2000\t2000\t2000" );
+	BOOST_CHECK_EQUAL( statusField( "/tmp/nodee-status", "Gid" ),
+			   "2001\t2001\t2001\t2001" );
+    }
+    ::unlink( "/tmp/nodee-status" );
+}
+
+
+class QuickExit: public Process
+{
+public:
+    QuickExit() {}
+    QuickExit( const ServerSpec & s ): Process( s ) {}
+
+    void prepare( Spawn & spawn ) {
+	spawn.setProgram( "/bin/sh" );
+	spawn.addArgument( "-c" );
+	spawn.addArgument( "exit 3" );
+    }
+};
+
+
+BOOST_AUTO_TEST_CASE( ReapChildren )
+{
+    Init i;
+    unsigned int v = Journal::version();
+    QuickExit * p = new QuickExit;
+    i.manage( p );
+    p->fork();
+
+    // the reaper may delete p at any moment now, so we watch the
+    // journal instead.
+    int n = 0;
+    while ( n < 50 &&
+	    Journal::changes( v ).find( "removed" ) == string::npos ) {
+	::usleep( 100000 );
+	n++;
+    }
+    string c = Journal::changes( v );
+    BOOST_CHECK( c.find( "\"event\": \"started\"" ) != string::npos );
+    BOOST_CHECK( c.find( "\"status\": \"3\"" ) != string::npos );
+    BOOST_CHECK( c.find( "\"event\": \"removed\"" ) != string::npos );
+}
+
+
+BOOST_AUTO_TEST_CASE( RestartBackoff )
+{
+    int n = 0;
+    while ( n < 100 ) {
+	int d = Init::backoff( 10, 1 );
+	BOOST_CHECK( d >= 5 && d <= 10 );
+	d = Init::backoff( 10, 3 );
+	BOOST_CHECK( d >= 20 && d <= 40 );
+	d = Init::backoff( 10, 50 );
+	BOOST_CHECK( d >= 300 && d <= 600 );
+	n++;
+    }
+
+    // a service that crashes at once is restarted after a delay, not
+    // at once, and is pending meanwhile.
+    Init i;
+    unsigned int v = Journal::version();
+    ServerSpec s = ServerSpec::parseJson(
+	"{"
+	"  \"coordinate\" : \"1.crashing.example.com\","
+	"  \"artifact\" : \"com.example:crashing:1.0\","
+	"  \"filename\" : \"crashing-1.0.jar\","
+	"  \"url\" : \"http://example.com\","
+	"  \"restart\" : { \"period\" : 2, \"maxrestarts\" : 2 }"
+	"}", i
+	);
+    BOOST_REQUIRE( s.valid() );
+    QuickExit * p = new QuickExit( s );
+    i.manage( p );
+    p->fork();
+
+    n = 0;
+    while ( n < 80 &&
+	    Journal::changes( v ).find( "removed" ) == string::npos ) {
+	::usleep( 100000 );
+	n++;
+    }
+    string c = Journal::changes( v );
+    string::size_type pending = c.find( "\"event\": \"pending\"" );
+    BOOST_CHECK( pending != string::npos );
+    BOOST_CHECK( c.find( "\"event\": \"started\"", pending ) != string::npos );
+    BOOST_CHECK( c.find( "\"event\": \"removed\"" ) != string::npos );
+}
+
+
+#include "events.h"
+
+#include <sys/socket.h>
+
+BOOST_AUTO_TEST_CASE( EventStream )
+{
+    BOOST_CHECK_EQUAL( Events::format( "sample", "{\"a\":\"1\"}\n" ),
+		       "event: sample\ndata: {\"a\":\"1\"}\n\n" );
+    BOOST_CHECK_EQUAL( Events::format( "x", "y" ), "event: x\ndata: y\n\n" );
+
+    // a full queue drops the oldest sample, not the first event
+    EventQueue q;
+    q.push( "header", false );
+    int n = 0;
+    while ( n < EventQueue::Max + 5 ) {
+	q.push( "s" + boost::lexical_cast<string>( n ) + "\n", true );
+	n++;
+    }
+    BOOST_CHECK_EQUAL( q.size(), EventQueue::Max );
+    BOOST_CHECK_EQUAL( q.dropped(), 6 );
+
+    int p[2];
+    BOOST_REQUIRE( ::socketpair( AF_UNIX, SOCK_STREAM, 0, p ) == 0 );
+    BOOST_CHECK( q.write( p[1] ) );
+    BOOST_CHECK( q.empty() );
+    char b[32];
+    int r = ::read( p[0], b, 12 );
+    BOOST_CHECK_EQUAL( string( b, r > 0 ? r : 0 ), "headers6\ns7\n" );
+    ::close( p[0] );
+    q.push( "more", false );
+    BOOST_CHECK( !q.write( p[1] ) );
+    ::close( p[1] );
+}
+
+
 #include "uid.h"
 
 BOOST_AUTO_TEST_CASE( ReadEtcPasswd )
@@ -483,6 +1180,91 @@ BOOST_AUTO_TEST_CASE( ArtifactLister )
 }
 
 
+#include "store.h"
+
+#include <utime.h>
+
+
+static void artifactFile( const string & name, int kbytes, time_t used )
+{
+    {
+	ofstream f( name.c_str() );
+	f << string( kbytes * 1024, 'x' );
+    }
+    struct utimbuf t;
+    t.actime = used;
+    t.modtime = used;
+    ::utime( name.c_str(), &t );
+}
+
+
+BOOST_AUTO_TEST_CASE( ArtifactCache )
+{
+    string d = "/tmp/nodeecache";
+    boost::filesystem::remove_all( d );
+    boost::filesystem::create_directories( d + "/artefacts/store/feed" );
+    artifactFile( d + "/artefacts/a.zip", 600, 1000 );
+    artifactFile( d + "/artefacts/b.zip", 300, 2000 );
+    artifactFile( d + "/artefacts/store/feed/b", 300, 2000 );
+    artifactFile( d + "/artefacts/c.zip", 600, 3000 );
+
+    string basedir = Conf::basedir;
+    string artefactdir = Conf::artefactdir;
+    Conf::basedir = d;
+    Conf::artefactdir = "artefacts";
+
+    BOOST_CHECK_EQUAL( Artifact::bytes(), 1800u * 1024 );
+    Artifact::record( "b.zip", "feed" );
+    BOOST_CHECK_EQUAL( Artifact::bytes(), 1800u * 1024 );
+
+    // a is the oldest, but it's in use, so b and c have to go
+    Artifact::acquire( "a.zip" );
+    Conf::artefactquota = 1;
+    Artifact::trim();
+    BOOST_CHECK_EQUAL( Artifact::bytes(), 600u * 1024 );
+    BOOST_CHECK( boost::filesystem::exists( d + "/artefacts/a.zip" ) );
+    BOOST_CHECK( !boost::filesystem::exists( d + "/artefacts/b.zip" ) );
+    BOOST_CHECK( !boost::filesystem::exists( d + "/artefacts/c.zip" ) );
+    BOOST_CHECK( !Store::has( "feed" ) );
+
+    BOOST_CHECK_EQUAL( Artifact::references( "a.zip" ), 1 );
+    BOOST_CHECK_EQUAL( Artifact::uninstall( "a.zip" ), Artifact::InUse );
+    Artifact::release( "a.zip" );
+
+    // names that would break the index are not recorded
+    Artifact::record( "x\nR a.zip", "" );
+    Artifact::acquire( "b\tc" );
+    BOOST_CHECK_EQUAL( Artifact::references( "b\tc" ), 0 );
+    BOOST_CHECK_EQUAL( Artifact::uninstall( ".index" ),
+		       Artifact::NoSuchArtifact );
+
+    // the index survives a restart (or a change of directory)
+    boost::filesystem::create_directory( d + "/other" );
+    Conf::artefactdir = "other";
+    BOOST_CHECK_EQUAL( Artifact::bytes(), 0u );
+    Conf::artefactdir = d + "/artefacts";
+    BOOST_CHECK_EQUAL( Artifact::bytes(), 600u * 1024 );
+    BOOST_CHECK_EQUAL( Artifact::list(), "{\n    \"1\": \"a.zip\"\n}\n" );
+    BOOST_CHECK( boost::filesystem::exists( d + "/artefacts/.index" ) );
+
+    BOOST_CHECK_EQUAL( Artifact::uninstall( "a.zip" ), Artifact::Uninstalled );
+    BOOST_CHECK_EQUAL( Artifact::uninstall( "a.zip" ),
+		       Artifact::NoSuchArtifact );
+    BOOST_CHECK_EQUAL( Artifact::uninstall( ".." ), Artifact::NoSuchArtifact );
+    BOOST_CHECK( !boost::filesystem::exists( d + "/artefacts/a.zip" ) );
+    BOOST_CHECK_EQUAL( Artifact::bytes(), 0u );
+    Conf::artefactdir = "other";
+    Artifact::bytes();
+    Conf::artefactdir = "artefacts";
+    BOOST_CHECK_EQUAL( Artifact::bytes(), 0u );
+
+    Conf::artefactquota = 0;
+    Conf::basedir = basedir;
+    Conf::artefactdir = artefactdir;
+    boost::filesystem::remove_all( d );
+}
+
+
 #include "serverspec.h"
 
 // I feel a need to record the following error message, which g++ gave me
@@ -518,3 +1300,862 @@ BOOST_AUTO_TEST_CASE( ServerOptions )
     BOOST_CHECK_EQUAL( o["--someoption"], "some value" );
     BOOST_CHECK_EQUAL( o["--anotheroption"], "more config" );
 }
+
+
+#include "launcher.h"
+#include "store.h"
+
+#include <sys/stat.h>
+
+static void script( const string & name, const string & body )
+{
+    {
+	ofstream o( name.c_str() );
+	o << "#!/bin/sh\n" << body;
+    }
+    ::chmod( name.c_str(), 0755 );
+}
+
+
+static int lines( const string & name )
+{
+    ifstream i( name.c_str() );
+    int n = 0;
+    string l;
+    while ( getline( i, l ) )
+	n++;
+    return n;
+}
+
+
+static ServerSpec launchable( const string & coordinate,
+			      const string & filename, Init & i )
+{
+    return ServerSpec::parseJson(
+	"{"
+	"  \"coordinate\" : \"" + coordinate + "\","
+	"  \"artifact\" : \"com.example:launchable:1.0\","
+	"  \"filename\" : \"" + filename + "\","
+	"  \"url\" : \"ftp://example.com/" + filename + "\""
+	"}", i
+	);
+}
+
+
+BOOST_AUTO_TEST_CASE( LaunchPipeline )
+{
+    string d = "/tmp/nodeelaunch";
+    boost::filesystem::remove_all( d );
+    boost::filesystem::create_directory( d );
+    boost::filesystem::create_directory( d + "/artefacts" );
+    // the helpers run as other users if we're root
+    ::chmod( d.c_str(), 01777 );
+    ::chmod( ( d + "/artefacts" ).c_str(), 01777 );
+    {
+	ofstream downloads( ( d + "/downloads" ).c_str() );
+	ofstream installs( ( d + "/installs" ).c_str() );
+    }
+    ::chmod( ( d + "/downloads" ).c_str(), 0666 );
+    ::chmod( ( d + "/installs" ).c_str(), 0666 );
+    script( d + "/download",
+	    "echo $$ >> " + d + "/downloads\n"
+	    "while [ $# -gt 0 ] ; do\n"
+	    "  [ \"$1\" = --filename ] && echo $2 > $2\n"
+	    "  shift\n"
+	    "done\n"
+	    "sleep 1\n" );
+    script( d + "/install",
+	    "echo $$ >> " + d + "/installs\n"
+	    "while [ $# -gt 0 ] ; do\n"
+	    "  [ \"$1\" = --rootdir ] && echo installed > $2/installed\n"
+	    "  shift\n"
+	    "done\n" );
+
+    string scriptdir = Conf::scriptdir;
+    string basedir = Conf::basedir;
+    string artefactdir = Conf::artefactdir;
+    Conf::scriptdir = d;
+    Conf::basedir = d;
+    Conf::artefactdir = "artefacts";
+    Conf::downloadlimit = 1;
+
+    // three services share one artifact, one uses another. nodee
+    // doesn't know how to unpack .war files, so the script does that.
+    Init i;
+    Launcher::launch( launchable( "1.a.example.com", "a.war", i ), i );
+    Launcher::launch( launchable( "2.a.example.com", "a.war", i ), i );
+    Launcher::launch( launchable( "3.a.example.com", "a.war", i ), i );
+    Launcher::launch( launchable( "1.b.example.com", "b.jar", i ), i );
+    BOOST_CHECK_EQUAL( Launcher::fetching(), 2 );
+    BOOST_CHECK_EQUAL( Launcher::running( Launcher::Download ), 1 );
+    BOOST_CHECK_EQUAL( Launcher::queued( Launcher::Download ), 1 );
+
+    int n = 0;
+    while ( n < 100 && ( Launcher::fetching() > 0 ||
+			 Launcher::queued( Launcher::Install ) > 0 ||
+			 Launcher::running( Launcher::Install ) > 0 ) ) {
+	::usleep( 100000 );
+	n++;
+    }
+    // each artifact is unpacked once, into the store
+    BOOST_CHECK_EQUAL( lines( d + "/downloads" ), 2 );
+    BOOST_CHECK_EQUAL( lines( d + "/installs" ), 1 );
+    BOOST_CHECK_EQUAL( Launcher::fetching(), 0 );
+    BOOST_CHECK_EQUAL( Launcher::queued( Launcher::Install ), 0 );
+    BOOST_CHECK_EQUAL( std::distance(
+			   boost::filesystem::directory_iterator(
+			       Store::directory() ),
+			   boost::filesystem::directory_iterator() ), 2 );
+
+    Conf::scriptdir = scriptdir;
+    Conf::basedir = basedir;
+    Conf::artefactdir = artefactdir;
+    Conf::downloadlimit = 0;
+    boost::filesystem::remove_all( d );
+}
+
+
+BOOST_AUTO_TEST_CASE( StorePopulate )
+{
+    string d = "/tmp/nodeestore";
+    boost::filesystem::remove_all( d );
+    boost::filesystem::create_directory( d );
+
+    string basedir = Conf::basedir;
+    string artefactdir = Conf::artefactdir;
+    Conf::basedir = d;
+    Conf::artefactdir = "artefacts";
+
+    string digest = "0123abcd";
+    BOOST_CHECK( !Store::has( digest ) );
+    string s = Store::staging( digest );
+    BOOST_REQUIRE( !s.empty() );
+    boost::filesystem::create_directory( s + "/lib" );
+    {
+	ofstream f( ( s + "/lib/a.jar" ).c_str() );
+	f << "contents\n";
+    }
+    ::chmod( ( s + "/lib/a.jar" ).c_str(), 06777 );
+    {
+	ofstream f( ( s + "/run.sh" ).c_str() );
+	f << "#!/bin/sh\n";
+    }
+    ::chmod( ( s + "/run.sh" ).c_str(), 0700 );
+    BOOST_CHECK_EQUAL( ::symlink( "lib/a.jar", ( s + "/a.jar" ).c_str() ), 0 );
+    BOOST_CHECK( Store::commit( s, digest ) );
+    BOOST_CHECK( Store::has( digest ) );
+
+    // a second extraction of the same artifact loses, harmlessly
+    string t = Store::staging( digest );
+    BOOST_CHECK( t != s );
+    BOOST_CHECK( Store::commit( t, digest ) );
+    BOOST_CHECK( !boost::filesystem::exists( t ) );
+
+    // nothing in the store may be writable by the services
+    struct stat st;
+    ::stat( ( Store::tree( digest ) + "/lib/a.jar" ).c_str(), &st );
+    BOOST_CHECK_EQUAL( st.st_mode & 022, 0u );
+    // nor setuid or setgid
+    BOOST_CHECK_EQUAL( st.st_mode & 06000, 0u );
+
+    BOOST_CHECK( Store::populate( digest, d + "/one", 0, 0 ) );
+    BOOST_CHECK( Store::populate( digest, d + "/two", 0, 0 ) );
+    BOOST_CHECK( !Store::populate( "fedc3210", d + "/three", 0, 0 ) );
+    BOOST_CHECK_EQUAL( lines( d + "/one/lib/a.jar" ), 1 );
+    BOOST_CHECK_EQUAL( lines( d + "/two/a.jar" ), 1 );
+    BOOST_CHECK( boost::filesystem::is_symlink( d + "/two/a.jar" ) );
+    BOOST_CHECK( !boost::filesystem::is_symlink( d + "/two/lib" ) );
+
+    // a symlink left behind by the service doesn't lead outside its root
+    boost::filesystem::create_directory( d + "/elsewhere" );
+    boost::filesystem::create_directory( d + "/four" );
+    BOOST_CHECK_EQUAL( ::symlink( ( d + "/elsewhere" ).c_str(),
+				  ( d + "/four/lib" ).c_str() ), 0 );
+    BOOST_CHECK( Store::populate( digest, d + "/four", 0, 0 ) );
+    BOOST_CHECK( !boost::filesystem::is_symlink( d + "/four/lib" ) );
+    BOOST_CHECK_EQUAL( lines( d + "/four/lib/a.jar" ), 1 );
+    BOOST_CHECK( !boost::filesystem::exists( d + "/elsewhere/a.jar" ) );
+
+    // a script only its owner may run must belong to the service
+    if ( ::geteuid() == 0 ) {
+	BOOST_CHECK( Store::populate( digest, d + "/five", 2000, 2001 ) );
+	struct stat st;
+	BOOST_CHECK_EQUAL( ::stat( ( d + "/five/run.sh" ).c_str(), &st ), 0 );
+	BOOST_CHECK_EQUAL( st.st_uid, 2000u );
+	BOOST_CHECK_EQUAL( st.st_gid, 2001u );
+	BOOST_CHECK_EQUAL( st.st_mode & 07777, 0700u );
+    }
+
+    Conf::basedir = basedir;
+    Conf::artefactdir = artefactdir;
+    boost::filesystem::remove_all( d );
+}
+
+
+#include "extractor.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <zlib.h>
+
+
+// returns a tar member with the given name, type and contents
+static string tarMember( const string & name, char type,
+			 const string & data, const string & link = "" )
+{
+    char h[512];
+    ::memset( h, 0, sizeof( h ) );
+    ::strncpy( h, name.c_str(), 100 );
+    ::sprintf( h + 100, "%07o", type == '5' ? 0750 : 0640 );
+    ::sprintf( h + 124, "%011o", (unsigned int)data.size() );
+    ::sprintf( h + 136, "%011o", 0 );
+    h[156] = type;
+    ::strncpy( h + 157, link.c_str(), 100 );
+    ::memcpy( h + 257, "ustar\0" "00", 8 );
+    ::memset( h + 148, ' ', 8 );
+    unsigned int sum = 0;
+    int i = 0;
+    while ( i < 512 )
+	sum += (unsigned char)h[i++];
+    ::sprintf( h + 148, "%06o", sum );
+    string r( h, 512 );
+    r += data;
+    r.append( ( 512 - data.size() % 512 ) % 512, '\0' );
+    return r;
+}
+
+
+static void put( string & s, unsigned int n, int bytes )
+{
+    while ( bytes-- > 0 ) {
+	s.push_back( (char)( n & 0xff ) );
+	n >>= 8;
+    }
+}
+
+
+// a minimal zip writer: each entry is stored or deflated, and has a
+// unix mode
+struct ZipWriter
+{
+    string local;
+    string central;
+    int count;
+
+    ZipWriter(): count( 0 ) {}
+
+    void add( const string & name, const string & data,
+	      unsigned int mode, bool deflate ) {
+	string d = data;
+	if ( deflate ) {
+	    // zlib's format is a raw deflate stream with a 2-byte
+	    // header and a 4-byte trailer
+	    uLongf l = compressBound( data.size() );
+	    string z( l, '\0' );
+	    compress2( (Bytef *)&z[0], &l,
+		       (const Bytef *)data.data(), data.size(), 9 );
+	    d = z.substr( 2, l - 6 );
+	}
+	unsigned int crc = crc32( 0, (const Bytef *)data.data(), data.size() );
+	unsigned int offset = local.size();
+	put( local, 0x04034b50, 4 );
+	put( local, 20, 2 );
+	put( local, 0, 2 );
+	put( local, deflate ? 8 : 0, 2 );
+	put( local, 0, 4 );
+	put( local, crc, 4 );
+	put( local, d.size(), 4 );
+	put( local, data.size(), 4 );
+	put( local, name.size(), 2 );
+	put( local, 0, 2 );
+	local += name + d;
+	put( central, 0x02014b50, 4 );
+	put( central, 0x0314, 2 );
+	put( central, 20, 2 );
+	put( central, 0, 2 );
+	put( central, deflate ? 8 : 0, 2 );
+	put( central, 0, 4 );
+	put( central, crc, 4 );
+	put( central, d.size(), 4 );
+	put( central, data.size(), 4 );
+	put( central, name.size(), 2 );
+	put( central, 0, 8 );
+	put( central, mode << 16, 4 );
+	put( central, offset, 4 );
+	central += name;
+	count++;
+    }
+
+    string contents() const {
+	string r = local + central;
+	put( r, 0x06054b50, 4 );
+	put( r, 0, 4 );
+	put( r, count, 2 );
+	put( r, count, 2 );
+	put( r, central.size(), 4 );
+	put( r, local.size(), 4 );
+	put( r, 0, 2 );
+	return r;
+    }
+};
+
+
+BOOST_AUTO_TEST_CASE( ExtractTarGz )
+{
+    string d = "/tmp/nodeeextract";
+    boost::filesystem::remove_all( d );
+    boost::filesystem::create_directory( d );
+
+    string longName = "deep/" + string( 120, 'n' );
+    gzFile g = gzopen( ( d + "/a.tar.gz" ).c_str(), "wb" );
+    string t = tarMember( "./dir/", '5', "" ) +
+	       tarMember( "dir/file", '0', "hello\n" ) +
+	       tarMember( "big", '0', string( 3 * 1024 * 1024, 'x' ) ) +
+	       tarMember( "././@LongLink", 'L', longName + '\0' ) +
+	       tarMember( longName.substr( 0, 100 ), '0', "long\n" ) +
+	       tarMember( "link", '2', "", "dir/file" ) +
+	       tarMember( "hard", '1', "", "dir/file" ) +
+	       string( 1024, '\0' );
+    gzwrite( g, t.data(), t.size() );
+    gzclose( g );
+
+    Extractor x( d + "/a.tar.gz", d + "/out" );
+    if ( ::geteuid() == 0 )
+	x.setOwner( 2000, 2000 );
+    BOOST_CHECK( x.extract() );
+    BOOST_CHECK_EQUAL( x.error(), "" );
+    BOOST_CHECK( boost::filesystem::is_directory( d + "/out/tmp" ) );
+    BOOST_CHECK_EQUAL( lines( d + "/out/dir/file" ), 1 );
+    BOOST_CHECK_EQUAL( lines( d + "/out/" + longName ), 1 );
+    BOOST_CHECK_EQUAL( boost::filesystem::file_size( d + "/out/big" ),
+		       3u * 1024 * 1024 );
+    BOOST_CHECK( boost::filesystem::is_symlink( d + "/out/link" ) );
+    BOOST_CHECK_EQUAL( boost::filesystem::hard_link_count( d + "/out/hard" ),
+		       2u );
+    struct stat st;
+    ::stat( ( d + "/out/dir/file" ).c_str(), &st );
+    BOOST_CHECK_EQUAL( st.st_mode & 07777, 0640u );
+    if ( ::geteuid() == 0 )
+	BOOST_CHECK_EQUAL( st.st_uid, 2000u );
+
+    // nothing may be written outside the target directory
+    g = gzopen( ( d + "/evil.tar.gz" ).c_str(), "wb" );
+    t = tarMember( "../evil", '0', "evil\n" ) + string( 1024, '\0' );
+    gzwrite( g, t.data(), t.size() );
+    gzclose( g );
+    Extractor evil( d + "/evil.tar.gz", d + "/out" );
+    BOOST_CHECK( !evil.extract() );
+    BOOST_CHECK( !boost::filesystem::exists( d + "/evil" ) );
+
+    boost::filesystem::remove_all( d );
+}
+
+
+// replaces the header field at offset with the n bytes at value, and
+// fixes the checksum
+static string patchTar( string m, int offset, const char * value, int n )
+{
+    m.replace( offset, n, value, n );
+    m.replace( 148, 8, 8, ' ' );
+    unsigned int sum = 0;
+    int i = 0;
+    while ( i < 512 )
+	sum += (unsigned char)m[i++];
+    char c[8];
+    ::sprintf( c, "%06o", sum );
+    m.replace( 148, 7, c, 7 );
+    return m;
+}
+
+
+static void writeTarGz( const string & file, const string & contents )
+{
+    gzFile g = gzopen( file.c_str(), "wb" );
+    string t = contents + string( 1024, '\0' );
+    gzwrite( g, t.data(), t.size() );
+    gzclose( g );
+}
+
+
+BOOST_AUTO_TEST_CASE( ExtractHostileTar )
+{
+    string d = "/tmp/nodeeextract";
+    boost::filesystem::remove_all( d );
+    boost::filesystem::create_directory( d );
+
+    // a pax header claiming to be some exabytes long, in base-256
+    const char huge[12] = { (char)0x80, 0, 0, 0, 0x7f, (char)0xff,
+			    (char)0xff, (char)0xff, (char)0xff, (char)0xff,
+			    (char)0xff, (char)0xff };
+    writeTarGz( d + "/huge.tar.gz",
+		patchTar( tarMember( "pax", 'x', "" ), 124, huge, 12 ) +
+		tarMember( "file", '0', "hello\n" ) );
+    Extractor x( d + "/huge.tar.gz", d + "/out" );
+    BOOST_CHECK( !x.extract() );
+
+    // a setuid file and a setgid directory lose those bits
+    writeTarGz( d + "/suid.tar.gz",
+		patchTar( tarMember( "dir/", '5', "" ), 100, "0002750", 7 ) +
+		patchTar( tarMember( "dir/sh", '0', "#!/bin/sh\n" ),
+			  100, "0004755", 7 ) );
+    Extractor y( d + "/suid.tar.gz", d + "/suid" );
+    BOOST_CHECK( y.extract() );
+    struct stat st;
+    ::stat( ( d + "/suid/dir/sh" ).c_str(), &st );
+    BOOST_CHECK_EQUAL( st.st_mode & 07777, 0755u );
+    ::stat( ( d + "/suid/dir" ).c_str(), &st );
+    BOOST_CHECK_EQUAL( st.st_mode & 07777, 0750u );
+
+    // a hard link may not reach through a symlink to the host
+    boost::filesystem::create_directory( d + "/host" );
+    {
+	ofstream secret( ( d + "/host/secret" ).c_str() );
+	secret << "secret\n";
+    }
+    writeTarGz( d + "/link.tar.gz",
+		tarMember( "x", '2', "", d + "/host" ) +
+		tarMember( "y", '1', "", "x/secret" ) );
+    Extractor z( d + "/link.tar.gz", d + "/link" );
+    BOOST_CHECK( !z.extract() );
+    BOOST_CHECK( !boost::filesystem::exists( d + "/link/y" ) );
+    BOOST_CHECK_EQUAL( boost::filesystem::hard_link_count( d + "/host/secret" ),
+		       1u );
+
+    boost::filesystem::remove_all( d );
+}
+
+
+BOOST_AUTO_TEST_CASE( ExtractZip )
+{
+    string d = "/tmp/nodeeextract";
+    boost::filesystem::remove_all( d );
+    boost::filesystem::create_directory( d );
+
+    ZipWriter z;
+    z.add( "lib/", "", 040755, false );
+    z.add( "lib/a.txt", string( 1000, 'a' ) + "\n", 0100644, true );
+    z.add( "b.txt", "b\n", 0100600, false );
+    z.add( "c", "b.txt", 0120777, false );
+    int i = 0;
+    while ( i < 40 ) {
+	z.add( "many/" + boost::lexical_cast<string>( i ),
+	       string( i * 100, 'm' ), 0100644, i % 2 );
+	i++;
+    }
+    {
+	ofstream f( ( d + "/a.zip" ).c_str() );
+	f << z.contents();
+    }
+
+    Extractor x( d + "/a.zip", d + "/out" );
+    BOOST_CHECK( x.extract() );
+    BOOST_CHECK_EQUAL( x.error(), "" );
+    BOOST_CHECK_EQUAL( lines( d + "/out/lib/a.txt" ), 1 );
+    BOOST_CHECK_EQUAL( boost::filesystem::file_size( d + "/out/lib/a.txt" ),
+		       1001u );
+    BOOST_CHECK_EQUAL( boost::filesystem::file_size( d + "/out/many/39" ),
+		       3900u );
+    BOOST_CHECK( boost::filesystem::is_symlink( d + "/out/c" ) );
+    BOOST_CHECK_EQUAL( lines( d + "/out/c" ), 1 );
+    struct stat st;
+    ::stat( ( d + "/out/b.txt" ).c_str(), &st );
+    BOOST_CHECK_EQUAL( st.st_mode & 07777, 0600u );
+
+    // a jar is copied, not unpacked
+    boost::filesystem::copy_file( d + "/a.zip", d + "/a.jar" );
+    Extractor jar( d + "/a.jar", d + "/jar" );
+    BOOST_CHECK( jar.extract() );
+    BOOST_CHECK_EQUAL( boost::filesystem::file_size( d + "/jar/a.jar" ),
+		       boost::filesystem::file_size( d + "/a.zip" ) );
+
+    boost::filesystem::remove_all( d );
+}
+
+
+#include "fetcher.h"
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <boost/thread.hpp>
+#include <boost/bind.hpp>
+
+// a stand-in for an artifact server: answers each connection with
+// the next canned response, and records the requests.
+struct StandIn
+{
+    int fd;
+    int port;
+    vector<string> responses;
+    vector<string> requests;
+};
+
+
+static void serveStandIn( StandIn * s )
+{
+    vector<string>::iterator r = s->responses.begin();
+    while ( r != s->responses.end() ) {
+	int c = ::accept( s->fd, 0, 0 );
+	if ( c < 0 )
+	    return;
+	string request;
+	char b[4096];
+	while ( request.find( "\r\n\r\n" ) == string::npos ) {
+	    int n = ::read( c, b, sizeof( b ) );
+	    if ( n <= 0 )
+		break;
+	    request.append( b, n );
+	}
+	s->requests.push_back( request );
+	(void)::write( c, r->data(), r->size() );
+	::close( c );
+	++r;
+    }
+}
+
+
+static void listenStandIn( StandIn & s )
+{
+    s.fd = ::socket( AF_INET, SOCK_STREAM, 0 );
+    struct sockaddr_in a;
+    ::memset( &a, 0, sizeof( a ) );
+    a.sin_family = AF_INET;
+    a.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+    a.sin_port = 0;
+    ::bind( s.fd, (struct sockaddr *)&a, sizeof( a ) );
+    ::listen( s.fd, 4 );
+    socklen_t l = sizeof( a );
+    ::getsockname( s.fd, (struct sockaddr *)&a, &l );
+    s.port = ntohs( a.sin_port );
+}
+
+
+BOOST_AUTO_TEST_CASE( FetchArtifact )
+{
+    string f = "/tmp/nodeefetch.jar";
+    ::unlink( f.c_str() );
+    {
+	ofstream o( f.c_str() );
+	o << "abc";
+    }
+    string md5, sha256;
+    BOOST_CHECK( Fetcher::digest( f, md5, sha256 ) );
+    BOOST_CHECK_EQUAL( md5, "900150983cd24fb0d6963f7d28e17f72" );
+    BOOST_CHECK_EQUAL( sha256, "ba7816bf8f01cfea414140de5dae2223"
+			       "b00361a396177a9cb410ff61f20015ad" );
+    ::unlink( f.c_str() );
+
+    BOOST_CHECK( Fetcher::fetchable( "http://user:pw@example.com:8080/a" ) );
+    BOOST_CHECK( !Fetcher::fetchable( "https://example.com/a" ) );
+
+    string body;
+    int n = 0;
+    while ( n < 100000 ) {
+	body.push_back( 'a' + n % 26 );
+	n++;
+    }
+    {
+	ofstream o( "/tmp/nodeefetch.expected" );
+	o << body;
+    }
+    BOOST_REQUIRE( Fetcher::digest( "/tmp/nodeefetch.expected",
+				    md5, sha256 ) );
+    ::unlink( "/tmp/nodeefetch.expected" );
+
+    // a redirect, then a connection that breaks half-way, then the
+    // rest of the file
+    StandIn s;
+    listenStandIn( s );
+    s.responses.push_back( "HTTP/1.0 302 Moved\r\n"
+			   "Location: /real.jar\r\n\r\n" );
+    s.responses.push_back( "HTTP/1.0 200 OK\r\n"
+			   "Content-Length: 100000\r\n\r\n" +
+			   body.substr( 0, 40000 ) );
+    s.responses.push_back( "HTTP/1.0 206 Partial\r\n"
+			   "Content-Range: bytes 40000-99999/100000\r\n"
+			   "Content-Length: 60000\r\n\r\n" +
+			   body.substr( 40000 ) );
+    boost::thread server( boost::bind( &serveStandIn, &s ) );
+
+    string url = "http://127.0.0.1:" +
+		 boost::lexical_cast<string>( s.port ) + "/a.jar";
+    Fetcher a( url, f );
+    a.setMd5( md5 );
+    a.setSha256( sha256 );
+    BOOST_CHECK( a.fetch() );
+    server.join();
+    ::close( s.fd );
+    BOOST_CHECK_EQUAL( a.requests(), 3 );
+    BOOST_CHECK_EQUAL( a.md5(), md5 );
+    BOOST_REQUIRE_EQUAL( s.requests.size(), 3u );
+    BOOST_CHECK( s.requests[1].find( "GET /real.jar " ) == 0 );
+    BOOST_CHECK( s.requests[2].find( "Range: bytes=40000-" ) !=
+		 string::npos );
+    BOOST_CHECK_EQUAL( boost::filesystem::file_size( f ), 100000u );
+
+    // a cached copy with the right digest isn't fetched again
+    Fetcher b( url, f );
+    b.setMd5( md5 );
+    BOOST_CHECK( b.fetch() );
+    BOOST_CHECK_EQUAL( b.requests(), 0 );
+    ::unlink( f.c_str() );
+
+    // a file with the wrong digest is never published
+    StandIn w;
+    listenStandIn( w );
+    w.responses.push_back( "HTTP/1.0 200 OK\r\n\r\nnot the right file" );
+    server = boost::thread( boost::bind( &serveStandIn, &w ) );
+    Fetcher c( "http://127.0.0.1:" +
+	       boost::lexical_cast<string>( w.port ) + "/a.jar", f );
+    c.setMd5( md5 );
+    c.setAttempts( 1 );
+    BOOST_CHECK( !c.fetch() );
+    server.join();
+    ::close( w.fd );
+    BOOST_CHECK( ::access( f.c_str(), F_OK ) < 0 );
+}
+
+
+BOOST_AUTO_TEST_CASE( PrefetchArtifact )
+{
+    BOOST_CHECK( ServerSpec::parseArtifactJson( "not json" ).empty() );
+    vector<ServerSpec> bad = ServerSpec::parseArtifactJson(
+	"[ { \"url\" : \"http://example.com/a.jar\","
+	"    \"filename\" : \"../a.jar\" } ]" );
+    BOOST_REQUIRE_EQUAL( bad.size(), 1u );
+    BOOST_CHECK( !bad[0].error().empty() );
+
+    string d = "/tmp/nodeeprefetch";
+    boost::filesystem::remove_all( d );
+    boost::filesystem::create_directory( d );
+    boost::filesystem::create_directory( d + "/artefacts" );
+    string basedir = Conf::basedir;
+    string artefactdir = Conf::artefactdir;
+    Conf::basedir = d;
+    Conf::artefactdir = "artefacts";
+    Conf::prefetchrate = 100;
+
+    string body( 200000, 'p' );
+    StandIn s;
+    listenStandIn( s );
+    s.responses.push_back( "HTTP/1.0 200 OK\r\n"
+			   "Content-Length: 200000\r\n\r\n" + body );
+    boost::thread server( boost::bind( &serveStandIn, &s ) );
+
+    vector<ServerSpec> specs = ServerSpec::parseArtifactJson(
+	"[ { \"url\" : \"http://127.0.0.1:" +
+	boost::lexical_cast<string>( s.port ) + "/p.jar\","
+	"    \"filename\" : \"p.jar\" } ]" );
+    BOOST_REQUIRE_EQUAL( specs.size(), 1u );
+    BOOST_CHECK( specs[0].error().empty() );
+
+    // 200k at 100k/s takes about two seconds
+    Init i;
+    time_t start = ::time( 0 );
+    Launcher::prefetch( specs[0], i );
+    BOOST_CHECK( Launcher::prefetches().find( "p.jar" ) != string::npos );
+    int n = 0;
+    while ( n < 100 &&
+	    Launcher::prefetches().find( "\"done\"" ) == string::npos &&
+	    Launcher::prefetches().find( "\"failed\"" ) == string::npos ) {
+	::usleep( 100000 );
+	n++;
+    }
+    // wakes the server up if nothing connected
+    ::shutdown( s.fd, SHUT_RDWR );
+    server.join();
+    ::close( s.fd );
+    BOOST_CHECK( Launcher::prefetches().find( "\"done\"" ) != string::npos );
+    BOOST_CHECK( Launcher::prefetches().find( "200000" ) != string::npos );
+    BOOST_CHECK( ::time( 0 ) - start >= 1 );
+
+    // the artifact is in the store, ready for a launch
+    string md5, sha256;
+    BOOST_CHECK( Fetcher::digest( d + "/artefacts/p.jar", md5, sha256 ) );
+    BOOST_CHECK( Store::has( sha256 ) );
+
+    Conf::basedir = basedir;
+    Conf::artefactdir = artefactdir;
+    Conf::prefetchrate = 0;
+    boost::filesystem::remove_all( d );
+}
+
+
+#include <poll.h>
+
+// reads everything the other end sends, until it closes
+static string drain( int fd )
+{
+    string r;
+    char b[4096];
+    int n;
+    while ( ( n = ::read( fd, b, sizeof( b ) ) ) > 0 )
+	r.append( b, n );
+    return r;
+}
+
+
+// sends request to a fresh HttpServer and returns its response
+static string askPeer( Init & i, const string & request )
+{
+    int p[2];
+    if ( ::socketpair( AF_UNIX, SOCK_STREAM, 0, p ) < 0 )
+	return "";
+    ::fcntl( p[0], F_SETFL, O_NONBLOCK );
+    HttpServer x( p[0], i );
+    feed( p[1], request );
+    if ( x.receive() == HttpServer::Complete )
+	x.start();
+    if ( x.fd() >= 0 )
+	x.close();
+    string r = drain( p[1] );
+    ::close( p[1] );
+    return r;
+}
+
+
+// a nodee on loopback: answers the requests on one connection after
+// the other, with an HttpServer, as HttpListener would.
+struct Peer
+{
+    StandIn listener;
+    Init * init;
+    int connections;
+};
+
+
+static void servePeer( Peer * peer )
+{
+    int n = 0;
+    while ( n < peer->connections ) {
+	int c = ::accept( peer->listener.fd, 0, 0 );
+	if ( c < 0 )
+	    return;
+	::fcntl( c, F_SETFL, O_NONBLOCK );
+	HttpServer x( c, *peer->init );
+	HttpServer::Input r = HttpServer::Partial;
+	while ( r == HttpServer::Partial ) {
+	    struct pollfd pfd;
+	    pfd.fd = c;
+	    pfd.events = POLLIN;
+	    ::poll( &pfd, 1, 1000 );
+	    r = x.receive();
+	}
+	if ( r == HttpServer::Complete )
+	    x.start();
+	if ( x.fd() >= 0 )
+	    x.close();
+	n++;
+    }
+}
+
+
+BOOST_AUTO_TEST_CASE( PeerArtifact )
+{
+    string d = "/tmp/nodeepeer";
+    boost::filesystem::remove_all( d );
+    boost::filesystem::create_directory( d );
+    boost::filesystem::create_directory( d + "/artefacts" );
+    boost::filesystem::create_directory( d + "/elsewhere" );
+    string basedir = Conf::basedir;
+    string artefactdir = Conf::artefactdir;
+    Conf::basedir = d;
+    Conf::artefactdir = "artefacts";
+
+    string body;
+    int n = 0;
+    while ( n < 100000 ) {
+	body.push_back( 'a' + n % 23 );
+	n++;
+    }
+    {
+	ofstream o( ( d + "/artefacts/p.jar" ).c_str() );
+	o << body;
+    }
+    string md5, sha256;
+    BOOST_REQUIRE( Fetcher::digest( d + "/artefacts/p.jar", md5, sha256 ) );
+
+    Init i;
+    Artifact::record( "p.jar", sha256 );
+    BOOST_CHECK( askPeer( i, "GET /artifact/file/q.jar HTTP/1.0\r\n\r\n" )
+		 .find( "HTTP/1.0 404 " ) == 0 );
+    string r = askPeer( i, "GET /artifact/file/p.jar HTTP/1.0\r\n\r\n" );
+    BOOST_CHECK( r.find( "HTTP/1.0 200 " ) == 0 );
+    BOOST_CHECK( r.find( "Content-Length: 100000\r\n" ) != string::npos );
+    BOOST_CHECK( r.size() > 100000 && r.substr( r.size() - 100000 ) == body );
+
+    r = askPeer( i, "GET /artifact/file/p.jar HTTP/1.0\r\n"
+		 "Range: bytes=10-19\r\n\r\n" );
+    BOOST_CHECK( r.find( "HTTP/1.0 206 " ) == 0 );
+    BOOST_CHECK( r.find( "Content-Range: bytes 10-19/100000\r\n" ) !=
+		 string::npos );
+    BOOST_CHECK_EQUAL( r.substr( r.find( "\r\n\r\n" ) + 4 ),
+		       body.substr( 10, 10 ) );
+    r = askPeer( i, "GET /artifact/file/p.jar HTTP/1.0\r\n"
+		 "Range: bytes=-5\r\n\r\n" );
+    BOOST_CHECK_EQUAL( r.substr( r.find( "\r\n\r\n" ) + 4 ),
+		       body.substr( 99995 ) );
+    r = askPeer( i, "GET /artifact/file/p.jar HTTP/1.0\r\n"
+		 "Range: bytes=100000-\r\n\r\n" );
+    BOOST_CHECK( r.find( "HTTP/1.0 416 " ) == 0 );
+    BOOST_CHECK( askPeer( i, "GET /artifact/file/.index HTTP/1.0\r\n\r\n" )
+		 .find( "HTTP/1.0 404 " ) == 0 );
+
+    // a peer that sends the wrong thing and one that sends the right
+    // thing. the depot isn't needed.
+    Peer good;
+    listenStandIn( good.listener );
+    good.init = &i;
+    good.connections = 2;
+    boost::thread goodServer( boost::bind( &servePeer, &good ) );
+    StandIn bad;
+    listenStandIn( bad );
+    bad.responses.push_back( "HTTP/1.0 200 OK\r\n\r\nnot the right file" );
+    boost::thread badServer( boost::bind( &serveStandIn, &bad ) );
+    StandIn depot;
+    listenStandIn( depot );
+    depot.responses.push_back( "HTTP/1.0 200 OK\r\n"
+			       "Content-Length: 100000\r\n\r\n" + body );
+    boost::thread depotServer( boost::bind( &serveStandIn, &depot ) );
+
+    vector<string> peers;
+    peers.push_back( "127.0.0.1:" +
+		     boost::lexical_cast<string>( bad.port ) );
+    peers.push_back( "127.0.0.1:" +
+		     boost::lexical_cast<string>( good.listener.port ) );
+    Fetcher::setPeers( peers );
+    string depotUrl = "http://127.0.0.1:" +
+		      boost::lexical_cast<string>( depot.port );
+
+    Fetcher a( depotUrl + "/p.jar", d + "/elsewhere/p.jar" );
+    a.setMd5( md5 );
+    BOOST_CHECK( a.fetch() );
+    BOOST_CHECK_EQUAL( a.sha256(), sha256 );
+    BOOST_CHECK( depot.requests.empty() );
+
+    // the good peer doesn't have q.jar, so the depot has to help
+    peers.pop_back();
+    peers.front() = "127.0.0.1:" +
+		    boost::lexical_cast<string>( good.listener.port );
+    Fetcher::setPeers( peers );
+    Fetcher b( depotUrl + "/q.jar", d + "/elsewhere/q.jar" );
+    b.setMd5( md5 );
+    BOOST_CHECK( b.fetch() );
+    BOOST_CHECK_EQUAL( b.requests(), 2 );
+    BOOST_CHECK_EQUAL( depot.requests.size(), 1u );
+
+    ::shutdown( good.listener.fd, SHUT_RDWR );
+    ::shutdown( bad.fd, SHUT_RDWR );
+    ::shutdown( depot.fd, SHUT_RDWR );
+    goodServer.join();
+    badServer.join();
+    depotServer.join();
+    ::close( good.listener.fd );
+    ::close( bad.fd );
+    ::close( depot.fd );
+    Fetcher::setPeers( vector<string>() );
+
+    Conf::basedir = basedir;
+    Conf::artefactdir = artefactdir;
+    boost::filesystem::remove_all( d );
+}
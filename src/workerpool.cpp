@@ -0,0 +1,94 @@
+// Copyright Arnt Gulbrandsen <arnt@gulbrandsen.priv.no>; BSD-licensed.
+
+#include "workerpool.h"
+
+#include <boost/bind.hpp>
+
+
+/*! \class WorkerPool workerpool.h
+
+    The WorkerPool class runs jobs on a fixed number of threads.
+
+    Anything that used to start a thread of its own for each piece of
+    work should use a WorkerPool instead: submit() queues a job, and
+    one of the pool's threads picks it up as soon as it's idle. If all
+    threads are busy, the job waits. Nodee thus uses a bounded number
+    of threads no matter how many clients are knocking.
+
+    Jobs may not throw. If one does anyway, the exception is swallowed
+    so that the thread survives to run the next job.
+
+    The threads are started by the constructor and run forever, so a
+    WorkerPool should live as long as nodee does.
+*/
+
+
+/*! Constructs a pool of \a threads threads, all of which start
+    waiting for jobs at once. At least one thread is started.
+*/
+
+WorkerPool::WorkerPool( int threads )
+    : n( threads > 0 ? threads : 1 )
+{
+    int i = 0;
+    while ( i < n ) {
+	boost::thread( boost::bind( &WorkerPool::start, this ) );
+	i++;
+    }
+}
+
+
+/*! Queues \a job for execution by the first idle thread. Returns at
+    once.
+*/
+
+void WorkerPool::submit( const boost::function<void()> & job )
+{
+    boost::lock_guard<boost::mutex> lock( mutex );
+    q.push_back( job );
+    work.notify_one();
+}
+
+
+/*! Returns the number of threads in the pool. */
+
+int WorkerPool::size() const
+{
+    return n;
+}
+
+
+/*! Returns the number of jobs waiting for a thread. Jobs that are
+    running are not counted.
+*/
+
+int WorkerPool::queued() const
+{
+    boost::lock_guard<boost::mutex> lock( mutex );
+    return q.size();
+}
+
+
+/*! Runs jobs until the end of time. Each of the pool's threads runs
+    this function.
+*/
+
+void WorkerPool::start()
+{
+    while ( true ) {
+	boost::function<void()> job;
+	{
+	    boost::unique_lock<boost::mutex> lock( mutex );
+	    while ( q.empty() )
+		work.wait( lock );
+	    job = q.front();
+	    q.pop_front();
+	}
+	try {
+	    job();
+	} catch ( ... ) {
+	    // the job should have handled that itself. we don't know
+	    // how, so we just keep going.
+	}
+    }
+}
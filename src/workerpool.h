@@ -0,0 +1,31 @@
+// Copyright Arnt Gulbrandsen <arnt@gulbrandsen.priv.no>; BSD-licensed.
+
+#ifndef WORKERPOOL_H
+#define WORKERPOOL_H
+
+#include <deque>
+
+#include <boost/function.hpp>
+#include <boost/thread.hpp>
+
+
+class WorkerPool
+{
+public:
+    WorkerPool( int );
+
+    void submit( const boost::function<void()> & );
+
+    int size() const;
+    int queued() const;
+
+    void start();
+
+private:
+    int n;
+    std::deque< boost::function<void()> > q;
+    mutable boost::mutex mutex;
+    boost::condition_variable work;
+};
+
+#endif
@@ -4,6 +4,8 @@
 #include "log.h"
 
 #include "hoststatus.h"
+#include "fetcher.h"
+#include "conf.h"
 
 #include <sysexits.h>
 
@@ -16,6 +18,7 @@
 using namespace std;
 
 #include <boost/thread.hpp>
+#include <boost/lexical_cast.hpp>
 
 static bool initialised;
 static boost::mutex zkmutex; // we don't need it, but we must fill in forms
@@ -56,6 +59,10 @@ static void watcher( zhandle_t * zzh,
     It will kill Nodee if it is unable to keep Zookeeper updated for a
     prolonged period (details rather fluid).
 
+    The other nodees' ephemeral nodes are useful too: ZkClient tells
+    Fetcher about them, so that artifacts can be fetched from other
+    nodees rather than from the depot.
+
     Note that if ZkClient kills Nodee too soon, a Zookeeper restart
     may cause the entire cluster to reboot, as Nodee's reboot watcher
     reboots the host. If that were to happen on same host that runs
@@ -65,7 +72,8 @@ static void watcher( zhandle_t * zzh,
 
 
 /*!  Constructs a Zookeeper client which will connect to zookeeper \a
-     server and update an ephemereal node every two minutes.
+     server and update an ephemereal node every two minutes. \a port
+     is the port this nodee listens to, and presumably the others too.
 
      \a server is in Zookeeper's usual format
      (10.0.10.10:3000,10.1.10.10:3000 or similar).
@@ -73,8 +81,8 @@ static void watcher( zhandle_t * zzh,
      This constructor succeeds or aborts the program via ::exit().
 */
 
-ZkClient::ZkClient( const std::string & server )
-    : zh( 0 )
+ZkClient::ZkClient( const std::string & server, int p )
+    : zh( 0 ), port( p )
 {
     if ( server.empty() ) {
 	info << "nodee: Not connecting to Zookeeper."
@@ -185,6 +193,7 @@ ZkClient::ZkClient( const std::string & server )
 
     // at this point we've created the node and nodee can do its work.
 
+    findPeers();
     boost::thread( *this );
 }
 
@@ -202,7 +211,34 @@ void ZkClient::start()
 	int r = zoo_set( zh, path.c_str(),
 			 status.data(), status.length(),
 			 -1 );
+	findPeers();
+    }
+}
+
+
+/*! Looks for other nodees in Zookeeper and tells Fetcher about them,
+    along with the peers in the configuration. Each nodee has a node
+    called /nodee/hostname.
+*/
+
+void ZkClient::findPeers()
+{
+    struct String_vector children;
+    if ( zoo_get_children( zh, "/nodee", 0, &children ) != ZOK )
+	return;
+
+    vector<string> peers( Conf::peers );
+    string self = path.substr( path.rfind( '/' ) + 1 );
+    int i = 0;
+    while ( i < children.count ) {
+	string host = children.data[i];
+	if ( host != self )
+	    peers.push_back( host + ":" +
+			     boost::lexical_cast<string>( port ) );
+	i++;
     }
+    deallocate_String_vector( &children );
+    Fetcher::setPeers( peers );
 }
 
 
@@ -11,15 +11,18 @@
 class ZkClient: public Process
 {
 public:
-    ZkClient( const std::string & server );
+    ZkClient( const std::string & server, int port );
 
     void operator()();
 
     void start();
 
 private:
+    void findPeers();
+
     zhandle_t * zh;
     std::string path;
+    int port;
 };
 
 #endif